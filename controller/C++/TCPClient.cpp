@@ -1,5 +1,7 @@
 #include "TCPClient.hpp"
 
+#include <cxxabi.h>
+
 namespace C {
 	extern "C" int printf(const char *format, ...);
 }
@@ -10,20 +12,101 @@ TCPClient::Command TCPClient::commands[] = {
 	{ "exit",			&TCPClient::cmd_exit },
 	{ "shutdown",		&TCPClient::cmd_shutdown },
 	{ "use printer",	&TCPClient::cmd_use_printer },
+	{ "monitor",		&TCPClient::cmd_monitor },
+	{ "status",		&TCPClient::cmd_status },
+	{ "set",		&TCPClient::cmd_set },
+	{ "submit job",		&TCPClient::cmd_submit_job },
+	{ "submit file",	&TCPClient::cmd_submit_file },
+	{ "submit pipe",	&TCPClient::cmd_submit_pipe },
+	{ "submit broadcast",	&TCPClient::cmd_submit_broadcast },
+	{ "end job",		&TCPClient::cmd_end_job },
+	{ "ingest",		&TCPClient::cmd_ingest },
+	{ "print",		&TCPClient::cmd_print },
+	{ "analyse",		&TCPClient::cmd_analyse },
+	{ "pools",		&TCPClient::cmd_pools },
+	{ "stats",		&TCPClient::cmd_stats },
+	{ "trace",		&TCPClient::cmd_trace },
 	{ NULL,				NULL }
 };
 
+// clients come and go with every dashboard poll, so they're pooled
+void *TCPClient::operator new(size_t size) {
+	return Pool<TCPClient>::get(size);
+}
+
+void TCPClient::operator delete(void *p, size_t size) {
+	Pool<TCPClient>::put(p, size);
+}
+
 TCPClient::TCPClient(int fd, struct sockaddr *addr) {
 	memcpy(&myaddr, addr, socksize(addr));
 	open(fd);
 	sock2a(addr, description, sizeof(description));
+	keepalive();
+	init();
+	Admission::opened(addr);
+	admitted = 1;
+}
 
+// for subclasses on other kinds of socket, which describe themselves
+TCPClient::TCPClient(int fd) {
+	memset(&myaddr, 0, sizeof(myaddr));
+	open(fd);
+	init();
+}
+
+void TCPClient::init() {
 	state = TCPCLIENT_STATE_CLASSIFY;
 
 	printer = NULL;
+	job = NULL;
+	broadcast = NULL;
+	trusted = 0;
+
+	method = uri = protocol = path = NULL;
+	headers = query = NULL;
+	headertail = &headers;
+	querytail = &query;
+	httpbody = NULL;
+	response = NULL;
+	responselen = responsesent = 0;
+
+	admitted = 0;
+	charged = 0;
+	account();
 }
 
 TCPClient::~TCPClient() {
+	if (admitted)
+		Admission::closed((struct sockaddr *) &myaddr);
+	Admission::charge(-(long) charged);
+}
+
+// tell Admission what our buffers hold now
+void TCPClient::account() {
+	size_t now = txbuf->size() + rxbuf->size() + arena.size();
+	Admission::charge((long) now - (long) charged);
+	charged = now;
+}
+
+void TCPClient::close() {
+	if (_fd == -1)
+		return;
+	TCPSocket::close();
+	// nobody's listening for replies any more
+	std::list<Printer *>::iterator i;
+	for (i = Printer::allprinters.begin(); i != Printer::allprinters.end(); i++)
+		(*i)->forget(this);
+	QueueManager::withdraw(this);
+	job = NULL;
+	// its members delete it as they end, now we're gone
+	if (broadcast && (broadcast->members() == 0))
+		delete broadcast;
+	broadcast = NULL;
+	if (printer)
+		printer->unref();
+	printer = NULL;
+	destroy();
 }
 
 int TCPClient::open(int fd) {
@@ -42,31 +125,57 @@ void TCPClient::onread(struct SelectFd *selected) {
 		// socket closed
 		return;
 	}
-	// now check our rxbuf for tasty lines
+	process();
+}
+
+// handle the lines in rxbuf. a long response holds up the lines after it
+// until it's all in txbuf, so replies stay in order, and a job with no
+// room holds up its line until it unstalls us
+void TCPClient::process() {
 	char linebuf[256];
 	int l;
-	while (rxbuf->numlines() > 0) {
-		l = rxbuf->readline(linebuf, 256);
-		linebuf[l] = 0;
+	while ((rxbuf->numlines() > 0) && (response == NULL) && !stalled) {
+		l = rxbuf->peekline(linebuf, 256);
+		if (l == 0)
+			break;
+		unsigned int span = l;
+		int taken = 1;
 // 		printf("[%d]< ", state); printl(linebuf); printf("\n");
 		switch (state) {
 			case TCPCLIENT_STATE_CLASSIFY: {
 				if (strncmp(linebuf, "GET /", 5) == 0) {
 					state = TCPCLIENT_STATE_HTTPHEADER;
+					setprofile(TCPSOCKET_PROFILE_BULK);
+					arena.reset();
+					headers = query = NULL;
+					headertail = &headers;
+					querytail = &query;
 					char *tok = linebuf;
-					char sep[5] = " \t\r\n";
-					httpdata["method"] = string(strsep(&tok, sep));
-					httpdata["uri"] = string(strsep(&tok, sep));
-					httpdata["protocol"] = string(strsep(&tok, sep));
+					const char *sep = " \t\r\n";
+					char *m = strsep(&tok, sep);
+					char *u = tok ? strsep(&tok, sep) : NULL;
+					char *p = tok ? strsep(&tok, sep) : NULL;
+					method = arena.strndup(m, strlen(m));
+					uri = u ? arena.strndup(u, strlen(u)) : "/";
+					protocol = p ? arena.strndup(p, strlen(p)) : "HTTP/1.0";
+					char *q = index((char *) uri, '?');
+					if (q) {
+						path = arena.strndup(uri, q - uri);
+						parse_query(arena.strndup(q + 1, strlen(q + 1)));
+					}
+					else {
+						path = uri;
+					}
 
 					bodysize = 0;
 					bodyrmn = 0;
 					bodycomplete = 0;
 
-					C::printf("method: %s\nuri: %s\nprotocol: %s\n", httpdata["method"].c_str(), httpdata["uri"].c_str(), httpdata["protocol"].c_str());
+					C::printf("method: %s\nuri: %s\nprotocol: %s\n", method, uri, protocol);
 				}
 				else {
-					process_netrap_request(linebuf, l);
+					setprofile(TCPSOCKET_PROFILE_INTERACTIVE);
+					taken = process_netrap_request(linebuf, l);
 				}
 				break;
 			}
@@ -77,7 +186,7 @@ void TCPClient::onread(struct SelectFd *selected) {
 					if (bodysize > 0) {
 						state = TCPCLIENT_STATE_HTTPBODY;
 						bodyrmn = bodysize;
-						httpbody = (char *) malloc(bodyrmn + 1);
+						httpbody = (char *) arena.alloc(bodyrmn + 1);
 					}
 					else {
 // 						state = TCPCLIENT_STATE_CLASSIFY;
@@ -90,13 +199,22 @@ void TCPClient::onread(struct SelectFd *selected) {
 						*value = 0;
 						do {
 							value++;
-						} while (index(" \t\r\n", *value) > NULL);
+						} while (*value && index(" \t\r\n", *value) != NULL);
 						do {
 							l--;
 						} while(linebuf[l] < 32);
 						linebuf[++l] = 0;
 
-						httpdata[string(linebuf)] = string(value);
+						HttpField *f = (HttpField *) arena.alloc(sizeof(HttpField));
+						f->name = arena.strndup(linebuf, strlen(linebuf));
+						f->value = arena.strndup(value, strlen(value));
+						f->next = NULL;
+						*headertail = f;
+						headertail = &f->next;
+
+						account();
+						if ((arena.used() > TCPCLIENT_MAXREQUEST) || Admission::overbudget())
+							refuse_http();
 // 						printf("Added %s = %s to metadata\n", linebuf, value);
 					}
 				}
@@ -108,16 +226,18 @@ void TCPClient::onread(struct SelectFd *selected) {
 				bodycomplete += l;
 				if (bodyrmn <= 0) {
 					process_http_request();
-					free(httpbody);
 					httpbody = NULL;
 // 					state = TCPCLIENT_STATE_CLASSIFY;
 				}
 				break;
 			}
 		}
+		if (!taken)
+			break;
+		rxbuf->skip(span);
 	}
 // 	printf("freed %d bytes in rxbuf\n", rxbuf->canwrite());
-	if ((rxbuf->canwrite() > 0) && (_fd >= 0)) {
+	if ((rxbuf->canwrite() > 0) && (_fd >= 0) && !stalled) {
 		selector[_fd]->poll |= POLL_READ;
 // 		printf("re-enabled onread as we have %d clear\n", rxbuf->canwrite());
 	}
@@ -125,8 +245,19 @@ void TCPClient::onread(struct SelectFd *selected) {
 
 void TCPClient::onwrite(struct SelectFd *selected) {
 	TCPSocket::onwrite(selected);
+	if (response) {
+		send_response();
+		if ((response == NULL) && (state != TCPCLIENT_STATE_CLOSING))
+			process();
+	}
+	else if (!stalled && (rxbuf->numlines() > 0) && (state != TCPCLIENT_STATE_CLOSING)) {
+		// unstalled with lines still waiting
+		process();
+	}
 	if (state == TCPCLIENT_STATE_CLOSING) {
-		if (txbuf->canread() == 0) {
+		if ((txbuf->canread() == 0) && (response == NULL)) {
+			// the response is all written, let the last of it go
+			flush();
 			selector.remove(_fd);
 			close();
 		}
@@ -137,41 +268,216 @@ void TCPClient::onerror(struct SelectFd *selected) {
 	TCPSocket::onerror(selected);
 }
 
-void TCPClient::process_http_request() {
-	C::printf("Processing %s request for %s\n", httpdata["method"].c_str(), httpdata["uri"].c_str());
-	char writebuf[256];
-	char *wp = writebuf;
-	wp += snprintf(wp, (writebuf + 256 - wp), "%s 200 OK\r\nConnection: close\r\nContent-Type: text/plain\r\n\r\n", httpdata["protocol"].c_str());
-	write(string(writebuf)); wp = writebuf;
+const char *TCPClient::header(const char *name) {
+	for (HttpField *f = headers; f; f = f->next) {
+		if (strcasecmp(f->name, name) == 0)
+			return f->value;
+	}
+	return NULL;
+}
+
+const char *TCPClient::param(const char *name) {
+	for (HttpField *f = query; f; f = f->next) {
+		if (strcmp(f->name, name) == 0)
+			return f->value;
+	}
+	return NULL;
+}
+
+static int unhex(char c) {
+	if ((c >= '0') && (c <= '9'))
+		return c - '0';
+	c |= 0x20;
+	if ((c >= 'a') && (c <= 'f'))
+		return c - 'a' + 10;
+	return -1;
+}
+
+// url decode in place
+static void urldecode(char *s) {
+	char *d = s;
+	for (; *s; s++) {
+		if (*s == '+') {
+			*d++ = ' ';
+		}
+		else if ((*s == '%') && (unhex(s[1]) >= 0) && (unhex(s[2]) >= 0)) {
+			*d++ = (unhex(s[1]) << 4) | unhex(s[2]);
+			s += 2;
+		}
+		else {
+			*d++ = *s;
+		}
+	}
+	*d = 0;
+}
+
+// split name=value&... into the query list, the strings stay where they are
+void TCPClient::parse_query(char *q) {
+	char *pair;
+	while ((pair = strsep(&q, "&")) != NULL) {
+		if (*pair == 0)
+			continue;
+		char *value = index(pair, '=');
+		if (value)
+			*value++ = 0;
+		else
+			value = pair + strlen(pair);
+		urldecode(pair);
+		urldecode(value);
+		HttpField *f = (HttpField *) arena.alloc(sizeof(HttpField));
+		f->name = pair;
+		f->value = value;
+		f->next = NULL;
+		*querytail = f;
+		querytail = &f->next;
+	}
+}
+
+void TCPClient::http_text(ArenaText *out) {
 	C::printf("Headers:\n");
-	write(string("Headers:\n"));
-	std::map<string, string>::iterator i;
-	for (i=httpdata.begin(); i != httpdata.end(); i++) {
-		C::printf("\t%s:\t%s\n", (*i).first.c_str(), (*i).second.c_str());
-		wp += snprintf(wp, (writebuf + 256 - wp), "\t%s:\t%s\n", (*i).first.c_str(), (*i).second.c_str());
-		write(string(writebuf)); wp = writebuf;
+	out->append("Headers:\n");
+	out->printf("\tmethod:\t%s\n\turi:\t%s\n\tprotocol:\t%s\n", method, uri, protocol);
+	for (HttpField *f = headers; f; f = f->next) {
+		C::printf("\t%s:\t%s\n", f->name, f->value);
+		out->printf("\t%s:\t%s\n", f->name, f->value);
+	}
+}
+
+void TCPClient::http_json(ArenaText *out) {
+	out->append("{\"method\":");
+	out->json(method);
+	out->append(",\"uri\":");
+	out->json(uri);
+	out->append(",\"path\":");
+	out->json(path);
+	out->append(",\"protocol\":");
+	out->json(protocol);
+	out->append(",\"query\":{");
+	for (HttpField *f = query; f; f = f->next) {
+		out->json(f->name);
+		out->append(":", 1);
+		out->json(f->value);
+		if (f->next)
+			out->append(",", 1);
+	}
+	out->append("},\"headers\":{");
+	for (HttpField *f = headers; f; f = f->next) {
+		out->json(f->name);
+		out->append(":", 1);
+		out->json(f->value);
+		if (f->next)
+			out->append(",", 1);
+	}
+	out->append("}}\n");
+}
+
+void TCPClient::process_http_request() {
+	C::printf("Processing %s request for %s\n", method, uri);
+	const char *format = param("format");
+	const char *accept = header("Accept");
+	int json = (format && (strcmp(format, "json") == 0)) || (!format && accept && strstr(accept, "application/json"));
+
+	// the whole response is built in the arena, then trickled into txbuf
+	ArenaText out(&arena);
+	if (strcmp(path, "/metrics") == 0) {
+		out.printf("%s 200 OK\r\nConnection: close\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n", protocol);
+		Metrics::prometheus(&out);
+	}
+	else {
+		out.printf("%s 200 OK\r\nConnection: close\r\nContent-Type: %s\r\n\r\n", protocol, json ? "application/json" : "text/plain");
+		if (json)
+			http_json(&out);
+		else
+			http_text(&out);
 	}
+	response = out.data();
+	responselen = out.length();
+	responsesent = 0;
+	account();
+	send_response();
 	state = TCPCLIENT_STATE_CLOSING;
-// 	close();
-// 	selector.remove(_fd);
 }
 
-void TCPClient::process_netrap_request(const char *line, int len) {
+// more than we'll hold for one request, or than all clients together may
+void TCPClient::refuse_http() {
+	static const char busy[] = "HTTP/1.0 503 Service Unavailable\r\nConnection: close\r\nRetry-After: 5\r\n\r\n";
+	C::printf("Refusing request from %s, %lu bytes buffered\n", toString(), (unsigned long) Admission::buffered);
+	arena.reset();
+	headers = query = NULL;
+	headertail = &headers;
+	querytail = &query;
+	response = busy;
+	responselen = sizeof(busy) - 1;
+	responsesent = 0;
+	send_response();
+	state = TCPCLIENT_STATE_CLOSING;
+}
+
+void TCPClient::send_response() {
+	size_t n = responselen - responsesent;
+	if (n > txbuf->canwrite())
+		n = txbuf->canwrite();
+	if (n)
+		responsesent += write(&response[responsesent], n);
+	if (responsesent >= responselen) {
+		// the request is answered, its memory can go
+		response = NULL;
+		arena.reset();
+		account();
+	}
+}
+
+/*
+ * lines already in rxbuf won't wake select() for reading, so ask to hear
+ * when we can write instead, which is almost always, and carry on from
+ * onwrite(). processing them here could feed a printer from inside its
+ * own feed()
+ */
+void TCPClient::unstall() {
+	TCPSocket::unstall();
+	if ((_fd >= 0) && (rxbuf->numlines() > 0))
+		selector[_fd]->poll |= POLL_WRITE;
+}
+
+// returns 0 if the line has to wait for room in a job, and stay in rxbuf
+int TCPClient::process_netrap_request(const char *line, int len) {
 	int i = 0;
 	const char *cmd;
 	void (TCPClient::*func)(const char *line, int cmd);
+	// the printer in use may have been unplugged since
+	if (printer && printer->destroyed()) {
+		printer->unref();
+		printer = NULL;
+	}
 	for (i = 0; commands[i].command != NULL; i++) {
 		cmd = commands[i].command;
 		func = commands[i].func;
 		if (strncmp(line, cmd, strlen(cmd)) == 0) {
 			(this->*func)(line, len);
-			return;
+			return 1;
 		}
 	}
-	// not a command- check if we have a printer
-	if (printer != NULL) {
-		printer->write(this, line, len);
+	// not a command- check if we're streaming a job or have a printer
+	int r = 1;
+	if (broadcast != NULL) {
+		r = broadcast->write(line, len);
+		broadcast->feed();
+	}
+	else if (job != NULL) {
+		r = job->write(line, len);
+		if (job->printer)
+			job->printer->feed();
+	}
+	else if (printer != NULL) {
+		r = printer->write(this, line, len);
 	}
+	if (r < 0) {
+		write("Line too long, dropped\n");
+		return 1;
+	}
+	if ((r == 0) && !stalled)
+		stall();
+	return r > 0;
 }
 
 void TCPClient::process_gcode_request(const char *line, int len) {
@@ -207,8 +513,23 @@ void TCPClient::cmd_list_printers(const char *line, int len) {
 	}
 }
 
+// add printer [<port> [baud]]
 void TCPClient::cmd_add_printer(const char *line, int len) {
-	Printer *p = new Printer();
+	char port[256];
+	int baud = 115200;
+	Printer *p;
+	if (sscanf(line + 11, "%255s %d", port, &baud) >= 1) {
+		p = new Printer(port, baud);
+		if (p->opened() < 0) {
+			printf("Could not open %s\n", port);
+			delete p;
+			return;
+		}
+		QueueManager::dispatch();
+	}
+	else {
+		p = new Printer();
+	}
 	printf("Printer \"%s\" created\n", p->name());
 }
 
@@ -225,10 +546,331 @@ void TCPClient::cmd_use_printer(const char *line, int len) {
 // 		printf("Checking \"%s\"\n", (*i)->name());
 		if (strncmp(name, (*i)->name(), l) == 0) {
 // 			printf("Match!\n");
+			// held, so it can't be freed under us if it's unplugged
+			if (printer)
+				printer->unref();
 			printer = (*i);
-			return;
+			printer->ref();
+			break;
 		}
 	}
+	free(name);
+}
+
+// copy every reply from the printer in use to this client
+void TCPClient::cmd_monitor(const char *line, int len) {
+	if (printer == NULL) {
+		write("No printer in use\n");
+		return;
+	}
+	printer->monitor(this);
+}
+
+// state of the printer in use, and how far along its jobs are
+void TCPClient::cmd_status(const char *line, int len) {
+	if (printer == NULL) {
+		write("No printer in use\n");
+		return;
+	}
+	printer->status(this);
+}
+
+// set <capability> <value>, on the printer in use
+void TCPClient::cmd_set(const char *line, int len) {
+	char capability[64], value[128];
+	if (printer == NULL) {
+		write("No printer in use\n");
+		return;
+	}
+	if (sscanf(line + 3, "%63s %127s", capability, value) != 2) {
+		write("Usage: set <capability> <value>\n");
+		return;
+	}
+	printer->setCapability(capability, value);
+	printf("%s set to %s\n", capability, value);
+}
+
+/*
+ * parse "key=value ..." job arguments following a command. with filters
+ * set, these add filters to the job:
+ *	feedrate=<percent> maxtemp=<hotend C> maxbed=<bed C> zoffset=<mm> strip=on
+ */
+static void parse_job_args(const char *line, int len, int skip, Job *job, int filters = 0) {
+	float maxtemp = 0, maxbed = 0;
+	char *args = (char *) malloc(len + 1);
+	memcpy(args, line, len);
+	args[len] = 0;
+	char *tok = args + skip;
+	char *word;
+	while ((word = strsep(&tok, " \t\r\n")) != NULL) {
+		char *value = index(word, '=');
+		if (value == NULL)
+			continue;
+		*value++ = 0;
+		if (strcmp(word, "printer") == 0)
+			job->group = value;
+		else if (strcmp(word, "priority") == 0)
+			job->priority = (strcmp(value, "bulk") == 0) ? JOB_PRIORITY_BULK : JOB_PRIORITY_NORMAL;
+		else if (filters && (strcmp(word, "feedrate") == 0))
+			job->addFilter(new FeedrateFilter(atof(value)));
+		else if (filters && (strcmp(word, "zoffset") == 0))
+			job->addFilter(new ZOffsetFilter(atof(value)));
+		else if (filters && (strcmp(word, "maxtemp") == 0))
+			maxtemp = atof(value);
+		else if (filters && (strcmp(word, "maxbed") == 0))
+			maxbed = atof(value);
+		else if (filters && (strcmp(word, "strip") == 0) && (strcmp(value, "on") == 0))
+			job->addFilter(new StripFilter());
+		else
+			job->requirements[word] = value;
+	}
+	free(args);
+	if (maxtemp || maxbed)
+		job->addFilter(new TemperatureFilter(maxtemp ? maxtemp : 1000, maxbed ? maxbed : 1000));
+}
+
+/*
+ * submit job [printer=<name|group>] [priority=bulk|normal] [filter=value ...] [capability=value ...]
+ *
+ * following lines up to "end job" are a print, which is queued until a
+ * compatible printer is idle
+ */
+void TCPClient::cmd_submit_job(const char *line, int len) {
+	if ((job != NULL) || (broadcast != NULL)) {
+		write("Already submitting a job\n");
+		return;
+	}
+	job = new Job(this, JOB_PRIORITY_NORMAL);
+	parse_job_args(line, len, 10, job, 1);
+
+	QueueManager::submit(job);
+	printf("Job %p submitted\n", job);
+}
+
+/*
+ * submit file <gcode file> [printer=<name|group>] [priority=bulk|normal] [filter=value ...] [capability=value ...]
+ *
+ * queue a print streamed from a file the controller can read
+ */
+void TCPClient::cmd_submit_file(const char *line, int len) {
+	char path[256];
+	int skip;
+	if (sscanf(line + 11, "%255s%n", path, &skip) != 1) {
+		write("Usage: submit file <gcode file> [job options]\n");
+		return;
+	}
+	FileSocket *file = new FileSocket();
+	if (file->open(path) < 0) {
+		delete file;
+		printf("Could not open %s\n", path);
+		return;
+	}
+	parse_job_args(line, len, 11 + skip, file->job, 1);
+
+	QueueManager::submit(file->job);
+	printf("Job %p submitted from %s\n", file->job, path);
+}
+
+/*
+ * submit pipe <fifo> [spool=<file>] [printer=<name|group>] [priority=bulk|normal] [filter=value ...] [capability=value ...]
+ *
+ * queue a print streamed in through a named pipe, eg. from a slicer,
+ * keeping a copy in the spool file if given
+ */
+void TCPClient::cmd_submit_pipe(const char *line, int len) {
+	char path[256];
+	int skip;
+	if (sscanf(line + 11, "%255s%n", path, &skip) != 1) {
+		write("Usage: submit pipe <fifo> [spool=<file>] [job options]\n");
+		return;
+	}
+	char spool[256] = "";
+	const char *s = strstr(line + 11 + skip, "spool=");
+	if (s)
+		sscanf(s + 6, "%255s", spool);
+
+	PipeSocket *pipe = new PipeSocket();
+	if (pipe->open(path, spool[0] ? spool : NULL) < 0) {
+		delete pipe;
+		printf("Could not open %s\n", path);
+		return;
+	}
+	parse_job_args(line, len, 11 + skip, pipe->job, 1);
+	pipe->job->requirements.erase("spool");
+
+	QueueManager::submit(pipe->job);
+	printf("Job %p submitted from %s\n", pipe->job, path);
+}
+
+/*
+ * submit broadcast [printer=<group>] [priority=bulk|normal] [capability=value ...]
+ *
+ * like submit job, but the print is streamed to every idle printer which
+ * matches, all at once
+ */
+void TCPClient::cmd_submit_broadcast(const char *line, int len) {
+	if ((job != NULL) || (broadcast != NULL)) {
+		write("Already submitting a job\n");
+		return;
+	}
+	Job args(this, JOB_PRIORITY_NORMAL, 0);
+	parse_job_args(line, len, 16, &args);
+
+	broadcast = new Broadcast(this);
+	int n = broadcast->start(args.group, args.requirements, args.priority);
+	if (n == 0) {
+		delete broadcast;
+		broadcast = NULL;
+		write("No idle printers match\n");
+		return;
+	}
+	printf("Broadcast %p submitted to %d printers\n", broadcast, n);
+}
+
+void TCPClient::cmd_end_job(const char *line, int len) {
+	if (broadcast != NULL) {
+		Broadcast *b = broadcast;
+		broadcast = NULL;
+		// the last member deletes it once it's finished, unless there's
+		// none left
+		if (b->members() == 0)
+			delete b;
+		else
+			b->finish();
+		return;
+	}
+	if (job == NULL)
+		return;
+	job->finish();
+	if (job->printer)
+		job->printer->feed();
+	job = NULL;
+}
+
+// ingest <gcode file> <image file>, timed for the printer in use. the
+// answer follows once a worker thread has done it
+void TCPClient::cmd_ingest(const char *line, int len) {
+	char source[256], image[256];
+	if (sscanf(line + 6, "%255s %255s", source, image) != 2) {
+		write("Usage: ingest <gcode file> <image file>\n");
+		return;
+	}
+	MotionLimits limits;
+	if (printer)
+		printer->motionlimits(&limits);
+	else
+		motionlimits_init(&limits);
+	WorkerPool::shared()->submit(new GcodeImageIngest(this, source, image, &limits));
+}
+
+/*
+ * print <image file> [line=<n>|layer=<n>] [printer=<name|group>] [priority=bulk|normal] [capability=value ...]
+ *
+ * queue an ingested print. it plays straight from the image, and keeps
+ * going if this client disconnects. line or layer resume a failed print
+ * there, after reheating and restoring positions
+ */
+void TCPClient::cmd_print(const char *line, int len) {
+	char path[256];
+	int skip;
+	if (sscanf(line + 5, "%255s%n", path, &skip) != 1) {
+		write("Usage: print <image file> [job options]\n");
+		return;
+	}
+	GcodeImage *image = new GcodeImage();
+	if (image->open(path) < 0) {
+		delete image;
+		printf("Could not open %s\n", path);
+		return;
+	}
+	GcodeImageJob *print = new GcodeImageJob(this, image, JOB_PRIORITY_NORMAL);
+	parse_job_args(line, len, 5 + skip, print);
+
+	std::map<string, string>::iterator r;
+	uint64_t from = 0;
+	if ((r = print->requirements.find("line")) != print->requirements.end()) {
+		from = strtoull(r->second.c_str(), NULL, 10);
+		print->requirements.erase(r);
+	}
+	if ((r = print->requirements.find("layer")) != print->requirements.end()) {
+		from = image->layerline(atoi(r->second.c_str()));
+		print->requirements.erase(r);
+	}
+	if (from >= print->length()) {
+		delete print;
+		write("No such line or layer\n");
+		return;
+	}
+	if (from > 0)
+		print->resume(from);
+
+	QueueManager::submit(print);
+	printf("Job %p submitted, %llu lines, %u layers, %.1fmm of filament\n", print, (unsigned long long) (print->length() - print->tell()), image->layers(), image->extruded());
+}
+
+/*
+ * analyse <gcode file>
+ *
+ * the results follow later, once the worker threads are done
+ */
+void TCPClient::cmd_analyse(const char *line, int len) {
+	char path[256];
+	if (sscanf(line + 7, "%255s", path) != 1) {
+		write("Usage: analyse <gcode file>\n");
+		return;
+	}
+	Analysis *a = new Analysis(this);
+	if (printer)
+		printer->motionlimits(&a->limits);
+	if (a->start(path) < 0) {
+		delete a;
+		printf("Could not analyse %s\n", path);
+	}
+}
+
+// counters, gauges and latency percentiles from the Metrics registry
+void TCPClient::cmd_stats(const char *line, int len) {
+	ArenaText out(&arena);
+	Metrics::summary(&out);
+	out.append("--end of stats--\n");
+	response = out.data();
+	responselen = out.length();
+	responsesent = 0;
+	account();
+	send_response();
+}
+
+// line timings for the printer in use
+void TCPClient::cmd_trace(const char *line, int len) {
+	if (printer == NULL) {
+		write("No printer in use\n");
+		return;
+	}
+	ArenaText out(&arena);
+	printer->trace(&out);
+	out.append("--end of trace--\n");
+	response = out.data();
+	responselen = out.length();
+	responsesent = 0;
+	account();
+	send_response();
+}
+
+/*
+ * pools
+ *
+ * what the object pools and buffer arena have handed out. heap counts
+ * requests they passed on to malloc
+ */
+void TCPClient::cmd_pools(const char *line, int len) {
+	std::list<PoolCounters *>::iterator i;
+	for (i = PoolCounters::all().begin(); i != PoolCounters::all().end(); i++) {
+		PoolCounters *c = *i;
+		char *name = abi::__cxa_demangle(c->name, NULL, NULL, NULL);
+		printf("%s: %lu allocs, %lu frees, %lu live, %lu slabs, %lu heap\n", name ? name : c->name, c->allocs, c->frees, c->allocs - c->frees, c->slabs, c->heap);
+		free(name);
+	}
+	write("--end of pools--\n");
 }
 
 void TCPClient::cmd_exit(const char *line, int len) {
@@ -236,6 +878,23 @@ void TCPClient::cmd_exit(const char *line, int len) {
 	write("Goodbye\n");
 }
 
+/*
+ * shutdown [password]
+ *
+ * trusted clients need no password. anyone else must give the one in
+ * NETRAP_PASSWORD, and can't shut us down at all if it isn't set
+ */
 void TCPClient::cmd_shutdown(const char *line, int len) {
+	if (!trusted) {
+		const char *password = getenv("NETRAP_PASSWORD");
+		char given[128] = "";
+		sscanf(line + 8, "%127s", given);
+		if ((password == NULL) || (password[0] == 0) || (strcmp(given, password) != 0)) {
+			C::printf("Refused shutdown from %s\n", toString());
+			write("Not authorised\n");
+			return;
+		}
+	}
+	C::printf("Shutdown by %s\n", toString());
 	exit(0);
 }
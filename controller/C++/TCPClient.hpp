@@ -2,10 +2,20 @@
 #define	_TCPCLIENT_HPP
 
 #include <string>
-#include <map>
 
 #include "TCPSocket.hpp"
+#include "arena.hpp"
+#include "admission.hpp"
+#include "metrics.hpp"
+
+// an http request whose headers take more arena than this is turned away
+#define TCPCLIENT_MAXREQUEST 16384
 #include "printer.hpp"
+#include "broadcast.hpp"
+#include "gcodeimage.hpp"
+#include "analysis.hpp"
+#include "socket-file.hpp"
+#include "socket-pipe.hpp"
 
 class TCPClient;
 
@@ -15,12 +25,51 @@ public:
 	~TCPClient();
 
 	int open(int fd);
+	// a client is done with once it closes, and destroys itself
+	void close();
+	void unstall();
+
+	static void *operator new(size_t size);
+	static void operator delete(void *p, size_t size);
 protected:
+	TCPClient(int fd);
+	void init();
+
 	void onread(struct SelectFd *selected);
 	void onwrite(struct SelectFd *selected);
 	void onerror(struct SelectFd *selected);
-
-	std::map<string, string> httpdata;
+	void process();
+
+	// everything about the current http request lives in the arena, and
+	// goes when it's answered
+	Arena arena;
+	struct HttpField {
+		const char *name;
+		const char *value;
+		HttpField *next;
+	};
+	const char *method;
+	const char *uri;
+	const char *protocol;
+	const char *path;
+	HttpField *headers, **headertail;
+	HttpField *query, **querytail;
+	const char *header(const char *name);
+	const char *param(const char *name);
+	void parse_query(char *q);
+
+	// the response, fed to txbuf as it drains
+	const char *response;
+	size_t responselen;
+	size_t responsesent;
+	void send_response();
+	void refuse_http();
+
+	// counted against the Admission caps. only network clients are
+	int admitted;
+	// buffer bytes charged to Admission
+	size_t charged;
+	void account();
 
 #define TCPCLIENT_STATE_CLASSIFY 0
 #define TCPCLIENT_STATE_CLOSING 1
@@ -35,9 +84,15 @@ protected:
 	char *httpbody;
 
 	Printer *printer;
+	Job *job;
+	Broadcast *broadcast;
+	// may run privileged commands, eg. shutdown, without a password
+	int trusted;
 
 	void process_http_request();
-	void process_netrap_request(const char *line, int len);
+	void http_text(ArenaText *out);
+	void http_json(ArenaText *out);
+	int process_netrap_request(const char *line, int len);
 	void process_gcode_request(const char *line, int len);
 
 	int printl(const char *str);
@@ -52,6 +107,20 @@ protected:
 	void cmd_list_printers(const char *line, int len);
 	void cmd_add_printer(const char *line, int len);
 	void cmd_use_printer(const char *line, int len);
+	void cmd_monitor(const char *line, int len);
+	void cmd_status(const char *line, int len);
+	void cmd_set(const char *line, int len);
+	void cmd_submit_job(const char *line, int len);
+	void cmd_submit_file(const char *line, int len);
+	void cmd_submit_pipe(const char *line, int len);
+	void cmd_submit_broadcast(const char *line, int len);
+	void cmd_end_job(const char *line, int len);
+	void cmd_ingest(const char *line, int len);
+	void cmd_print(const char *line, int len);
+	void cmd_analyse(const char *line, int len);
+	void cmd_pools(const char *line, int len);
+	void cmd_stats(const char *line, int len);
+	void cmd_trace(const char *line, int len);
 	void cmd_exit(const char *line, int len);
 	void cmd_shutdown(const char *line, int len);
 };
@@ -1,15 +1,17 @@
 #include "TCPListen.hpp"
 
 #include <sys/select.h>
+#include <cerrno>
 
 #include "TCPClient.hpp"
+#include "admission.hpp"
 
 namespace C {
 	int clisten(int sockfd, int backlog) {
 		return listen(sockfd, backlog);
 	}
-	int caccept(int sockfd, struct sockaddr *addr, socklen_t *addrlen) {
-		return accept(sockfd, addr, addrlen);
+	int caccept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags) {
+		return accept4(sockfd, addr, addrlen, flags);
 	}
 }
 
@@ -17,8 +19,8 @@ TCPListen::TCPListen() {
 	listenfd.clear();
 }
 
-TCPListen::TCPListen(uint16_t port) {
-	listen(port);
+TCPListen::TCPListen(uint16_t port, int flags) {
+	listen(port, flags);
 }
 
 TCPListen::~TCPListen() {
@@ -74,7 +76,12 @@ int sock2a(void *address, char *buffer, int length) {
 	}
 }
 
-int TCPListen::listen(uint16_t port) {
+/*
+ * REUSEPORT lets several listeners bind the same port, each with its own
+ * accept queue, and the kernel spreads new connections over them- one per
+ * event loop, if there's ever more than one
+ */
+int TCPListen::listen(uint16_t port, int flags) {
 	struct addrinfo hints;
 	struct addrinfo *result, *rp;
 	int s;
@@ -103,7 +110,7 @@ int TCPListen::listen(uint16_t port) {
 		memcpy(&listenaddr, rp->ai_addr, rp->ai_addrlen);
 		memcpy(addr, rp->ai_addr, rp->ai_addrlen);
 
-		int fd = socket(rp->ai_family, SOCK_STREAM, IPPROTO_TCP);
+		int fd = socket(rp->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
 
 		int yes = 1;
 		if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
@@ -111,6 +118,11 @@ int TCPListen::listen(uint16_t port) {
 			exit(1);
 		}
 
+		if ((flags & TCPLISTEN_REUSEPORT) && (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1)) {
+			perror("setsockopt");
+			exit(1);
+		}
+
 		if (rp->ai_family == AF_INET6) {
 			if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &yes, sizeof(int)) == -1) {
 				perror("setsockopt");
@@ -161,21 +173,29 @@ int TCPListen::waiting() {
 	return select(fdmax, &testread, NULL, &testread, &timeout);
 }
 
+// take every connection that's waiting, so a burst doesn't cost a loop each
 void TCPListen::onread(struct SelectFd *selected) {
-	socklen_t size = socksize((struct sockaddr *) selected->data);
-	int newfd = C::caccept(selected->fd, (struct sockaddr *) selected->data, &size);
-
-// 	char buf[64];
-// 	sock2a(selected->data, buf, 64);
-// 	printf("New connection from %s (%d/", buf, newfd);
+	for (;;) {
+		struct sockaddr_storage addr;
+		socklen_t size = sizeof(addr);
+		int newfd = C::caccept4(selected->fd, (struct sockaddr *) &addr, &size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (newfd == -1) {
+			if ((errno == EINTR) || (errno == ECONNABORTED))
+				continue;
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+				perror("accept4");
+			return;
+		}
 
-// 	Socket *newsock = new Socket();
-// 	newsock->open(newfd);
-	TCPClient *newsock = new TCPClient(newfd, (struct sockaddr *) selected->data);
+		if (!Admission::admit(newfd, (struct sockaddr *) &addr)) {
+			Admission::refuse(newfd);
+			continue;
+		}
 
-	printf("New connection from %s (%d)\n", newsock->toString(), newfd);
+		TCPClient *newsock = new TCPClient(newfd, (struct sockaddr *) &addr);
 
-// 	printf("%p)\n", newsock);
+		printf("New connection from %s (%d)\n", newsock->toString(), newfd);
+	}
 }
 
 void TCPListen::onwrite(struct SelectFd *selected) {
@@ -208,7 +228,9 @@ Socket *TCPListen::accept() {
 				break;
 			}
 		}
-		int newfd = C::caccept(fd, (struct sockaddr *)&addr, &addrsize);
+		int newfd = C::caccept4(fd, (struct sockaddr *)&addr, &addrsize, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (newfd == -1)
+			return NULL;
 
 		Socket *newsock = new Socket();
 		newsock->open(newfd);
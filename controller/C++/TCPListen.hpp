@@ -21,13 +21,15 @@ int socksize(struct sockaddr *address);
 uint16_t sockport(void *address);
 int sock2a(void *address, char *buffer, int length);
 
+#define TCPLISTEN_REUSEPORT 1
+
 class TCPListen : public SelectorEventReceiver {
 public:
 	TCPListen();
-	TCPListen(uint16_t port);
+	TCPListen(uint16_t port, int flags = 0);
 	~TCPListen();
 
-	int listen(uint16_t port);
+	int listen(uint16_t port, int flags = 0);
 	int waiting();
 	Socket *accept();
 	uint16_t port();
@@ -1,12 +1,16 @@
 #include "TCPSocket.hpp"
 
 TCPSocket::TCPSocket() {
+	memset(&myaddr, 0, sizeof(myaddr));
+	profile = TCPSOCKET_PROFILE_NONE;
 }
 
 TCPSocket::TCPSocket(int fd, struct sockaddr *addr) {
 	memcpy(&myaddr, addr, socksize(addr));
+	profile = TCPSOCKET_PROFILE_NONE;
 	open(fd);
 	sock2a(addr, description, sizeof(description));
+	keepalive();
 }
 
 TCPSocket::~TCPSocket() {
@@ -21,8 +25,54 @@ int TCPSocket::open(int fd) {
 	return 1;
 }
 
+// subclasses may be on other kinds of socket, which take no TCP options
+int TCPSocket::istcp() {
+	return (_fd >= 0) && ((myaddr.ss_family == AF_INET) || (myaddr.ss_family == AF_INET6));
+}
+
+// notice peers which have gone away without a word, eg. a closed laptop
+void TCPSocket::keepalive() {
+	if (!istcp())
+		return;
+	int yes = 1;
+	int idle = TCPSOCKET_KEEPIDLE, interval = TCPSOCKET_KEEPINTVL, count = TCPSOCKET_KEEPCNT;
+	unsigned int timeout = TCPSOCKET_USER_TIMEOUT;
+	if ((setsockopt(_fd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes)) == -1) ||
+		(setsockopt(_fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) == -1) ||
+		(setsockopt(_fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) == -1) ||
+		(setsockopt(_fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count)) == -1) ||
+		(setsockopt(_fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout)) == -1))
+		perror("setsockopt");
+}
+
+void TCPSocket::setprofile(int profile) {
+	if ((profile == this->profile) || !istcp())
+		return;
+	int on = (profile == TCPSOCKET_PROFILE_INTERACTIVE) ? 1 : 0;
+	int cork = (profile == TCPSOCKET_PROFILE_BULK) ? 1 : 0;
+	if ((setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1) ||
+		(setsockopt(_fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on)) == -1) ||
+		(setsockopt(_fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork)) == -1))
+		perror("setsockopt");
+	this->profile = profile;
+}
+
+// send what's corked now rather than waiting for a full segment
+void TCPSocket::flush() {
+	if ((profile != TCPSOCKET_PROFILE_BULK) || !istcp())
+		return;
+	int off = 0, on = 1;
+	setsockopt(_fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+	setsockopt(_fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
 void TCPSocket::onread(struct SelectFd *selected) {
 	Socket::onread(selected);
+	// the kernel drops back to delayed acks by itself, so ask again
+	if ((profile == TCPSOCKET_PROFILE_INTERACTIVE) && (_fd >= 0)) {
+		int on = 1;
+		setsockopt(_fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+	}
 }
 
 void TCPSocket::onwrite(struct SelectFd *selected) {
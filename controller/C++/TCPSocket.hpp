@@ -4,6 +4,23 @@
 #include "socket.hpp"
 #include "TCPListen.hpp"
 
+/*
+ * INTERACTIVE: short commands and replies, eg. jogging- no Nagle delay,
+ *	and acks go straight back
+ * BULK: whole responses- corked, so they go out in full segments, and
+ *	flush()ed once each response is complete
+ */
+#define TCPSOCKET_PROFILE_NONE        0
+#define TCPSOCKET_PROFILE_INTERACTIVE 1
+#define TCPSOCKET_PROFILE_BULK        2
+
+// a peer that stops acking is dropped after this long, ms
+#define TCPSOCKET_USER_TIMEOUT 30000
+// and an idle one is probed after KEEPIDLE s, every KEEPINTVL s, KEEPCNT times
+#define TCPSOCKET_KEEPIDLE  60
+#define TCPSOCKET_KEEPINTVL 10
+#define TCPSOCKET_KEEPCNT   3
+
 class TCPSocket : public Socket {
 public:
 	TCPSocket();
@@ -11,8 +28,15 @@ public:
 	~TCPSocket();
 
 	int open(int fd);
+
+	void setprofile(int profile);
+	void flush();
 protected:
 	struct sockaddr_storage myaddr;
+	int profile;
+
+	int istcp();
+	void keepalive();
 
 	void onread(struct SelectFd *selected);
 	void onwrite(struct SelectFd *selected);
@@ -0,0 +1,37 @@
+#include "UnixClient.hpp"
+
+#include <sys/socket.h>
+
+namespace C {
+	#include <unistd.h>
+	extern "C" int printf(const char *format, ...);
+}
+
+void *UnixClient::operator new(size_t size) {
+	return Pool<UnixClient>::get(size);
+}
+
+void UnixClient::operator delete(void *p, size_t size) {
+	Pool<UnixClient>::put(p, size);
+}
+
+UnixClient::UnixClient(int fd) : TCPClient(fd) {
+	struct ucred cred;
+	socklen_t size = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &size) == 0) {
+		pid = cred.pid;
+		uid = cred.uid;
+		gid = cred.gid;
+		trusted = (uid == 0) || (uid == C::geteuid());
+	}
+	else {
+		perror("SO_PEERCRED");
+		pid = 0;
+		uid = (uid_t) -1;
+		gid = (gid_t) -1;
+	}
+	snprintf(description, sizeof(description), "unix:pid=%d,uid=%d", (int) pid, (int) uid);
+}
+
+UnixClient::~UnixClient() {
+}
@@ -0,0 +1,25 @@
+#ifndef _UNIXCLIENT_HPP
+#define _UNIXCLIENT_HPP
+
+#include <sys/types.h>
+
+#include "TCPClient.hpp"
+
+/*
+ * A TCPClient on a unix domain socket. Peers running as root or as our
+ * own user are trusted.
+ */
+class UnixClient : public TCPClient {
+public:
+	UnixClient(int fd);
+	~UnixClient();
+
+	static void *operator new(size_t size);
+	static void operator delete(void *p, size_t size);
+protected:
+	pid_t pid;
+	uid_t uid;
+	gid_t gid;
+};
+
+#endif /* _UNIXCLIENT_HPP */
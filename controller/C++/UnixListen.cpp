@@ -0,0 +1,154 @@
+#include "UnixListen.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "UnixClient.hpp"
+#include "admission.hpp"
+
+namespace C {
+	#include <unistd.h>
+	#include <sys/stat.h>
+	extern "C" int printf(const char *format, ...);
+}
+
+UnixListen::UnixListen() {
+	listenfd = -1;
+}
+
+UnixListen::UnixListen(const char *path) {
+	listenfd = -1;
+	listen(path);
+}
+
+UnixListen::~UnixListen() {
+	if (listenfd >= 0) {
+		selector.remove(listenfd);
+		C::close(listenfd);
+		C::unlink(path.c_str());
+	}
+}
+
+// the socket's directory, made 0700 if it isn't there. anyone else who
+// can write to it could swap in a socket of their own
+static int privatedir(const char *path) {
+	std::string dir(path);
+	size_t slash = dir.rfind('/');
+	if (slash == std::string::npos)
+		dir = ".";
+	else
+		dir.resize(slash ? slash : 1);
+
+	if ((C::mkdir(dir.c_str(), 0700) == -1) && (errno != EEXIST)) {
+		perror(dir.c_str());
+		return -1;
+	}
+	struct C::stat st;
+	if (C::lstat(dir.c_str(), &st) == -1) {
+		perror(dir.c_str());
+		return -1;
+	}
+	if (!S_ISDIR(st.st_mode) || (st.st_uid != C::geteuid()) || (st.st_mode & 077)) {
+		fprintf(stderr, "%s must be a directory owned by uid %d with mode 0700\n", dir.c_str(), (int) C::geteuid());
+		return -1;
+	}
+	return 0;
+}
+
+// NETRAP_SOCKET, else UNIXLISTEN_PATH for root, else UNIXLISTEN_NAME in
+// the user's runtime dir. NULL if there's nowhere fit to put it
+const char *UnixListen::defaultpath(void) {
+	static std::string path;
+	if (getenv("NETRAP_SOCKET"))
+		return getenv("NETRAP_SOCKET");
+	if (C::geteuid() == 0)
+		return UNIXLISTEN_PATH;
+	const char *runtime = getenv("XDG_RUNTIME_DIR");
+	if ((runtime == NULL) || (runtime[0] != '/'))
+		return NULL;
+	path = runtime;
+	path += "/" UNIXLISTEN_NAME;
+	return path.c_str();
+}
+
+int UnixListen::listen(const char *path) {
+	struct sockaddr_un addr;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path %s is too long\n", path);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (privatedir(path) < 0)
+		return -1;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	// a socket left behind by a controller that's gone refuses connections
+	int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if ((probe >= 0) && (connect(probe, (struct sockaddr *) &addr, sizeof(addr)) == 0)) {
+		fprintf(stderr, "%s is in use by another controller\n", path);
+		C::close(probe);
+		C::close(fd);
+		return -1;
+	}
+	if (probe >= 0)
+		C::close(probe);
+	C::unlink(path);
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		perror("bind");
+		C::close(fd);
+		return -1;
+	}
+	if (::listen(fd, SOMAXCONN) == -1) {
+		perror("listen");
+		C::close(fd);
+		return -1;
+	}
+	fprintf(stderr, "Listening on %s\n", path);
+
+	this->path = path;
+	listenfd = fd;
+	selector.add(fd, this);
+	return 0;
+}
+
+// take every connection that's waiting, as TCPListen does
+void UnixListen::onread(struct SelectFd *selected) {
+	for (;;) {
+		int newfd = ::accept4(selected->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (newfd == -1) {
+			if ((errno == EINTR) || (errno == ECONNABORTED))
+				continue;
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+				perror("accept4");
+			return;
+		}
+		// local clients skip the caps, so there's always a way in to fix
+		// things, but select() still can't take an fd past FD_SETSIZE
+		if (newfd >= FD_SETSIZE) {
+			Admission::refuse(newfd);
+			continue;
+		}
+		UnixClient *newsock = new UnixClient(newfd);
+
+		printf("New connection from %s (%d)\n", newsock->toString(), newfd);
+	}
+}
+
+void UnixListen::onwrite(struct SelectFd *selected) {
+}
+
+void UnixListen::onerror(struct SelectFd *selected) {
+}
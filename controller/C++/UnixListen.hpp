@@ -0,0 +1,42 @@
+#ifndef _UNIXLISTEN_HPP
+#define _UNIXLISTEN_HPP
+
+#include <string>
+
+#include "selector.hpp"
+
+// where local tools find a root controller unless NETRAP_SOCKET says
+// otherwise. the directory has to be ours and closed to everyone else
+#define UNIXLISTEN_PATH "/run/netrap/netrap.sock"
+// anyone else's goes in $XDG_RUNTIME_DIR, which is private already
+#define UNIXLISTEN_NAME "netrap.sock"
+
+/*
+ * The netrap protocol on a unix domain socket, for scripts and the CGI
+ * relay on the same host. Same commands as over TCP, but the peer's
+ * credentials are known, so they can stand in for a password. That's
+ * only safe if nobody else can put a socket where ours should be, so
+ * listen() refuses a directory that isn't 0700 and ours.
+ */
+class UnixListen : public SelectorEventReceiver {
+public:
+	UnixListen();
+	UnixListen(const char *path);
+	~UnixListen();
+
+	int listen(const char *path);
+
+	static const char *defaultpath(void);
+
+protected:
+	int listenfd;
+	std::string path;
+
+	Selector selector;
+
+	void onread(struct SelectFd *selected);
+	void onwrite(struct SelectFd *selected);
+	void onerror(struct SelectFd *selected);
+};
+
+#endif /* _UNIXLISTEN_HPP */
@@ -0,0 +1,122 @@
+#include "admission.hpp"
+
+namespace C {
+	#include <unistd.h>
+}
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <netinet/in.h>
+
+#include "metrics.hpp"
+
+int Admission::maxclients = ADMISSION_MAXCLIENTS;
+int Admission::maxperip = ADMISSION_MAXPERIP;
+size_t Admission::maxbuffer = ADMISSION_MAXBUFFER;
+
+int Admission::clients = 0;
+size_t Admission::buffered = 0;
+unsigned long Admission::refused = 0;
+
+std::map<std::string, int> Admission::perip;
+unsigned long Admission::lastreported = 0;
+time_t Admission::lastreport = 0;
+
+static const char overloaded[] =
+	"HTTP/1.0 503 Service Unavailable\r\n"
+	"Connection: close\r\n"
+	"Retry-After: 5\r\n"
+	"Content-Type: text/plain\r\n"
+	"\r\n"
+	"Too busy, try again later\n";
+
+void Admission::configure() {
+	const char *v;
+	if ((v = getenv("NETRAP_MAXCLIENTS")) != NULL)
+		maxclients = atoi(v);
+	if ((v = getenv("NETRAP_MAXPERIP")) != NULL)
+		maxperip = atoi(v);
+	if ((v = getenv("NETRAP_MAXBUFFER")) != NULL)
+		maxbuffer = strtoul(v, NULL, 0);
+	// select() can't watch anything past FD_SETSIZE
+	if (maxclients > FD_SETSIZE - ADMISSION_FDRESERVE)
+		maxclients = FD_SETSIZE - ADMISSION_FDRESERVE;
+	Metrics::collector(&Admission::collect);
+}
+
+void Admission::collect() {
+	static int c = Metrics::gauge("netrap_clients", "Network clients connected");
+	static int b = Metrics::gauge("netrap_client_buffer_bytes", "Bytes held in client buffers");
+	static int r = Metrics::counter("netrap_clients_refused_total", "Connections refused at accept time");
+	Metrics::set(c, clients);
+	Metrics::set(b, buffered);
+	Metrics::set(r, refused);
+}
+
+// the address without the port, so every connection from a host shares it
+std::string Admission::key(struct sockaddr *addr) {
+	if (addr->sa_family == AF_INET)
+		return std::string((const char *) &((struct sockaddr_in *) addr)->sin_addr, sizeof(struct in_addr));
+	if (addr->sa_family == AF_INET6)
+		return std::string((const char *) &((struct sockaddr_in6 *) addr)->sin6_addr, sizeof(struct in6_addr));
+	return std::string();
+}
+
+int Admission::admit(int fd, struct sockaddr *addr) {
+	if (fd >= FD_SETSIZE - ADMISSION_FDRESERVE)
+		return 0;
+	if (clients >= maxclients)
+		return 0;
+	if (buffered + ADMISSION_CLIENTCOST > maxbuffer)
+		return 0;
+	std::map<std::string, int>::iterator i = perip.find(key(addr));
+	if ((i != perip.end()) && (i->second >= maxperip))
+		return 0;
+	return 1;
+}
+
+/*
+ * a best effort 503 and close. the socket is fresh, so the response fits
+ * its send buffer, and a client that isn't speaking http sees a line of
+ * text before the hangup
+ */
+void Admission::refuse(int fd) {
+	ssize_t r = C::write(fd, overloaded, sizeof(overloaded) - 1);
+	(void) r;
+	C::close(fd);
+	refused++;
+	report();
+}
+
+// once every so often, so a flood doesn't flood the log too
+void Admission::report() {
+	time_t now = time(NULL);
+	if (now - lastreport < ADMISSION_LOGINTERVAL)
+		return;
+	printf("Refused %lu connections (%d clients, %lu bytes buffered)\n", refused - lastreported, clients, (unsigned long) buffered);
+	lastreported = refused;
+	lastreport = now;
+}
+
+void Admission::opened(struct sockaddr *addr) {
+	clients++;
+	perip[key(addr)]++;
+}
+
+void Admission::closed(struct sockaddr *addr) {
+	clients--;
+	std::map<std::string, int>::iterator i = perip.find(key(addr));
+	if ((i != perip.end()) && (--i->second <= 0))
+		perip.erase(i);
+}
+
+void Admission::charge(long bytes) {
+	buffered += bytes;
+}
+
+int Admission::overbudget() {
+	return buffered > maxbuffer;
+}
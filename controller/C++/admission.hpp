@@ -0,0 +1,63 @@
+#ifndef _ADMISSION_HPP
+#define _ADMISSION_HPP
+
+#include <cstddef>
+#include <map>
+#include <string>
+
+#include <sys/select.h>
+#include <sys/socket.h>
+
+// defaults, overridden by NETRAP_MAXCLIENTS, NETRAP_MAXPERIP and NETRAP_MAXBUFFER
+#define ADMISSION_MAXCLIENTS 256
+#define ADMISSION_MAXPERIP 16
+#define ADMISSION_MAXBUFFER (4 << 20)
+// fds kept back from clients for printers, job files and pipes
+#define ADMISSION_FDRESERVE 64
+// the least a client costs in buffers once it's taken on
+#define ADMISSION_CLIENTCOST (1024 + 128 + 4096)
+// seconds between reports of refused connections
+#define ADMISSION_LOGINTERVAL 10
+
+/*
+ * Decides whether a network client may connect, so a flood of them can't
+ * run us out of memory or file descriptors.
+ *
+ * There are caps on clients in all, on clients from one address, and on
+ * the bytes their buffers hold. Only clients are counted against these
+ * caps. Printers and jobs never are, and ADMISSION_FDRESERVE fds below
+ * FD_SETSIZE are kept for them, so a running print can't be starved.
+ * Clients over a cap are sent a 503 and closed before anything is
+ * allocated for them.
+ */
+class Admission {
+public:
+	static void configure();
+
+	// may a client on fd from addr be taken on
+	static int admit(int fd, struct sockaddr *addr);
+	static void refuse(int fd);
+	static void opened(struct sockaddr *addr);
+	static void closed(struct sockaddr *addr);
+
+	// client buffer bytes, as they're allocated and freed
+	static void charge(long bytes);
+	static int overbudget();
+
+	static int maxclients, maxperip;
+	static size_t maxbuffer;
+
+	static int clients;
+	static size_t buffered;
+	static unsigned long refused;
+private:
+	static std::map<std::string, int> perip;
+	static unsigned long lastreported;
+	static time_t lastreport;
+
+	static std::string key(struct sockaddr *addr);
+	static void report();
+	static void collect();
+};
+
+#endif /* _ADMISSION_HPP */
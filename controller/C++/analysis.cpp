@@ -0,0 +1,336 @@
+#include "analysis.hpp"
+
+#include "socket.hpp"
+#include "gcode.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+
+namespace C {
+	#include <unistd.h>
+	#include <sys/types.h>
+	#include <sys/stat.h>
+	#include <sys/mman.h>
+	#include <fcntl.h>
+
+	extern "C" int printf(const char *format, ...);
+}
+
+#define WORD(g, letter) ((g)->words[(letter) - 'A'])
+#define HAS(g, letter) ((g)->seen & GCODE_WORD(letter))
+
+static void stats_init(GcodeStats *s) {
+	memset(s, 0, sizeof(GcodeStats));
+	for (int i = 0; i < 3; i++) {
+		s->min[i] = FLT_MAX;
+		s->max[i] = -FLT_MAX;
+	}
+}
+
+Analysis::Analysis(Socket *client) {
+	this->client = client;
+	if (client)
+		client->ref();
+	path = NULL;
+	map = NULL;
+	maplen = 0;
+	pending = 0;
+	pass = 0;
+	stats_init(&stats);
+	motionlimits_init(&limits);
+}
+
+Analysis::~Analysis() {
+	for (unsigned int i = 0; i < chunks.size(); i++)
+		delete chunks[i];
+	if (map)
+		C::munmap((void *) map, maplen);
+	free(path);
+	if (client)
+		client->unref();
+}
+
+/*
+ * split path into chunks and set the first pass going. returns -1 if the
+ * file can't be read, in which case nothing was started
+ */
+int Analysis::start(const char *path) {
+	int fd = C::open(path, O_RDONLY);
+	if (fd == -1) {
+		perror(path);
+		return -1;
+	}
+	struct C::stat st;
+	if ((C::fstat(fd, &st) == -1) || (st.st_size == 0)) {
+		C::close(fd);
+		return -1;
+	}
+	void *m = C::mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	C::close(fd);
+	if (m == MAP_FAILED) {
+		perror(path);
+		return -1;
+	}
+	this->path = strdup(path);
+	map = (const char *) m;
+	maplen = st.st_size;
+
+	WorkerPool *pool = WorkerPool::shared();
+	uint64_t n = maplen / ANALYSIS_MIN_CHUNK;
+	if (n > (uint64_t) pool->size() * ANALYSIS_CHUNKS_PER_THREAD)
+		n = pool->size() * ANALYSIS_CHUNKS_PER_THREAD;
+	if (n < 1)
+		n = 1;
+
+	const char *end = map + maplen;
+	const char *p = map;
+	for (uint64_t i = 1; i <= n; i++) {
+		const char *e = map + maplen * i / n;
+		if (e < p)
+			e = p;
+		if (e < end) {
+			e = (const char *) memchr(e, 10, end - e);
+			e = e ? e + 1 : end;
+		}
+		if (e > p)
+			chunks.push_back(new AnalysisChunk(this, p, e));
+		p = e;
+	}
+
+	pass = 1;
+	pending = chunks.size();
+	for (unsigned int i = 0; i < chunks.size(); i++)
+		pool->submit(chunks[i]);
+	return 0;
+}
+
+void Analysis::chunkdone() {
+	if (--pending > 0)
+		return;
+
+	if (pass == 1) {
+		prefix();
+		pass = 2;
+		pending = chunks.size();
+		for (unsigned int i = 0; i < chunks.size(); i++)
+			WorkerPool::shared()->submit(chunks[i]);
+		return;
+	}
+
+	merge();
+	finished();
+	delete this;
+}
+
+// run the start state through each chunk's transform to find where the next begins
+void Analysis::prefix() {
+	PrinterState state;
+	printerstate_init(&state);
+	for (unsigned int c = 0; c < chunks.size(); c++) {
+		chunks[c]->entry = state;
+		const GcodeTransform *t = &chunks[c]->transform;
+		for (int i = 0; i < 4; i++) {
+			int h = ((i == AXIS_E) ? state.relative_e : state.relative) ? 1 : 0;
+			const AxisTransform *a = &t->axis[i][h];
+			state.target[i] = a->known ? a->value : state.target[i] + a->value;
+		}
+		if (t->relative >= 0)
+			state.relative = t->relative;
+		if (t->relative_e >= 0)
+			state.relative_e = t->relative_e;
+		if (t->feedrate_set)
+			state.feedrate = t->feedrate;
+	}
+}
+
+void Analysis::merge() {
+	float height = -FLT_MAX;
+	for (unsigned int c = 0; c < chunks.size(); c++) {
+		const GcodeStats *s = &chunks[c]->stats;
+		stats.lines += s->lines;
+		stats.errors += s->errors;
+		stats.time += s->time;
+		stats.extruded += s->extruded;
+		for (int i = 0; i < 3; i++) {
+			stats.min[i] = std::min(stats.min[i], s->min[i]);
+			stats.max[i] = std::max(stats.max[i], s->max[i]);
+		}
+		// a layer starts at each new highest extrusion, across the whole file
+		const std::vector<float> &h = chunks[c]->heights;
+		stats.layers += h.end() - std::upper_bound(h.begin(), h.end(), height + ANALYSIS_LAYER_EPSILON);
+		if (!h.empty())
+			height = std::max(height, h.back());
+	}
+}
+
+void Analysis::finished() {
+	C::printf("Analysed %s: %llu lines, %u layers, %.1fmm of filament, %.0fs\n", path, (unsigned long long) stats.lines, stats.layers, stats.extruded, stats.time);
+	if ((client == NULL) || (client->opened() < 0))
+		return;
+	client->printf("Analysis of %s\n", path);
+	client->printf("lines: %llu\n", (unsigned long long) stats.lines);
+	client->printf("errors: %llu\n", (unsigned long long) stats.errors);
+	client->printf("layers: %u\n", stats.layers);
+	client->printf("filament: %.1f\n", stats.extruded);
+	client->printf("time: %.0f\n", stats.time);
+	if (stats.min[0] <= stats.max[0])
+		client->printf("bounds: %.3f %.3f %.3f %.3f %.3f %.3f\n", stats.min[0], stats.min[1], stats.min[2], stats.max[0], stats.max[1], stats.max[2]);
+	client->printf("--end of analysis--\n");
+}
+
+AnalysisChunk::AnalysisChunk(Analysis *parent, const char *start, const char *end) {
+	this->parent = parent;
+	this->start = start;
+	this->end = end;
+	stats_init(&stats);
+}
+
+void AnalysisChunk::run() {
+	if (parent->pass == 1)
+		summarise();
+	else
+		measure();
+}
+
+void AnalysisChunk::done() {
+	parent->chunkdone();
+}
+
+/*
+ * first pass: what this chunk does to the modal state. until the chunk
+ * sets a mode itself, both answers are kept
+ */
+void AnalysisChunk::summarise() {
+	static const char axes[4] = { 'X', 'Y', 'Z', 'E' };
+	GcodeTransform *t = &transform;
+	memset(t, 0, sizeof(GcodeTransform));
+	t->relative = -1;
+	t->relative_e = -1;
+
+	GcodeLine g;
+	int i, h;
+	for (const char *p = start; p < end; ) {
+		const char *nl = (const char *) memchr(p, 10, end - p);
+		const char *e = nl ? nl : end;
+		int len = (e - p > 0x7FFF) ? 0x7FFF : e - p;
+		int error = Gcode::parse(p, len, &g);
+		p = e + 1;
+		if ((error != GCODE_OK) || !HAS(&g, 'G')) {
+			if ((error == GCODE_OK) && HAS(&g, 'M')) {
+				if (WORD(&g, 'M') == 82)
+					t->relative_e = 0;
+				else if (WORD(&g, 'M') == 83)
+					t->relative_e = 1;
+			}
+			continue;
+		}
+
+		switch ((int) WORD(&g, 'G')) {
+			case 0: case 1: case 2: case 3:
+				for (i = 0; i < 4; i++) {
+					if (!HAS(&g, axes[i]))
+						continue;
+					int mode = (i == AXIS_E) ? t->relative_e : t->relative;
+					for (h = 0; h < 2; h++) {
+						AxisTransform *a = &t->axis[i][h];
+						if (((mode < 0) ? h : mode) == 0) {
+							a->known = 1;
+							a->value = WORD(&g, axes[i]);
+						}
+						else {
+							a->value += WORD(&g, axes[i]);
+						}
+					}
+				}
+				if (HAS(&g, 'F')) {
+					t->feedrate_set = 1;
+					t->feedrate = WORD(&g, 'F');
+				}
+				break;
+			case 28: {
+				uint32_t named = (g.seen | g.bare) & (GCODE_WORD('X') | GCODE_WORD('Y') | GCODE_WORD('Z'));
+				for (i = 0; i < 3; i++) {
+					if ((named != 0) && !(named & GCODE_WORD(axes[i])))
+						continue;
+					for (h = 0; h < 2; h++) {
+						t->axis[i][h].known = 1;
+						t->axis[i][h].value = 0;
+					}
+				}
+				break;
+			}
+			case 90:
+				t->relative = 0;
+				t->relative_e = 0;
+				break;
+			case 91:
+				t->relative = 1;
+				t->relative_e = 1;
+				break;
+			case 92: {
+				int any = HAS(&g, 'X') || HAS(&g, 'Y') || HAS(&g, 'Z') || HAS(&g, 'E');
+				for (i = 0; i < 4; i++) {
+					if (any && !HAS(&g, axes[i]))
+						continue;
+					for (h = 0; h < 2; h++) {
+						t->axis[i][h].known = 1;
+						t->axis[i][h].value = any ? WORD(&g, axes[i]) : 0;
+					}
+				}
+				break;
+			}
+		}
+	}
+}
+
+// second pass: starting from the true entry state, what this chunk costs
+void AnalysisChunk::measure() {
+	PrinterState state = entry;
+	Estimator estimator(&parent->limits);
+	GcodeLine g;
+	float height = -FLT_MAX;
+
+	for (const char *p = start; p < end; ) {
+		const char *nl = (const char *) memchr(p, 10, end - p);
+		const char *e = nl ? nl : end;
+		int len = (e - p > 0x7FFF) ? 0x7FFF : e - p;
+		int error = Gcode::parse(p, len, &g);
+		p = e + 1;
+		stats.lines++;
+		if (error != GCODE_OK) {
+			stats.errors++;
+			continue;
+		}
+
+		float from[4];
+		memcpy(from, state.target, sizeof(from));
+		printerstate_apply(&state, &g);
+		if (!HAS(&g, 'G') || (WORD(&g, 'G') > 3))
+			continue;
+
+		float dx = state.target[AXIS_X] - from[AXIS_X];
+		float dy = state.target[AXIS_Y] - from[AXIS_Y];
+		float de = state.target[AXIS_E] - from[AXIS_E];
+
+		stats.extruded += de;
+		estimator.move(from, state.target, state.feedrate);
+
+		if ((de > 0) && ((dx != 0) || (dy != 0))) {
+			for (int i = 0; i < 3; i++) {
+				stats.min[i] = std::min(stats.min[i], std::min(from[i], state.target[i]));
+				stats.max[i] = std::max(stats.max[i], std::max(from[i], state.target[i]));
+			}
+			if (state.target[AXIS_Z] > height + ANALYSIS_LAYER_EPSILON) {
+				height = state.target[AXIS_Z];
+				heights.push_back(height);
+			}
+		}
+	}
+	// each chunk is planned from and to a standstill, which is out by
+	// well under a second a chunk
+	stats.time = estimator.flush();
+}
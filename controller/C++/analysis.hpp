@@ -0,0 +1,109 @@
+#ifndef _ANALYSIS_HPP
+#define _ANALYSIS_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include "printerstate.hpp"
+#include "workerpool.hpp"
+#include "estimator.hpp"
+
+class Socket;
+class AnalysisChunk;
+
+// smallest chunk worth handing to a thread
+#define ANALYSIS_MIN_CHUNK (256 * 1024)
+#define ANALYSIS_CHUNKS_PER_THREAD 4
+// relative moves add up a little differently chunked, so heights within
+// this are the same layer
+#define ANALYSIS_LAYER_EPSILON 0.005f
+
+// what a gcode file will do, worked out from the file alone
+struct GcodeStats {
+	uint64_t lines;
+	uint64_t errors;
+	double time;         // seconds, as the firmware would plan the moves
+	double extruded;     // mm of filament, net of retractions
+	float min[3];        // bounding box of extruding moves
+	float max[3];
+	unsigned int layers;
+};
+
+/*
+ * one axis of a chunk's effect on the position, for an entry in
+ * absolute [0] or relative [1] mode. known means the chunk ends at value
+ * whatever the entry state was, otherwise it moves value from it
+ */
+struct AxisTransform {
+	int known;
+	float value;
+};
+
+// a chunk's whole effect on the modal state, as a function of its entry state
+struct GcodeTransform {
+	AxisTransform axis[4][2];
+	int relative;        // -1 if the chunk never sets it
+	int relative_e;
+	int feedrate_set;
+	float feedrate;
+};
+
+/*
+ * Analyse a gcode file in parallel chunks split at line boundaries.
+ *
+ * Each chunk is tokenized twice on the worker pool. The first pass
+ * reduces it to a GcodeTransform; a prefix pass over the transforms (a
+ * handful of them, so in the event loop) gives each chunk's true entry
+ * state; the second pass gathers each chunk's stats from there. The stats
+ * are then merged in file order. Results reach the client, if it's still
+ * there, and the Analysis deletes itself.
+ */
+class Analysis {
+public:
+	Analysis(Socket *client);
+	virtual ~Analysis();
+
+	int start(const char *path);
+
+	GcodeStats stats;
+	MotionLimits limits;
+protected:
+	Socket *client;
+	char *path;
+	const char *map;
+	uint64_t maplen;
+
+	std::vector<AnalysisChunk *> chunks;
+	unsigned int pending;
+	int pass;
+
+	void chunkdone();
+	void prefix();
+	void merge();
+	virtual void finished();
+
+	friend class AnalysisChunk;
+};
+
+class AnalysisChunk : public Task {
+public:
+	AnalysisChunk(Analysis *parent, const char *start, const char *end);
+
+	void run();
+	void done();
+
+	GcodeTransform transform;
+	PrinterState entry;
+	GcodeStats stats;
+	// extrusion heights which were a new maximum for this chunk
+	std::vector<float> heights;
+protected:
+	Analysis *parent;
+	const char *start;
+	const char *end;
+
+	void summarise();
+	void measure();
+};
+
+#endif /* _ANALYSIS_HPP */
@@ -0,0 +1,164 @@
+#include "arena.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+#include "pool.hpp"
+
+// allocations are aligned for anything
+#define ARENA_ALIGN 16
+#define ARENA_HEADER ((sizeof(Chunk) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+Arena::Arena(size_t chunk) {
+	first = current = NULL;
+	chunksize = chunk;
+}
+
+Arena::~Arena() {
+	reset();
+	if (first)
+		BufferArena::put(first, first->size);
+}
+
+// a chunk with room for size, in a power of two so the BufferArena keeps it
+Arena::Chunk *Arena::chunk(size_t size) {
+	size_t total = chunksize;
+	while (total < ARENA_HEADER + size)
+		total <<= 1;
+	Chunk *c = (Chunk *) BufferArena::get(total);
+	c->next = NULL;
+	c->size = total;
+	c->used = ARENA_HEADER;
+	return c;
+}
+
+void *Arena::alloc(size_t size) {
+	size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+	if (current == NULL) {
+		if (first == NULL)
+			first = chunk(size);
+		current = first;
+	}
+	if (current->used + size > current->size) {
+		Chunk *c = chunk(size);
+		current->next = c;
+		current = c;
+	}
+	void *p = (char *) current + current->used;
+	current->used += size;
+	return p;
+}
+
+char *Arena::strndup(const char *s, size_t len) {
+	char *d = (char *) alloc(len + 1);
+	memcpy(d, s, len);
+	d[len] = 0;
+	return d;
+}
+
+// drop everything allocated since the last reset
+void Arena::reset() {
+	if (first == NULL)
+		return;
+	Chunk *c = first->next;
+	while (c) {
+		Chunk *next = c->next;
+		BufferArena::put(c, c->size);
+		c = next;
+	}
+	first->next = NULL;
+	first->used = ARENA_HEADER;
+	current = first;
+}
+
+size_t Arena::used() {
+	size_t n = 0;
+	for (Chunk *c = first; c; c = c->next)
+		n += c->used - ARENA_HEADER;
+	return n;
+}
+
+size_t Arena::size() {
+	size_t n = 0;
+	for (Chunk *c = first; c; c = c->next)
+		n += c->size;
+	return n;
+}
+
+ArenaText::ArenaText(Arena *arena) {
+	this->arena = arena;
+	buf = NULL;
+	used = capacity = 0;
+}
+
+void ArenaText::reserve(size_t more) {
+	if (used + more + 1 <= capacity)
+		return;
+	size_t c = capacity ? capacity * 2 : 256;
+	while (c < used + more + 1)
+		c *= 2;
+	char *b = (char *) arena->alloc(c);
+	if (used)
+		memcpy(b, buf, used);
+	buf = b;
+	capacity = c;
+}
+
+void ArenaText::append(const char *s, size_t len) {
+	reserve(len);
+	memcpy(&buf[used], s, len);
+	used += len;
+	buf[used] = 0;
+}
+
+void ArenaText::append(const char *s) {
+	append(s, strlen(s));
+}
+
+void ArenaText::printf(const char *format, ...) {
+	va_list ap;
+	reserve(64);
+	va_start(ap, format);
+	int r = vsnprintf(&buf[used], capacity - used, format, ap);
+	va_end(ap);
+	if (r < 0)
+		return;
+	if ((size_t) r >= capacity - used) {
+		reserve(r);
+		va_start(ap, format);
+		vsnprintf(&buf[used], capacity - used, format, ap);
+		va_end(ap);
+	}
+	used += r;
+}
+
+void ArenaText::json(const char *s) {
+	append("\"", 1);
+	for (const char *p = s; *p; p++) {
+		unsigned char c = *p;
+		if ((c == '"') || (c == '\\')) {
+			char e[2] = { '\\', (char) c };
+			append(e, 2);
+		}
+		else if (c < 32) {
+			printf("\\u%04x", c);
+		}
+		else {
+			const char *q = p;
+			while (q[1] && (q[1] != '"') && (q[1] != '\\') && ((unsigned char) q[1] >= 32))
+				q++;
+			append(p, q - p + 1);
+			p = q;
+		}
+	}
+	append("\"", 1);
+}
+
+const char *ArenaText::data() {
+	return buf ? buf : "";
+}
+
+size_t ArenaText::length() {
+	return used;
+}
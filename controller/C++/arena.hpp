@@ -0,0 +1,67 @@
+#ifndef _ARENA_HPP
+#define _ARENA_HPP
+
+#include <cstddef>
+#include <cstdarg>
+
+// bytes in each chunk an arena takes from the BufferArena
+#define ARENA_CHUNK 4096
+
+/*
+ * A bump allocator for things that live exactly as long as one request.
+ * alloc() just moves a pointer along; nothing is freed on its own, it all
+ * goes at once with reset(). The first chunk is kept over resets, and the
+ * rest go back to the BufferArena, so a steady stream of requests takes
+ * nothing from the heap.
+ */
+class Arena {
+public:
+	Arena(size_t chunk = ARENA_CHUNK);
+	~Arena();
+
+	void *alloc(size_t size);
+	char *strndup(const char *s, size_t len);
+	void reset();
+	size_t used();
+	// bytes of chunks held, used or not
+	size_t size();
+private:
+	struct Chunk {
+		Chunk *next;
+		size_t size;
+		size_t used;
+	};
+	Chunk *first;
+	Chunk *current;
+	size_t chunksize;
+
+	Chunk *chunk(size_t size);
+};
+
+/*
+ * Text built up in an arena, eg. a response. Growing it copies it to a
+ * bigger block and leaves the old one behind, which is fine for the life
+ * of a request.
+ */
+class ArenaText {
+public:
+	ArenaText(Arena *arena);
+
+	void append(const char *s, size_t len);
+	void append(const char *s);
+	void printf(const char *format, ...);
+	// s quoted and escaped as a JSON string
+	void json(const char *s);
+
+	const char *data();
+	size_t length();
+private:
+	Arena *arena;
+	char *buf;
+	size_t used;
+	size_t capacity;
+
+	void reserve(size_t more);
+};
+
+#endif /* _ARENA_HPP */
@@ -0,0 +1,255 @@
+#include "broadcast.hpp"
+
+#include "printer.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+BroadcastJob::BroadcastJob(Broadcast *parent) : Job(parent->source, JOB_PRIORITY_NORMAL, 0) {
+	this->parent = parent;
+	offset = parent->tail;
+	line = parent->tailline;
+	failed = 0;
+}
+
+BroadcastJob::~BroadcastJob() {
+	parent->jobs.remove(this);
+	parent->trim();
+	// the last printer to finish cleans up
+	if (parent->jobs.empty() && (parent->finished || (source == NULL) || (source->opened() < 0)))
+		delete parent;
+}
+
+unsigned int BroadcastJob::numlines() {
+	if (failed)
+		return 0;
+	return parent->lines - line;
+}
+
+unsigned int BroadcastJob::peeklen() {
+	if (numlines() == 0)
+		return 0;
+	return parent->linelength(offset);
+}
+
+unsigned int BroadcastJob::readline(char *buf, unsigned int len) {
+	unsigned int l = peeklen();
+	if (l == 0)
+		return 0;
+
+	unsigned int start = offset % parent->length;
+	unsigned int stage1 = parent->length - start;
+	unsigned int copy = (l < len - 1) ? l : len - 1;
+	if (stage1 > copy)
+		stage1 = copy;
+	memcpy(buf, &parent->data[start], stage1);
+	if (copy > stage1)
+		memcpy(&buf[stage1], parent->data, copy - stage1);
+	buf[copy] = 0;
+
+	offset += l;
+	line++;
+	parent->trim();
+
+	return copy;
+}
+
+// tokens of the line just read. its slot is only reused by a later write
+const GcodeLine *BroadcastJob::tokens() {
+	if (line == 0)
+		return NULL;
+	return &parent->parsed[(line - 1) % parent->maxlines];
+}
+
+int BroadcastJob::write(const char *line, int len) {
+	return parent->write(line, len);
+}
+
+int BroadcastJob::complete() {
+	if (numlines())
+		return 0;
+	return failed || parent->finished || (source == NULL) || (source->opened() < 0);
+}
+
+// a member is for one printer, it can't move to another
+int BroadcastJob::requeue() {
+	if (!failed)
+		fail("printer gone");
+	return 0;
+}
+
+// drop out of the group, and let the source know
+void BroadcastJob::fail(const char *why) {
+	failed = 1;
+	printf("Broadcast %p: dropping printer %s, %s\n", parent, printer ? printer->name() : "(none)", why);
+	if (source && (source->opened() >= 0))
+		source->printf("--broadcast: printer %s dropped, %s--\n", printer ? printer->name() : "(none)", why);
+}
+
+Broadcast::Broadcast(Socket *source, unsigned int size) {
+	this->source = source;
+	if (source)
+		source->ref();
+	data = (char *) malloc(size);
+	length = size;
+	head = 0;
+	tail = 0;
+	lines = 0;
+	finished = 0;
+	abandoned = 0;
+	maxlines = size / BROADCAST_LINEBYTES;
+	parsed = new GcodeLine[maxlines];
+	tailline = 0;
+}
+
+Broadcast::~Broadcast() {
+	if (source && source->is_stalled())
+		source->unstall();
+	if (source)
+		source->unref();
+	free(data);
+	delete[] parsed;
+}
+
+/*
+ * attach a member job to every idle printer matching group and
+ * requirements. returns the number of printers taking part
+ */
+int Broadcast::start(const std::string &group, std::map<std::string, std::string> &requirements, int priority) {
+	Job probe(source, priority, 0);
+	probe.group = group;
+	probe.requirements = requirements;
+
+	std::list<Printer *>::iterator i;
+	for (i = Printer::allprinters.begin(); i != Printer::allprinters.end(); i++) {
+		Printer *printer = *i;
+		if ((printer->opened() < 0) || !printer->idle() || !probe.compatible(printer))
+			continue;
+		BroadcastJob *job = new BroadcastJob(this);
+		job->group = group;
+		job->requirements = requirements;
+		job->priority = priority;
+		jobs.push_back(job);
+		printer->attach(job);
+	}
+	return jobs.size();
+}
+
+int Broadcast::members() {
+	return jobs.size();
+}
+
+/*
+ * lines are stored whole or not at all, and parsed on the way in. -1 if
+ * it isn't one whole line of at most JOB_MAXLINE
+ */
+int Broadcast::write(const char *line, int len) {
+	if ((len <= 0) || (len > JOB_MAXLINE) || (line[len - 1] != '\n') || memchr(line, '\n', len - 1))
+		return -1;
+	if (jobs.empty()) {
+		// nobody left to print it, don't stall the source waiting
+		if (!abandoned && source && (source->opened() >= 0))
+			source->write("--broadcast: no printers left, dropping the rest--\n");
+		abandoned = 1;
+		return len;
+	}
+	if ((unsigned int) len > length - (head - tail))
+		return 0;
+	if (lines - tailline >= maxlines)
+		return 0;
+
+	unsigned int start = head % length;
+	unsigned int stage1 = length - start;
+	if (stage1 > (unsigned int) len)
+		stage1 = len;
+	memcpy(&data[start], line, stage1);
+	if ((unsigned int) len > stage1)
+		memcpy(data, &line[stage1], len - stage1);
+
+	head += len;
+	Gcode::parse(line, len, &parsed[lines % maxlines]);
+	lines++;
+
+	if (source && !source->is_stalled() && ((head - tail >= length / 4 * 3) || (lines - tailline >= maxlines / 4 * 3)))
+		source->stall();
+
+	return len;
+}
+
+void Broadcast::finish() {
+	finished = 1;
+	feed();
+}
+
+void Broadcast::feed() {
+	// feeding may reap members, and the last one takes us with it
+	std::list<Printer *> printers;
+	std::list<BroadcastJob *>::iterator i;
+	for (i = jobs.begin(); i != jobs.end(); i++) {
+		if ((*i)->printer)
+			printers.push_back((*i)->printer);
+	}
+	std::list<Printer *>::iterator j;
+	for (j = printers.begin(); j != printers.end(); j++)
+		(*j)->feed();
+}
+
+unsigned int Broadcast::linelength(unsigned long long offset) {
+	unsigned int start = offset % length;
+	unsigned int avail = head - offset;
+	unsigned int stage1 = length - start;
+	if (stage1 > avail)
+		stage1 = avail;
+
+	const char *p = (const char *) memchr(&data[start], '\n', stage1);
+	if (p)
+		return p - &data[start] + 1;
+	p = (const char *) memchr(data, '\n', avail - stage1);
+	if (p)
+		return stage1 + (p - data) + 1;
+	return 0;
+}
+
+/*
+ * release whatever the slowest member has finished with. a member whose
+ * printer is gone doesn't count, nor does one still at the stall point
+ * once another member has read everything there is- it's holding up the
+ * group, so it's failed
+ */
+void Broadcast::trim() {
+	std::list<BroadcastJob *>::iterator i;
+	int starved = 0;
+	for (i = jobs.begin(); i != jobs.end(); i++) {
+		BroadcastJob *job = *i;
+		if (job->failed)
+			continue;
+		if ((job->printer == NULL) || (job->printer->opened() < 0))
+			job->fail("printer gone");
+		else if (job->offset == head)
+			starved = 1;
+	}
+	if (starved && source && source->is_stalled()) {
+		for (i = jobs.begin(); i != jobs.end(); i++) {
+			BroadcastJob *job = *i;
+			if (!job->failed && ((head - job->offset >= length / 4 * 3) || (lines - job->line >= maxlines / 4 * 3)))
+				job->fail("too far behind");
+		}
+	}
+
+	unsigned long long t = head;
+	unsigned long long tl = lines;
+	for (i = jobs.begin(); i != jobs.end(); i++) {
+		if ((*i)->failed)
+			continue;
+		if ((*i)->offset < t)
+			t = (*i)->offset;
+		if ((*i)->line < tl)
+			tl = (*i)->line;
+	}
+	tail = t;
+	tailline = tl;
+
+	if (source && source->is_stalled() && (head - tail <= length / 4) && (lines - tailline <= maxlines / 4))
+		source->unstall();
+}
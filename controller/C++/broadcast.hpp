@@ -0,0 +1,95 @@
+#ifndef _BROADCAST_HPP
+#define _BROADCAST_HPP
+
+#include <list>
+#include <map>
+#include <string>
+
+#include "job.hpp"
+#include "socket.hpp"
+
+class Broadcast;
+
+// bytes of ring per line of tokens kept alongside
+#define BROADCAST_LINEBYTES 16
+
+/*
+ * One printer's view of a Broadcast- a cursor into the shared stream.
+ * It's attached to its printer like any other job, so each printer is fed
+ * at the pace of its own ok window.
+ */
+class BroadcastJob : public Job {
+public:
+	BroadcastJob(Broadcast *parent);
+	~BroadcastJob();
+
+	unsigned int numlines();
+	unsigned int peeklen();
+	unsigned int readline(char *buf, unsigned int len);
+	const GcodeLine *tokens();
+	int write(const char *line, int len);
+	int complete();
+	int requeue();
+protected:
+	Broadcast *parent;
+	unsigned long long offset;
+	unsigned long long line;
+	// dropped from the group, it has nothing more to send
+	int failed;
+
+	void fail(const char *why);
+
+	friend class Broadcast;
+};
+
+/*
+ * Stream one job to a bank of identical printers.
+ *
+ * The job's lines are stored once in a shared ring, parsed once as they
+ * go in, and each member printer reads through it with its own cursor.
+ * Space is reclaimed as the slowest printer moves on, and the source is
+ * stalled while the ring is nearly full, so the fastest printer can only
+ * get a buffer's length ahead.
+ *
+ * A member whose printer goes away, or which holds the source stalled
+ * while the others have caught up and sit idle, is failed rather than
+ * left to starve the group. Once every member has gone, what the source
+ * writes is dropped, and the source deletes a broadcast with no members.
+ */
+class Broadcast {
+public:
+	Broadcast(Socket *source, unsigned int size = 65536);
+	~Broadcast();
+
+	int start(const std::string &group, std::map<std::string, std::string> &requirements, int priority);
+	int members();
+
+	int write(const char *line, int len);
+	void finish();
+	void feed();
+
+	Socket *source;
+protected:
+	char *data;
+	unsigned int length;
+	unsigned long long head;
+	unsigned long long tail;
+	unsigned long long lines;
+	int finished;
+	// every member has gone, the rest of the stream is dropped
+	int abandoned;
+
+	// tokens for each line in the ring, by line number
+	GcodeLine *parsed;
+	unsigned int maxlines;
+	unsigned long long tailline;
+
+	std::list<BroadcastJob *> jobs;
+
+	unsigned int linelength(unsigned long long offset);
+	void trim();
+
+	friend class BroadcastJob;
+};
+
+#endif /* _BROADCAST_HPP */
@@ -0,0 +1,136 @@
+#include "encoder.hpp"
+
+#include <cmath>
+
+#define WORD(g, letter) ((g)->words[(letter) - 'A'])
+#define HAS(g, letter) ((g)->seen & GCODE_WORD(letter))
+
+#define AXIS_WORDS (GCODE_WORD('X') | GCODE_WORD('Y') | GCODE_WORD('Z') | GCODE_WORD('E'))
+
+Encoder::Encoder() {
+	flags = ENCODER_OFF;
+	setresolution(0.001f, 0.00001f);
+	reset();
+}
+
+void Encoder::setmode(int mode) {
+	flags = mode;
+	reset();
+}
+
+int Encoder::mode() {
+	return flags;
+}
+
+static int places(float resolution) {
+	if (!(resolution > 0))
+		return 4;
+	int d = (int) ceilf(-log10f(resolution) - 0.0001f);
+	return (d < 0) ? 0 : (d > 6) ? 6 : d;
+}
+
+// resolutions in mm, eg. 0.001 is 3 decimal places
+void Encoder::setresolution(float xyz, float e) {
+	static const char axes[] = "XYZIJKR";
+	for (int i = 0; i < 26; i++)
+		decimals[i] = 4;
+	for (const char *a = axes; *a; a++)
+		decimals[*a - 'A'] = places(xyz);
+	decimals['E' - 'A'] = places(e);
+	for (int i = 0; i < 26; i++) {
+		scale[i] = 1;
+		for (int d = 0; d < decimals[i]; d++)
+			scale[i] *= 10;
+	}
+	reset();
+}
+
+// forget what the firmware holds, eg. after it resets
+void Encoder::reset() {
+	modal = 0;
+}
+
+// whether a and b go out as the same text
+int Encoder::same(char letter, float a, float b) {
+	int64_t s = scale[letter - 'A'];
+	return llrint((double) a * s) == llrint((double) b * s);
+}
+
+int Encoder::encode(const GcodeLine *g, const PrinterState *state, char *buf, int len) {
+	static const char axes[4] = { 'X', 'Y', 'Z', 'E' };
+
+	// string arguments, lines we couldn't read and bad checksums go as they are
+	if ((flags == ENCODER_OFF) || (g->error != GCODE_OK) || (g->text >= 0) || ((g->checksum >= 0) && !g->checksumok)) {
+		follow(g, state);
+		return 0;
+	}
+
+	uint32_t drop = 0;
+	if (HAS(g, 'G') && !HAS(g, 'M') && !HAS(g, 'T') && (WORD(g, 'G') == 0 || WORD(g, 'G') == 1)) {
+		for (int i = 0; i < 4; i++) {
+			uint32_t w = GCODE_WORD(axes[i]);
+			int rel = (i == AXIS_E) ? state->relative_e : state->relative;
+			if ((g->seen & modal & w) && !rel && same(axes[i], WORD(g, axes[i]), state->target[i]))
+				drop |= w;
+		}
+		if ((g->seen & modal & GCODE_WORD('F')) && same('F', WORD(g, 'F'), state->feedrate))
+			drop |= GCODE_WORD('F');
+	}
+
+	follow(g, state);
+	return Gcode::encode(g, buf, len, drop, decimals, flags == ENCODER_COMPACT);
+}
+
+// keep modal in step with what the firmware has been sent
+void Encoder::follow(const GcodeLine *g, const PrinterState *state) {
+	static const char axes[4] = { 'X', 'Y', 'Z', 'E' };
+	int i;
+
+	if (g->error != GCODE_OK) {
+		modal = 0;
+		return;
+	}
+	if (HAS(g, 'T') || (g->bare & (GCODE_WORD('G') | GCODE_WORD('M') | GCODE_WORD('T')))) {
+		modal = 0;
+		return;
+	}
+	if (HAS(g, 'G')) {
+		switch ((int) WORD(g, 'G')) {
+			case 0: case 1: case 2: case 3:
+				for (i = 0; i < 4; i++) {
+					uint32_t w = GCODE_WORD(axes[i]);
+					if (!(g->seen & w))
+						continue;
+					int rel = (i == AXIS_E) ? state->relative_e : state->relative;
+					// a relative move lands on the rounded sum, which may not be ours
+					if (rel)
+						modal &= ~w;
+					else
+						modal |= w;
+				}
+				if (HAS(g, 'F'))
+					modal |= GCODE_WORD('F');
+				return;
+			case 4: case 90: case 91:
+				return;
+			case 92:
+				if ((g->seen & AXIS_WORDS) == 0)
+					modal |= AXIS_WORDS;
+				else
+					modal |= g->seen & AXIS_WORDS;
+				return;
+		}
+		modal = 0;
+		return;
+	}
+	if (HAS(g, 'M')) {
+		switch ((int) WORD(g, 'M')) {
+			case 82: case 83:
+			case 104: case 105: case 106: case 107: case 109:
+			case 114: case 115: case 117:
+			case 140: case 190:
+				return;
+		}
+		modal = 0;
+	}
+}
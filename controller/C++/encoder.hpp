@@ -0,0 +1,47 @@
+#ifndef _ENCODER_HPP
+#define _ENCODER_HPP
+
+#include "gcode.hpp"
+#include "printerstate.hpp"
+
+#define ENCODER_OFF     0
+#define ENCODER_ON      1   // one space between words
+#define ENCODER_COMPACT 2   // no spaces at all, for firmware which copes
+
+// default places for X Y Z I J K R, and for E
+#define ENCODER_DECIMALS   3
+#define ENCODER_DECIMALS_E 5
+
+/*
+ * Rewrite lines on their way down the serial link with as few bytes as
+ * they need: no comments, no padding, numbers to the printer's resolution
+ * and no trailing zeros, and G0/G1 words which repeat the value the
+ * firmware already has left out.
+ *
+ * A word is only dropped once the firmware is known to hold its value-
+ * modal tracks which words were last sent as absolute values, and anything
+ * that might move the printer behind our back (homing, probing, tool
+ * changes, any command we don't know) forgets them all.
+ */
+class Encoder {
+public:
+	Encoder();
+
+	void setmode(int mode);
+	int mode();
+	void setresolution(float xyz, float e);
+	void reset();
+
+	// state is from before g is applied. returns 0 to send the line as it came
+	int encode(const GcodeLine *g, const PrinterState *state, char *buf, int len);
+protected:
+	int flags;
+	int8_t decimals[26];
+	int64_t scale[26];
+	uint32_t modal;
+
+	int same(char letter, float a, float b);
+	void follow(const GcodeLine *g, const PrinterState *state);
+};
+
+#endif /* _ENCODER_HPP */
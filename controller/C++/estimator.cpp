@@ -0,0 +1,150 @@
+#include "estimator.hpp"
+
+#include <cmath>
+#include <cstring>
+
+#define WORD(g, letter) ((g)->words[(letter) - 'A'])
+#define HAS(g, letter) ((g)->seen & GCODE_WORD(letter))
+
+void motionlimits_init(MotionLimits *limits) {
+	limits->accel = 1000;
+	limits->jerk[AXIS_X] = 10;
+	limits->jerk[AXIS_Y] = 10;
+	limits->jerk[AXIS_Z] = 0.4;
+	limits->jerk[AXIS_E] = 5;
+	limits->feedrate[AXIS_X] = 300;
+	limits->feedrate[AXIS_Y] = 300;
+	limits->feedrate[AXIS_Z] = 5;
+	limits->feedrate[AXIS_E] = 25;
+}
+
+Estimator::Estimator() {
+	motionlimits_init(&limits);
+	reset();
+}
+
+Estimator::Estimator(const MotionLimits *limits) {
+	this->limits = *limits;
+	reset();
+}
+
+void Estimator::setlimits(const MotionLimits *limits) {
+	this->limits = *limits;
+}
+
+void Estimator::reset() {
+	elapsed = 0;
+	count = 0;
+	entry[0] = 0;
+	memset(last, 0, sizeof(last));
+	lastnominal = 0;
+}
+
+void Estimator::apply(PrinterState *state, const GcodeLine *g) {
+	float from[4];
+	memcpy(from, state->target, sizeof(from));
+	printerstate_apply(state, g);
+	if (HAS(g, 'G') && (WORD(g, 'G') <= 3))
+		move(from, state->target, state->feedrate);
+}
+
+void Estimator::move(const float *from, const float *to, float feedrate) {
+	float d[4], u[4];
+	int i;
+	for (i = 0; i < 4; i++)
+		d[i] = to[i] - from[i];
+	float l = sqrtf(d[AXIS_X] * d[AXIS_X] + d[AXIS_Y] * d[AXIS_Y] + d[AXIS_Z] * d[AXIS_Z]);
+	if (l == 0)
+		l = fabsf(d[AXIS_E]);
+	if (l == 0)
+		return;
+
+	// nominal speed, slowed so no axis goes over its own limit
+	float v = feedrate / 60;
+	for (i = 0; i < 4; i++) {
+		u[i] = d[i] / l;
+		if (fabsf(u[i]) * v > limits.feedrate[i])
+			v = limits.feedrate[i] / fabsf(u[i]);
+	}
+	if (v <= 0)
+		v = limits.feedrate[AXIS_X];
+
+	// the fastest the corner can be taken without any axis jumping by
+	// more than its jerk. after a stop, last is all zeros
+	float junction = ((lastnominal > 0) && (lastnominal < v)) ? lastnominal : v;
+	for (i = 0; i < 4; i++) {
+		float du = fabsf(u[i] - last[i]);
+		if (du * junction > limits.jerk[i])
+			junction = limits.jerk[i] / du;
+	}
+
+	if (count == ESTIMATOR_LOOKAHEAD)
+		retire(ESTIMATOR_LOOKAHEAD / 2);
+
+	length[count] = l;
+	nominal[count] = v;
+	maxentry[count] = junction;
+	entry[count] = junction;
+	count++;
+	entry[count] = 0;
+
+	memcpy(last, u, sizeof(last));
+	lastnominal = v;
+}
+
+/*
+ * backward then forward over the window: every move must be able to
+ * stop by the end of the window, and can't enter faster than the one
+ * before it could accelerate to. the first move's entry is already fixed
+ */
+void Estimator::plan() {
+	float twoa = 2 * limits.accel;
+	int i;
+	entry[count] = 0;
+	for (i = count - 1; i > 0; i--) {
+		float v = sqrtf(entry[i + 1] * entry[i + 1] + twoa * length[i]);
+		entry[i] = (maxentry[i] < v) ? maxentry[i] : v;
+	}
+	for (i = 0; i < (int) count; i++) {
+		float v = sqrtf(entry[i] * entry[i] + twoa * length[i]);
+		if (entry[i + 1] > v)
+			entry[i + 1] = v;
+	}
+}
+
+// time the oldest n moves as trapezoids, and drop them from the window
+void Estimator::retire(unsigned int n) {
+	plan();
+
+	float a = limits.accel;
+	float twoa = 2 * a;
+	double t = 0;
+	for (unsigned int i = 0; i < n; i++) {
+		float v0 = entry[i], v1 = entry[i + 1], vn = nominal[i], l = length[i];
+		float cruise = l - (2 * vn * vn - v0 * v0 - v1 * v1) / twoa;
+		float peak = sqrtf((twoa * l + v0 * v0 + v1 * v1) / 2);
+		float vp = (cruise >= 0) ? vn : peak;
+		t += (2 * vp - v0 - v1) / a + ((cruise > 0) ? cruise : 0) / vn;
+	}
+	elapsed += t;
+
+	count -= n;
+	memmove(length, &length[n], count * sizeof(float));
+	memmove(nominal, &nominal[n], count * sizeof(float));
+	memmove(maxentry, &maxentry[n], count * sizeof(float));
+	memmove(entry, &entry[n], (count + 1) * sizeof(float));
+}
+
+// time of the moves which have left the window so far
+double Estimator::time() {
+	return elapsed;
+}
+
+// finish as if the machine stops after the last move, and return the total
+double Estimator::flush() {
+	if (count)
+		retire(count);
+	memset(last, 0, sizeof(last));
+	lastnominal = 0;
+	return elapsed;
+}
@@ -0,0 +1,63 @@
+#ifndef _ESTIMATOR_HPP
+#define _ESTIMATOR_HPP
+
+#include "gcode.hpp"
+#include "printerstate.hpp"
+
+// moves planned together; the oldest half is retired once it fills up
+#define ESTIMATOR_LOOKAHEAD 32
+
+/*
+ * machine limits the firmware planner works to, in mm and seconds. the
+ * defaults are a typical Marlin machine, and a printer's capabilities
+ * override them: accel, jerk.x .. jerk.e, feedrate.x .. feedrate.e
+ */
+struct MotionLimits {
+	float accel;
+	float jerk[4];
+	float feedrate[4];
+};
+
+void motionlimits_init(MotionLimits *limits);
+
+/*
+ * Print time from the moves alone, planned the way the firmware does:
+ * trapezoidal speed profiles, junction speeds limited by jerk, and a
+ * lookahead window so a move only slows for corners it can see.
+ *
+ * Moves are kept as arrays of their properties rather than an array of
+ * moves, so planning and timing a batch are straight loops over floats.
+ */
+class Estimator {
+public:
+	Estimator();
+	Estimator(const MotionLimits *limits);
+
+	void setlimits(const MotionLimits *limits);
+	void reset();
+
+	// follow a line, adding its move if it has one
+	void apply(PrinterState *state, const GcodeLine *g);
+	void move(const float *from, const float *to, float feedrate);
+
+	double time();
+	double flush();
+protected:
+	MotionLimits limits;
+	double elapsed;
+
+	unsigned int count;
+	float length[ESTIMATOR_LOOKAHEAD];
+	float nominal[ESTIMATOR_LOOKAHEAD];
+	float maxentry[ESTIMATOR_LOOKAHEAD];
+	float entry[ESTIMATOR_LOOKAHEAD + 1];
+
+	// direction of the last move, to work out the next junction
+	float last[4];
+	float lastnominal;
+
+	void plan();
+	void retire(unsigned int n);
+};
+
+#endif /* _ESTIMATOR_HPP */
@@ -0,0 +1,119 @@
+#include "filter.hpp"
+
+#define WORD(g, letter) ((g)->words[(letter) - 'A'])
+#define HAS(g, letter) ((g)->seen & GCODE_WORD(letter))
+
+Filter::~Filter() {
+}
+
+FilterChain::FilterChain() {
+}
+
+FilterChain::~FilterChain() {
+	std::list<Filter *>::iterator i;
+	for (i = filters.begin(); i != filters.end(); i++)
+		delete *i;
+}
+
+void FilterChain::add(Filter *filter) {
+	filters.push_back(filter);
+}
+
+int FilterChain::empty() {
+	return filters.empty();
+}
+
+void FilterChain::run(FilterBatch *batch) {
+	std::list<Filter *>::iterator i;
+	for (i = filters.begin(); i != filters.end(); i++)
+		(*i)->run(batch);
+}
+
+FeedrateFilter::FeedrateFilter(float percent) {
+	scale = percent / 100;
+}
+
+void FeedrateFilter::run(FilterBatch *batch) {
+	for (unsigned int i = 0; i < batch->count; i++) {
+		GcodeLine *g = &batch->lines[i];
+		if (HAS(g, 'F') && HAS(g, 'G')) {
+			WORD(g, 'F') *= scale;
+			batch->dirty[i] = 1;
+		}
+	}
+}
+
+TemperatureFilter::TemperatureFilter(float hotend, float bed) {
+	this->hotend = hotend;
+	this->bed = bed;
+}
+
+void TemperatureFilter::run(FilterBatch *batch) {
+	for (unsigned int i = 0; i < batch->count; i++) {
+		GcodeLine *g = &batch->lines[i];
+		if (!HAS(g, 'M') || !HAS(g, 'S'))
+			continue;
+		float limit;
+		switch ((int) WORD(g, 'M')) {
+			case 104: case 109:
+				limit = hotend;
+				break;
+			case 140: case 190:
+				limit = bed;
+				break;
+			default:
+				continue;
+		}
+		if (WORD(g, 'S') > limit) {
+			WORD(g, 'S') = limit;
+			batch->dirty[i] = 1;
+		}
+	}
+}
+
+ZOffsetFilter::ZOffsetFilter(float offset) {
+	this->offset = offset;
+	relative = 0;
+}
+
+/*
+ * moves and G92 both shift, so the printer's idea of Z stays offset
+ * throughout. relative moves are left alone
+ */
+void ZOffsetFilter::run(FilterBatch *batch) {
+	for (unsigned int i = 0; i < batch->count; i++) {
+		GcodeLine *g = &batch->lines[i];
+		if (!HAS(g, 'G'))
+			continue;
+		switch ((int) WORD(g, 'G')) {
+			case 0: case 1: case 2: case 3:
+				if (relative || !HAS(g, 'Z'))
+					break;
+				WORD(g, 'Z') += offset;
+				batch->dirty[i] = 1;
+				break;
+			case 92:
+				if (!HAS(g, 'Z'))
+					break;
+				WORD(g, 'Z') += offset;
+				batch->dirty[i] = 1;
+				break;
+			case 90:
+				relative = 0;
+				break;
+			case 91:
+				relative = 1;
+				break;
+		}
+	}
+}
+
+void StripFilter::run(FilterBatch *batch) {
+	for (unsigned int i = 0; i < batch->count; i++) {
+		// string arguments aren't in the tokens and a checksum would need
+		// recomputing, so those lines stay as they are
+		const GcodeLine *g = &batch->lines[i];
+		if ((g->error == GCODE_OK) && (g->text < 0) && (g->checksum < 0))
+			batch->dirty[i] = 1;
+	}
+}
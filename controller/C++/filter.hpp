@@ -0,0 +1,78 @@
+#ifndef _FILTER_HPP
+#define _FILTER_HPP
+
+#include <list>
+
+#include "gcode.hpp"
+
+#define FILTER_BATCH 64
+
+/*
+ * Lines on their way through a job's filters, tokenized once. A filter
+ * which changes a line sets dirty, and the line is formatted afresh from
+ * its tokens; untouched lines go out as they came. Clearing a line's
+ * seen and bare drops it.
+ */
+struct FilterBatch {
+	unsigned int count;
+	GcodeLine lines[FILTER_BATCH];
+	uint8_t dirty[FILTER_BATCH];
+	uint16_t len[FILTER_BATCH];
+	char text[FILTER_BATCH][256];
+};
+
+class Filter {
+public:
+	virtual ~Filter();
+	virtual void run(FilterBatch *batch) = 0;
+};
+
+// filters run in the order they were added, each over the whole batch
+class FilterChain {
+public:
+	FilterChain();
+	~FilterChain();
+
+	void add(Filter *filter);
+	int empty();
+	void run(FilterBatch *batch);
+protected:
+	std::list<Filter *> filters;
+};
+
+// scale every F by percent
+class FeedrateFilter : public Filter {
+public:
+	FeedrateFilter(float percent);
+	void run(FilterBatch *batch);
+protected:
+	float scale;
+};
+
+// hold temperature targets at or below a limit, for hotends and the bed
+class TemperatureFilter : public Filter {
+public:
+	TemperatureFilter(float hotend, float bed);
+	void run(FilterBatch *batch);
+protected:
+	float hotend;
+	float bed;
+};
+
+// shift absolute Z by offset, eg. to make up for a thicker bed
+class ZOffsetFilter : public Filter {
+public:
+	ZOffsetFilter(float offset);
+	void run(FilterBatch *batch);
+protected:
+	float offset;
+	int relative;
+};
+
+// resend lines from their tokens, without comments or spare whitespace
+class StripFilter : public Filter {
+public:
+	void run(FilterBatch *batch);
+};
+
+#endif /* _FILTER_HPP */
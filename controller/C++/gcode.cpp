@@ -1,37 +1,502 @@
 #include "gcode.hpp"
 
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
-uint32_t Gcode::parse(const char *line, int len, float words[32]) {
-	uint32_t seen = 0;
-	for (int i = 0; i < len; ) {
-		char c = line[i];
-		int n = 255;
-		if (c >= 'a' && c <= 'z')
-			c -= 'a' - 'A';
-		if (c >= 'A' && c <= 'Z') {
-			n = c - 'A';
+/*
+ * Number parsing
+ *
+ * gcode numbers are a small subset of what strtof accepts, so we scan the
+ * digits into an integer mantissa and a decimal scale ourselves. Runs of
+ * digits are consumed eight (or four) at a time with SWAR tricks on a
+ * plain integer load where the line is long enough.
+ *
+ * Converting to float must round exactly like strtof. m / 10^k computed
+ * in double and then narrowed to float could round twice, so the division
+ * is rounded to odd instead- a double rounded to odd has enough extra bits
+ * that narrowing it to float gives the correctly rounded result. When
+ * m < 2^24 and k <= 10 both operands are exact floats, and plain double
+ * division is already safe, so that common case skips the fixup.
+ *
+ * Mantissas too big to be exact in a double fall back to strtof. We never
+ * call setlocale(), so strtof is always in the C locale.
+ */
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define GCODE_SWAR 1
+#endif
+
+static const double pow10[] = {
+	1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+	1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+	1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#ifdef GCODE_SWAR
+static inline int swar8(const char *p, uint64_t *v) {
+	uint64_t x;
+	memcpy(&x, p, 8);
+	if ((((x & 0xF0F0F0F0F0F0F0F0ULL) | (((x + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4))) != 0x3333333333333333ULL)
+		return 0;
+	x -= 0x3030303030303030ULL;
+	x = (x * 10) + (x >> 8);
+	x = (((x & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) + (((x >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+	*v = x;
+	return 1;
+}
+
+static inline int swar4(const char *p, uint32_t *v) {
+	uint32_t x;
+	memcpy(&x, p, 4);
+	if ((((x & 0xF0F0F0F0U) | (((x + 0x06060606U) & 0xF0F0F0F0U) >> 4))) != 0x33333333U)
+		return 0;
+	x -= 0x30303030U;
+	x = (x * 10) + (x >> 8);
+	x = ((x & 0x00FF00FFU) * ((100 << 16) + 1)) >> 16;
+	*v = x & 0xFFFF;
+	return 1;
+}
+#endif
+
+// append a run of digits to *m, returns how many there were
+static inline int digits(const char *p, const char *end, uint64_t *m) {
+	const char *start = p;
+	uint64_t v = *m;
+#ifdef GCODE_SWAR
+	uint64_t v8;
+	uint32_t v4;
+	while ((end - p >= 8) && swar8(p, &v8)) {
+		v = v * 100000000ULL + v8;
+		p += 8;
+	}
+	if ((end - p >= 4) && swar4(p, &v4)) {
+		v = v * 10000 + v4;
+		p += 4;
+	}
+#endif
+	while ((p < end) && (*p >= '0') && (*p <= '9')) {
+		v = v * 10 + (*p - '0');
+		p++;
+	}
+	*m = v;
+	return p - start;
+}
+
+/*
+ * scan sign, digits and fraction. returns characters used, or 0 if there
+ * are no digits. *exact is cleared if the mantissa may have overflowed
+ */
+static inline int scan(const char *p, const char *end, uint64_t *m, int *scale, int *neg, int *exact) {
+	const char *start = p;
+	int n, f = 0;
+
+	*m = 0;
+	*neg = 0;
+	*exact = 1;
+
+	if ((p < end) && ((*p == '-') || (*p == '+'))) {
+		*neg = (*p == '-');
+		p++;
+	}
+	// leading zeros don't count towards overflow
+	while ((p + 1 < end) && (p[0] == '0') && (p[1] >= '0') && (p[1] <= '9'))
+		p++;
+	n = digits(p, end, m);
+	p += n;
+	if ((p < end) && (*p == '.')) {
+		p++;
+		f = digits(p, end, m);
+		p += f;
+	}
+	if (n + f == 0)
+		return 0;
+	if (n + f > 19)
+		*exact = 0;
+	*scale = f;
+	return p - start;
+}
+
+int Gcode::number(const char *p, const char *end, float *value) {
+	uint64_t m;
+	int scale, neg, exact;
+	int l = scan(p, end, &m, &scale, &neg, &exact);
+	if (l == 0)
+		return 0;
+
+	float f;
+	if (exact && (scale == 0)) {
+		f = (float) m;
+	}
+	else if (exact && (m <= (1ULL << 24)) && (scale <= 10)) {
+		f = (float) ((double) m / pow10[scale]);
+	}
+	else if (exact && (m < (1ULL << 53)) && (scale <= 22)) {
+		double d = pow10[scale];
+		double q = (double) m / d;
+		double r = __builtin_fma(-q, d, (double) m);
+		if (r != 0) {
+			// round to odd: of the two doubles either side of m / d pick
+			// the one with its last bit set
+			uint64_t bits;
+			memcpy(&bits, &q, 8);
+			if ((bits & 1) == 0) {
+				bits += (r > 0) ? 1 : -1;
+				memcpy(&q, &bits, 8);
+			}
 		}
-		else if (c == '*') {
-			n = 26;
+		f = (float) q;
+	}
+	else {
+		// strtof wants the whole span, however many digits it runs to
+		char buf[64];
+		char *s = (l < (int) sizeof(buf)) ? buf : (char *) malloc(l + 1);
+		if (s == NULL)
+			return 0;
+		memcpy(s, p, l);
+		s[l] = 0;
+		*value = strtof(s, NULL);
+		if (s != buf)
+			free(s);
+		return l;
+	}
+
+	*value = neg ? -f : f;
+	return l;
+}
+
+// one number() against strtof on the same len characters. line has room
+// past them for digits that number() mustn't read
+static int checknumber(char *line, int len) {
+	char term[512];
+	memcpy(term, line, len);
+	term[len] = 0;
+	memcpy(line + len, "99", 2);
+
+	float got = 0, want = strtof(term, NULL);
+	int used = Gcode::number(line, line + len, &got);
+	if ((used == len) && (memcmp(&got, &want, sizeof(float)) == 0))
+		return 0;
+	printf("gcode: %s gave %.9g (%d chars), strtof %.9g\n", term, got, used, want);
+	return 1;
+}
+
+/*
+ * number() against strtof, bit for bit, on numbers picked to hit each of
+ * its paths- short exact ones, the round-to-odd division, and runs of
+ * digits too long for the mantissa. returns the number of mismatches
+ */
+int Gcode::check(void) {
+	static const char *edges[] = {
+		"0", "-0", "+1", "16777216", "16777217", "0.1", "-0.3", "3.4028235",
+		"1.00000005960464477539", "1.0000000596046447753906250000001",
+		"9007199254740993", "0.000000000000000000000000000000000000000000001",
+		"340282356779733661637539395458142568448",
+		// double lands on a float halfway point, round to nearest twice
+		// would get these wrong
+		"1.06985741853714", "1.17369943857193", "-1.19163578748703",
+	};
+	char line[512];
+	uint64_t seed = 0x9e3779b97f4a7c15ULL;
+	int cases = 0, failed = 0;
+
+	for (unsigned int i = 0; i < sizeof(edges) / sizeof(edges[0]); i++, cases++) {
+		memcpy(line, edges[i], strlen(edges[i]));
+		failed += checknumber(line, strlen(edges[i]));
+	}
+	// xorshift, so every run checks the same numbers. mostly short ones,
+	// every eighth with up to 120 integer digits and every sixteenth with
+	// up to 200 fraction digits
+	for (int i = 0; i < 200000; i++, cases++) {
+		int len = 0;
+		seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+		int n = 1 + (seed >> 8) % ((i & 7) ? 12 : 120);
+		int f = ((seed >> 20) & 3) ? (int) ((seed >> 24) % ((i & 15) ? 12 : 200)) : -1;
+		if (seed & 1)
+			line[len++] = '-';
+		for (int d = 0; d < n + f + 1; d++) {
+			if (d == n) {
+				line[len++] = '.';
+				continue;
+			}
+			seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+			line[len++] = '0' + (seed >> 33) % 10;
 		}
-		else if (c != ' ' || c != '\t' || c != '\r' || c != '\n') {
-			// non-whitespace in gcode- bad line?
-			printf("invalid gcode:\n\"%s\"\n", line);
-			for (;i;i--) printf(" ");
-			printf("^\n");
+		if (checknumber(line, len) && (failed++ > 10))
+			break;
+	}
+	printf("gcode: %d numbers, %d failed\n", cases, failed);
+	return failed;
+}
+
+/*
+ * parse into an integer count of 10^-decimals units, eg. with decimals
+ * 3, "12.3456" is 12346. returns 0 if there's no number or it won't fit
+ */
+int Gcode::fixed(const char *p, const char *end, int32_t *value, int decimals) {
+	uint64_t m;
+	int scale, neg, exact;
+	int l = scan(p, end, &m, &scale, &neg, &exact);
+	if ((l == 0) || !exact)
+		return 0;
+
+	for (; scale < decimals; scale++) {
+		if (m > (uint64_t) INT32_MAX)
 			return 0;
+		m *= 10;
+	}
+	if (scale > decimals) {
+		uint64_t d = 1;
+		for (; scale > decimals; scale--)
+			d *= 10;
+		m = (m + d / 2) / d;
+	}
+	if (m > (uint64_t) INT32_MAX)
+		return 0;
+
+	*value = neg ? -(int32_t) m : (int32_t) m;
+	return l;
+}
+
+// these take the rest of the line as a single string argument
+static int takes_text(const GcodeLine *g) {
+	if (!(g->seen & GCODE_WORD('M')))
+		return 0;
+	switch ((int) g->words['M' - 'A']) {
+		case 23: case 28: case 30: case 32: case 117: case 118:
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Tokenize one line of gcode in a single pass, eg.
+ *
+ *	N123 G1 X10.5 Y-3 E0.42 F1800 (move) ; comment *71
+ *
+ * Never prints anything; on a malformed line out->error says what went
+ * wrong and out->erroroffset where, and the words up to that point are
+ * kept. Returns out->error.
+ */
+int Gcode::parse(const char *line, int len, GcodeLine *out) {
+	const char *end = line + len;
+	const char *p = line;
+	uint8_t sum = 0;
+
+	out->seen = 0;
+	out->bare = 0;
+	out->n = -1;
+	out->checksum = -1;
+	out->checksumok = 0;
+	out->comment = -1;
+	out->commentlen = 0;
+	out->text = -1;
+	out->textlen = 0;
+	out->error = GCODE_OK;
+	out->erroroffset = 0;
+
+	while (p < end) {
+		char c = *p;
+
+		if ((c == ' ') || (c == '\t') || (c == '\r') || (c == '\n')) {
+			sum ^= c;
+			p++;
+			continue;
+		}
+
+		if (c == ';') {
+			const char *e = p + 1;
+			while ((e < end) && (*e != '\r') && (*e != '\n'))
+				e++;
+			if (out->comment < 0) {
+				out->comment = p + 1 - line;
+				out->commentlen = e - p - 1;
+			}
+			break;
+		}
+
+		if (c == '(') {
+			const char *e = (const char *) memchr(p, ')', end - p);
+			if (e == NULL) {
+				out->error = GCODE_ERROR_COMMENT;
+				out->erroroffset = p - line;
+				return out->error;
+			}
+			if (out->comment < 0) {
+				out->comment = p + 1 - line;
+				out->commentlen = e - p - 1;
+			}
+			for (; p <= e; p++)
+				sum ^= *p;
+			continue;
+		}
+
+		if (c == '*') {
+			const char *q = p + 1;
+			int v = 0;
+			while ((q < end) && (*q >= '0') && (*q <= '9'))
+				v = v * 10 + (*q++ - '0');
+			if ((q == p + 1) || (v > 255)) {
+				out->error = GCODE_ERROR_CHECKSUM;
+				out->erroroffset = p - line;
+				return out->error;
+			}
+			out->checksum = v;
+			out->checksumok = (v == sum);
+			p = q;
+			continue;
+		}
+
+		if ((c >= 'a') && (c <= 'z'))
+			c -= 'a' - 'A';
+		if ((c < 'A') || (c > 'Z')) {
+			out->error = GCODE_ERROR_UNEXPECTED;
+			out->erroroffset = p - line;
+			return out->error;
+		}
+
+		const char *word = p;
+		int w = c - 'A';
+		p++;
+		while ((p < end) && ((*p == ' ') || (*p == '\t')))
+			p++;
+
+		if (c == 'N') {
+			const char *q = p;
+			long v = 0;
+			while ((q < end) && (*q >= '0') && (*q <= '9'))
+				v = v * 10 + (*q++ - '0');
+			if (q == p) {
+				out->error = GCODE_ERROR_NUMBER;
+				out->erroroffset = p - line;
+				return out->error;
+			}
+			out->n = v;
+			out->words[w] = v;
+			out->seen |= 1UL << w;
+			p = q;
 		}
-		if (n < 32) {
-			i++;
-			char *ep = (char *) &line[i];;
-			words[n] = strtof(ep, &ep);
-			if (ep > &line[i]) {
-				seen |= 1<<n;
-				i += ep - &line[i];
+		else {
+			int l = number(p, end, &out->words[w]);
+			if (l > 0) {
+				out->seen |= 1UL << w;
+				out->bare &= ~(1UL << w);
+				p += l;
+			}
+			else if ((p < end) && (((*p >= '0') && (*p <= '9')) || (*p == '-') || (*p == '+') || (*p == '.'))) {
+				out->error = GCODE_ERROR_NUMBER;
+				out->erroroffset = p - line;
+				return out->error;
+			}
+			else {
+				out->bare |= 1UL << w;
 			}
 		}
+		for (; word < p; word++)
+			sum ^= *word;
+
+		if (takes_text(out) && (out->text < 0)) {
+			while ((p < end) && ((*p == ' ') || (*p == '\t'))) {
+				sum ^= *p;
+				p++;
+			}
+			const char *e = p;
+			while ((e < end) && (*e != '*') && (*e != ';') && (*e != '\r') && (*e != '\n'))
+				e++;
+			const char *t = e;
+			while ((t > p) && ((t[-1] == ' ') || (t[-1] == '\t')))
+				t--;
+			out->text = p - line;
+			out->textlen = t - p;
+			for (; p < e; p++)
+				sum ^= *p;
+		}
+	}
+
+	return out->error;
+}
+
+static const int64_t powers[] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
+
+/*
+ * a number as gcode writes it- rounded to decimals places, no trailing
+ * zeros, no -0. buf needs room for 24 characters
+ */
+static int format_number(char *buf, float value, int decimals) {
+	double scaled = (double) value * powers[decimals];
+	if (!(fabs(scaled) < 1e18))
+		// nothing sensible, but keep it to one word
+		return snprintf(buf, 24, "%.0f", (fabs(value) < 1e18) ? value : 0.0);
+	int64_t v = llrint(scaled);
+	char digits[24];
+	int l = 0, n = 0;
+	if (v < 0) {
+		buf[l++] = '-';
+		v = -v;
+	}
+	// trailing zeros of the fraction never get written
+	while ((decimals > 0) && (v % 10 == 0)) {
+		v /= 10;
+		decimals--;
+	}
+	do {
+		digits[n++] = '0' + (v % 10);
+		v /= 10;
+	} while ((v > 0) || (n <= decimals));
+	while (n > 0) {
+		if (n == decimals)
+			buf[l++] = '.';
+		buf[l++] = digits[--n];
+	}
+	return l;
+}
+
+/*
+ * write a tokenized line back out as text, command words first. comments
+ * and string arguments aren't in the tokens, so they're lost. returns the
+ * length including the newline, or -1 if buf is too small
+ */
+int Gcode::format(const GcodeLine *g, char *buf, int len) {
+	return encode(g, buf, len);
+}
+
+/*
+ * format() for the wire. each letter is written to decimals[letter - 'A']
+ * places (4 if decimals is NULL), letters in drop are left out, and compact
+ * leaves out the spaces too. a line with an N word gets its N from the
+ * tokens and a fresh checksum, as the words it covers may have changed
+ */
+int Gcode::encode(const GcodeLine *g, char *buf, int len, uint32_t drop, const int8_t *decimals, int compact) {
+	static const char order[] = "GMTABCDHIJKLOPQRSUVWXYZEF";
+	int l = 0;
+	if (len < 32)
+		return -1;
+	if (g->seen & GCODE_WORD('N'))
+		l = snprintf(buf, len, "N%ld", g->n);
+	for (const char *o = order; *o; o++) {
+		uint32_t w = GCODE_WORD(*o);
+		if (!((g->seen | g->bare) & w) || (drop & w))
+			continue;
+		if (l + 28 > len)
+			return -1;
+		if (l && !compact)
+			buf[l++] = ' ';
+		buf[l++] = *o;
+		if (g->seen & w)
+			l += format_number(&buf[l], g->words[*o - 'A'], decimals ? decimals[*o - 'A'] : 4);
+	}
+	if (g->seen & GCODE_WORD('N')) {
+		uint8_t sum = 0;
+		for (int i = 0; i < l; i++)
+			sum ^= buf[i];
+		if (l + 6 > len)
+			return -1;
+		l += snprintf(&buf[l], 6, "*%u", sum);
 	}
-	return seen;
+	if (l + 2 > len)
+		return -1;
+	buf[l++] = 10;
+	buf[l] = 0;
+	return l;
 }
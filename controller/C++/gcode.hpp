@@ -2,10 +2,52 @@
 #define _GCODE_HPP
 
 #include <cstdint>
+#include <cstddef>
+
+#define GCODE_OK               0
+#define GCODE_ERROR_UNEXPECTED 1
+#define GCODE_ERROR_NUMBER     2
+#define GCODE_ERROR_COMMENT    3
+#define GCODE_ERROR_CHECKSUM   4
+
+#define GCODE_WORD(letter) (1UL << ((letter) - 'A'))
+
+/*
+ * one tokenized line. offsets are into the line that was parsed
+ */
+struct GcodeLine {
+	uint32_t seen;       // GCODE_WORD(x) set if words[x - 'A'] holds a value
+	uint32_t bare;       // letters present without a value, eg. G28 X Y
+	float words[26];
+
+	long n;              // N line number, -1 if none
+	int checksum;        // value after '*', -1 if none
+	int checksumok;      // checksum present and matches
+
+	int16_t comment;     // first ; or () comment, without delimiters
+	int16_t commentlen;
+	int16_t text;        // string argument of M23, M117 etc.
+	int16_t textlen;
+
+	int16_t error;       // GCODE_OK or GCODE_ERROR_*
+	int16_t erroroffset;
+};
 
 class Gcode {
 public:
-	static uint32_t parse(const char *line, int len, float words[32]);
+	static int parse(const char *line, int len, GcodeLine *out);
+	static int format(const GcodeLine *g, char *buf, int len);
+	static int encode(const GcodeLine *g, char *buf, int len, uint32_t drop = 0, const int8_t *decimals = NULL, int compact = 0);
+
+	/*
+	 * parse a gcode number- optional sign, digits, optional fraction, no
+	 * exponent- starting at p. returns the number of characters used, 0 if
+	 * there isn't a number there. number() rounds exactly as strtof would
+	 */
+	static int number(const char *p, const char *end, float *value);
+	static int fixed(const char *p, const char *end, int32_t *value, int decimals);
+
+	static int check(void);
 };
 
 #endif /* _GCODE_HPP */
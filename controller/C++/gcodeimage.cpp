@@ -0,0 +1,644 @@
+#include "gcodeimage.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+namespace C {
+	#include <unistd.h>
+	#include <sys/types.h>
+	#include <sys/stat.h>
+	#include <sys/mman.h>
+	#include <fcntl.h>
+
+	extern "C" int printf(const char *format, ...);
+}
+
+#define GCODEIMAGE_ALIGN(x) (((x) + 7) & ~((uint64_t) 7))
+
+static const char padding[8] = { 0 };
+
+// follow one line's effect on the printer, and on the filament used
+static void track(PrinterState *state, double *extruded, const GcodeLine *g) {
+	float e = state->target[AXIS_E];
+	printerstate_apply(state, g);
+	if ((g->seen & GCODE_WORD('G')) && (g->words['G' - 'A'] <= 3) && (g->seen & GCODE_WORD('E')))
+		*extruded += state->target[AXIS_E] - e;
+}
+
+static void mark(GcodeImageCheckpoint *cp, uint64_t line, unsigned int layer, int flags, double extruded, double time, const PrinterState *state) {
+	cp->line = line;
+	cp->layer = layer;
+	cp->flags = flags;
+	cp->extruded = extruded;
+	cp->time = time;
+	cp->state = *state;
+}
+
+GcodeImage::GcodeImage() {
+	map = NULL;
+	maplen = 0;
+	header = NULL;
+	index = NULL;
+	checkpoints = NULL;
+}
+
+GcodeImage::~GcodeImage() {
+	close();
+}
+
+/*
+ * tokenize a gcode file into an image. this reads the whole file, so it
+ * belongs at upload time rather than anywhere near a running print.
+ * times are estimated with limits, or the defaults if that's NULL.
+ * returns the number of lines, or -1 on error
+ */
+int GcodeImage::ingest(const char *source, const char *image, const MotionLimits *limits) {
+	int fd = C::open(source, O_RDONLY);
+	if (fd == -1) {
+		perror(source);
+		return -1;
+	}
+	struct C::stat st;
+	if (C::fstat(fd, &st) == -1) {
+		perror(source);
+		C::close(fd);
+		return -1;
+	}
+	uint64_t size = st.st_size;
+	const char *text = NULL;
+	if (size > 0) {
+		text = (const char *) C::mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (text == MAP_FAILED) {
+			perror(source);
+			C::close(fd);
+			return -1;
+		}
+		C::madvise((void *) text, size, MADV_SEQUENTIAL);
+	}
+	C::close(fd);
+
+	// written beside the image and renamed over it, as the image may be
+	// mapped by a print which truncating it would kill with SIGBUS
+	char *tmp = (char *) malloc(strlen(image) + 8);
+	sprintf(tmp, "%s.XXXXXX", image);
+	int tfd = mkstemp(tmp);
+	FILE *out = (tfd == -1) ? NULL : fdopen(tfd, "w");
+	if (out == NULL) {
+		perror(tmp);
+		if (tfd != -1) {
+			C::close(tfd);
+			C::unlink(tmp);
+		}
+		free(tmp);
+		if (text)
+			C::munmap((void *) text, size);
+		return -1;
+	}
+	C::fchmod(tfd, 0644);
+
+	GcodeImageHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, GCODEIMAGE_MAGIC, sizeof(h.magic));
+	h.version = GCODEIMAGE_VERSION;
+	h.text = GCODEIMAGE_ALIGN(sizeof(h));
+	h.textlen = size;
+	if (limits)
+		h.limits = *limits;
+	else
+		motionlimits_init(&h.limits);
+	h.records = GCODEIMAGE_ALIGN(h.text + size);
+
+	// the text goes in as it is, so record offsets are source offsets
+	fwrite(&h, sizeof(h), 1, out);
+	fwrite(padding, 1, h.text - sizeof(h), out);
+	if (size)
+		fwrite(text, 1, size, out);
+	fwrite(padding, 1, h.records - h.text - size, out);
+
+	std::vector<uint64_t> offsets;
+	uint64_t offset = h.records;
+	char buf[sizeof(GcodeImageRecord) + 26 * sizeof(float)];
+	GcodeImageRecord *r = (GcodeImageRecord *) buf;
+	GcodeLine g;
+
+	// run the print through a PrinterState as we go, so a resume can start
+	// from the nearest checkpoint rather than the top of the file
+	std::vector<GcodeImageCheckpoint> checkpoints;
+	GcodeImageCheckpoint cp, zmove;
+	PrinterState state;
+	printerstate_init(&state);
+	double extruded = 0;
+	Estimator estimator(&h.limits);
+	unsigned int layer = 0;
+	float layerz = 0;
+	int zpending = 0;
+
+	for (uint64_t p = 0; p < size; ) {
+		const char *line = text + p;
+		const char *nl = (const char *) memchr(line, 10, size - p);
+		uint64_t len = nl ? (uint64_t) (nl - line) : size - p;
+
+		memset(r, 0, sizeof(*r));
+		r->text = p;
+		if (len > 0x7FFF) {
+			// too long for the tokenizer, and for any firmware
+			r->flags = GCODEIMAGE_ERROR;
+			r->textlen = 0xFFFF;
+		}
+		else {
+			if (Gcode::parse(line, len, &g) != GCODE_OK)
+				r->flags |= GCODEIMAGE_ERROR;
+			if ((g.seen == 0) && (g.bare == 0))
+				r->flags |= GCODEIMAGE_EMPTY;
+			r->seen = g.seen;
+			r->bare = g.bare;
+
+			// only the command part is sent, so trailing ; comments go
+			const char *c = (const char *) memchr(line, ';', len);
+			unsigned int l = c ? c - line : len;
+			while ((l > 0) && (line[l - 1] <= 32))
+				l--;
+			r->textlen = l;
+			for (unsigned int i = 0; i < l; i++)
+				r->sum ^= line[i];
+		}
+
+		uint64_t i = offsets.size();
+		if ((i % GCODEIMAGE_INTERVAL) == 0) {
+			mark(&cp, i, layer, 0, extruded, estimator.time(), &state);
+			checkpoints.push_back(cp);
+		}
+		if (r->flags == 0) {
+			int move = (g.seen & GCODE_WORD('G')) && (g.words['G' - 'A'] <= 3);
+			if ((g.seen & (GCODE_WORD('G') | GCODE_WORD('M') | GCODE_WORD('T'))) == GCODE_WORD('T')) {
+				mark(&cp, i, layer, GCODEIMAGE_TOOL, extruded, estimator.time(), &state);
+				checkpoints.push_back(cp);
+			}
+			// only these can move Z, so only these need the state kept
+			if ((g.seen & GCODE_WORD('G')) && (((g.seen | g.bare) & GCODE_WORD('Z')) || (g.words['G' - 'A'] == 28)))
+				mark(&cp, i, 0, GCODEIMAGE_LAYER, extruded, estimator.time(), &state);
+
+			float z = state.target[AXIS_Z];
+			double e = extruded;
+			float from[4];
+			memcpy(from, state.target, sizeof(from));
+			track(&state, &extruded, &g);
+			if (move)
+				estimator.move(from, state.target, state.feedrate);
+			if (state.target[AXIS_Z] != z) {
+				zmove = cp;
+				zpending = 1;
+			}
+
+			// the first extrusion at a new height starts a layer
+			if (move && zpending && (extruded > e) && (g.seen & (GCODE_WORD('X') | GCODE_WORD('Y'))) && ((layer == 0) || (state.target[AXIS_Z] != layerz))) {
+				zmove.layer = ++layer;
+				layerz = state.target[AXIS_Z];
+				zpending = 0;
+				// checkpoints since the Z move belong to the new layer
+				std::vector<GcodeImageCheckpoint>::iterator c = checkpoints.end();
+				while ((c != checkpoints.begin()) && ((c - 1)->line > zmove.line)) {
+					--c;
+					c->layer = layer;
+				}
+				checkpoints.insert(c, zmove);
+			}
+		}
+
+		int k = 0;
+		for (uint32_t b = r->seen; b; b &= b - 1)
+			r->words[k++] = g.words[__builtin_ctz(b)];
+
+		unsigned int rl = GCODEIMAGE_ALIGN(sizeof(*r) + k * sizeof(float));
+		memset(&buf[sizeof(*r) + k * sizeof(float)], 0, rl - sizeof(*r) - k * sizeof(float));
+		fwrite(r, 1, rl, out);
+		offsets.push_back(offset);
+		offset += rl;
+
+		p += len + 1;
+	}
+
+	h.lines = offsets.size();
+	h.index = offset;
+	if (h.lines)
+		fwrite(&offsets[0], sizeof(uint64_t), h.lines, out);
+
+	if (checkpoints.empty()) {
+		mark(&cp, 0, 0, 0, 0, 0, &state);
+		checkpoints.push_back(cp);
+	}
+	h.checkpoints = h.index + h.lines * sizeof(uint64_t);
+	h.ncheckpoints = checkpoints.size();
+	h.layers = layer;
+	h.extruded = extruded;
+	h.time = estimator.flush();
+	fwrite(&checkpoints[0], sizeof(GcodeImageCheckpoint), h.ncheckpoints, out);
+
+	// header last, so a half-written image is never mistaken for a good one
+	fseek(out, 0, SEEK_SET);
+	fwrite(&h, sizeof(h), 1, out);
+
+	int error = ferror(out);
+	if (fclose(out) != 0)
+		error = 1;
+	if (text)
+		C::munmap((void *) text, size);
+	if (!error && (rename(tmp, image) == -1))
+		error = 1;
+	if (error) {
+		perror(image);
+		C::unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return h.lines;
+}
+
+GcodeImageIngest::GcodeImageIngest(Socket *client, const char *source, const char *image, const MotionLimits *limits) {
+	this->client = client;
+	if (client)
+		client->ref();
+	this->source = strdup(source);
+	this->image = strdup(image);
+	this->limits = *limits;
+	lines = -1;
+}
+
+GcodeImageIngest::~GcodeImageIngest() {
+	free(source);
+	free(image);
+	if (client)
+		client->unref();
+}
+
+void GcodeImageIngest::run() {
+	lines = GcodeImage::ingest(source, image, &limits);
+}
+
+void GcodeImageIngest::done() {
+	if (lines < 0)
+		C::printf("Could not ingest %s\n", source);
+	else
+		C::printf("Ingested %d lines from %s into %s\n", lines, source, image);
+	if (client && (client->opened() >= 0)) {
+		if (lines < 0)
+			client->printf("Could not ingest %s\n", source);
+		else
+			client->printf("Ingested %d lines into %s\n", lines, image);
+	}
+	delete this;
+}
+
+// the sections have to fit the file without overflowing. records are
+// checked by record() as they're reached, so open() stays cheap
+static int valid(const GcodeImageHeader *h, uint64_t size) {
+	return (h->index <= size) && (h->checkpoints <= size) && (h->lines <= (size - h->index) / sizeof(uint64_t)) &&
+		(h->ncheckpoints <= (size - h->checkpoints) / sizeof(GcodeImageCheckpoint)) &&
+		(h->text <= size) && (h->textlen <= size - h->text) &&
+		!((h->index | h->checkpoints | h->records) & 7);
+}
+
+int GcodeImage::open(const char *image) {
+	close();
+
+	int fd = C::open(image, O_RDONLY);
+	if (fd == -1) {
+		perror(image);
+		return -1;
+	}
+	struct C::stat st;
+	if ((C::fstat(fd, &st) == -1) || ((uint64_t) st.st_size < sizeof(GcodeImageHeader))) {
+		C::printf("%s is not a gcode image\n", image);
+		C::close(fd);
+		return -1;
+	}
+	void *m = C::mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	C::close(fd);
+	if (m == MAP_FAILED) {
+		perror(image);
+		return -1;
+	}
+
+	const GcodeImageHeader *h = (const GcodeImageHeader *) m;
+	if ((memcmp(h->magic, GCODEIMAGE_MAGIC, sizeof(h->magic)) != 0) ||
+		(h->version != GCODEIMAGE_VERSION) ||
+		(h->index + h->lines * sizeof(uint64_t) > h->checkpoints) ||
+		(h->ncheckpoints == 0) ||
+		(h->checkpoints + h->ncheckpoints * sizeof(GcodeImageCheckpoint) > (uint64_t) st.st_size) ||
+		(h->text + h->textlen > h->records) ||
+		(h->records > h->index) ||
+		!valid(h, st.st_size)) {
+		C::printf("%s is not a gcode image\n", image);
+		C::munmap(m, st.st_size);
+		return -1;
+	}
+
+	map = (const char *) m;
+	maplen = st.st_size;
+	header = h;
+	index = (const uint64_t *) (map + h->index);
+	checkpoints = (const GcodeImageCheckpoint *) (map + h->checkpoints);
+	return 0;
+}
+
+void GcodeImage::close() {
+	if (map)
+		C::munmap((void *) map, maplen);
+	map = NULL;
+	maplen = 0;
+	header = NULL;
+	index = NULL;
+	checkpoints = NULL;
+}
+
+uint64_t GcodeImage::lines() {
+	return header ? header->lines : 0;
+}
+
+/*
+ * NULL past the end, or if the index entry isn't a whole record between
+ * the records and the index, with words for letters only and its text
+ * within the text section- so text() never reads outside the map
+ */
+const GcodeImageRecord *GcodeImage::record(uint64_t line) {
+	if (line >= lines())
+		return NULL;
+	uint64_t o = index[line];
+	if ((o < header->records) || (o > header->index) || (o & 7) || (header->index - o < sizeof(GcodeImageRecord)))
+		return NULL;
+	const GcodeImageRecord *r = (const GcodeImageRecord *) (map + o);
+	if (((r->seen | r->bare) & ~(uint32_t) (GCODE_WORD('Z' + 1) - 1)) ||
+		(header->index - o < sizeof(*r) + __builtin_popcount(r->seen) * sizeof(float)) ||
+		(r->text > header->textlen) ||
+		((r->textlen != 0xFFFF) && (r->textlen > header->textlen - r->text)))
+		return NULL;
+	return r;
+}
+
+const char *GcodeImage::text(const GcodeImageRecord *r) {
+	return map + header->text + r->text;
+}
+
+// unpack a record. comment and text offsets aren't kept
+void GcodeImage::tokens(const GcodeImageRecord *r, GcodeLine *g) {
+	g->seen = r->seen;
+	g->bare = r->bare;
+	int k = 0;
+	for (uint32_t b = r->seen; b; b &= b - 1)
+		g->words[__builtin_ctz(b)] = r->words[k++];
+	g->n = (r->seen & GCODE_WORD('N')) ? (long) g->words['N' - 'A'] : -1;
+	g->checksum = -1;
+	g->checksumok = 0;
+	g->comment = -1;
+	g->commentlen = 0;
+	g->text = -1;
+	g->textlen = 0;
+	g->error = (r->flags & GCODEIMAGE_ERROR) ? GCODE_ERROR_UNEXPECTED : GCODE_OK;
+	g->erroroffset = 0;
+}
+
+unsigned int GcodeImage::layers() {
+	return header ? header->layers : 0;
+}
+
+double GcodeImage::extruded() {
+	return header ? header->extruded : 0;
+}
+
+double GcodeImage::time() {
+	return header ? header->time : 0;
+}
+
+/*
+ * estimated time left from line on, re-planning only the stretch since
+ * the last checkpoint, so it's cheap enough to ask while printing
+ */
+double GcodeImage::remaining(uint64_t line) {
+	const GcodeImageCheckpoint *cp = checkpoint(line);
+	if (cp == NULL)
+		return 0;
+	if (line > lines())
+		line = lines();
+	PrinterState state = cp->state;
+	Estimator estimator(&header->limits);
+	GcodeLine g;
+	for (uint64_t i = cp->line; i < line; i++) {
+		const GcodeImageRecord *r = record(i);
+		if ((r == NULL) || r->flags)
+			continue;
+		tokens(r, &g);
+		estimator.apply(&state, &g);
+	}
+	double left = header->time - cp->time - estimator.flush();
+	return (left > 0) ? left : 0;
+}
+
+static bool byline(uint64_t line, const GcodeImageCheckpoint &cp) {
+	return line < cp.line;
+}
+
+static bool bylayer(const GcodeImageCheckpoint &cp, unsigned int layer) {
+	return cp.layer < layer;
+}
+
+// first line of a layer, or lines() if there's no such layer
+uint64_t GcodeImage::layerline(unsigned int layer) {
+	if (layer == 0)
+		return 0;
+	const GcodeImageCheckpoint *end = checkpoints + header->ncheckpoints;
+	const GcodeImageCheckpoint *cp = std::lower_bound(checkpoints, end, layer, bylayer);
+	if ((cp == end) || (cp->layer != layer))
+		return lines();
+	return cp->line;
+}
+
+// the last checkpoint at or before line
+const GcodeImageCheckpoint *GcodeImage::checkpoint(uint64_t line) {
+	if (header == NULL)
+		return NULL;
+	const GcodeImageCheckpoint *cp = std::upper_bound(checkpoints, checkpoints + header->ncheckpoints, line, byline);
+	return (cp == checkpoints) ? NULL : cp - 1;
+}
+
+/*
+ * the printer's state just before line, replayed from the nearest
+ * checkpoint- at most GCODEIMAGE_INTERVAL lines. returns the number of
+ * lines replayed, or -1
+ */
+int GcodeImage::state(uint64_t line, PrinterState *state, double *extruded) {
+	const GcodeImageCheckpoint *cp = checkpoint(line);
+	if (cp == NULL)
+		return -1;
+	if (line > lines())
+		line = lines();
+	*state = cp->state;
+	*extruded = cp->extruded;
+	GcodeLine g;
+	for (uint64_t i = cp->line; i < line; i++) {
+		const GcodeImageRecord *r = record(i);
+		if ((r == NULL) || r->flags)
+			continue;
+		tokens(r, &g);
+		track(state, extruded, &g);
+	}
+	return line - cp->line;
+}
+
+/*
+ * gcode to bring a freshly reset printer back to where it was just before
+ * line: heat up, select the tool, home X and Y, and put the logical Z and
+ * E positions back. Z can't be homed without hitting the print, so it's
+ * assumed not to have moved. returns the length, or -1 if buf is too small
+ */
+int GcodeImage::preamble(uint64_t line, char *buf, int len) {
+	PrinterState s;
+	double extruded;
+	if (state(line, &s, &extruded) < 0)
+		return -1;
+
+	int l = 0, i;
+#define EMIT(...) do { \
+		int r = snprintf(&buf[l], len - l, __VA_ARGS__); \
+		if ((r < 0) || (r >= len - l)) \
+			return -1; \
+		l += r; \
+	} while (0)
+
+	if (s.bed_target > 0)
+		EMIT("M140 S%.0f\n", s.bed_target);
+	for (i = 0; i < PRINTER_MAX_EXTRUDERS; i++) {
+		if (s.hotend_target[i] > 0)
+			EMIT("M104 T%d S%.0f\n", i, s.hotend_target[i]);
+	}
+	if (s.bed_target > 0)
+		EMIT("M190 S%.0f\n", s.bed_target);
+	for (i = 0; i < PRINTER_MAX_EXTRUDERS; i++) {
+		if (s.hotend_target[i] > 0)
+			EMIT("M109 T%d S%.0f\n", i, s.hotend_target[i]);
+	}
+	EMIT("T%d\n", s.tool);
+	EMIT("G92 Z%.3f\n", s.target[AXIS_Z]);
+	EMIT("G28 X Y\n");
+	EMIT("G90\n");
+	EMIT("G0 X%.3f Y%.3f\n", s.target[AXIS_X], s.target[AXIS_Y]);
+	if (s.fan > 0)
+		EMIT("M106 S%.0f\n", s.fan);
+	else
+		EMIT("M107\n");
+	EMIT("G92 E%.5f\n", s.target[AXIS_E]);
+	if (s.relative)
+		EMIT("G91\n");
+	EMIT(s.relative_e ? "M83\n" : "M82\n");
+	if (s.feedrate > 0)
+		EMIT("G1 F%.0f\n", s.feedrate);
+#undef EMIT
+	return l;
+}
+
+// the small queue holds a resume preamble, played before the image
+GcodeImageJob::GcodeImageJob(Socket *source, GcodeImage *image, int priority) : Job(source, priority, 1024) {
+	this->image = image;
+	cursor = 0;
+	queued = 0;
+	finished = 1;
+}
+
+GcodeImageJob::~GcodeImageJob() {
+	delete image;
+}
+
+// skip lines which would never be sent, so the queue sees real work only.
+// a corrupt record ends the print there
+unsigned int GcodeImageJob::numlines() {
+	const GcodeImageRecord *r;
+	while (cursor < image->lines()) {
+		if ((r = image->record(cursor)) == NULL) {
+			C::printf("gcode image line %llu is corrupt, print stopped\n", (unsigned long long) cursor + 1);
+			cursor = image->lines();
+			break;
+		}
+		if (r->textlen > GCODEIMAGE_MAXLINE)
+			C::printf("gcode image line %llu is too long, skipped\n", (unsigned long long) cursor + 1);
+		else if (!(r->flags & GCODEIMAGE_EMPTY))
+			break;
+		cursor++;
+	}
+	uint64_t n = image->lines() - cursor + lines->numlines();
+	return (n > 0xFFFFFFFF) ? 0xFFFFFFFF : n;
+}
+
+unsigned int GcodeImageJob::peeklen() {
+	if (lines->numlines())
+		return Job::peeklen();
+	if (numlines() == 0)
+		return 0;
+	return image->record(cursor)->textlen + 1;
+}
+
+unsigned int GcodeImageJob::readline(char *buf, unsigned int len) {
+	queued = (lines->numlines() > 0);
+	if (queued)
+		return Job::readline(buf, len);
+	if (numlines() == 0)
+		return 0;
+	const GcodeImageRecord *r = image->record(cursor++);
+	len--; // make room for newline
+	unsigned int l = (r->textlen < len) ? r->textlen : len - 1;
+	memcpy(buf, image->text(r), l);
+	buf[l++] = 10;
+	buf[l] = 0;
+	image->tokens(r, &current);
+	return l;
+}
+
+const GcodeLine *GcodeImageJob::tokens() {
+	return queued ? NULL : &current;
+}
+
+// an uploaded print carries on whether or not its submitter stays around
+int GcodeImageJob::complete() {
+	return numlines() == 0;
+}
+
+// a print cut short says where it got to, so it can be resumed there
+int GcodeImageJob::requeue() {
+	if (sent == 0)
+		return Job::requeue();
+	C::printf("Job %p ended, its printer went away at line %llu\n", this, (unsigned long long) cursor);
+	if (source && (source->opened() >= 0))
+		source->printf("--printer disconnected at line %llu, job ended. print again with line= to resume--\n", (unsigned long long) cursor);
+	return 0;
+}
+
+int GcodeImageJob::progress(uint64_t *done, uint64_t *total, double *remaining) {
+	*done = cursor;
+	*total = image->lines();
+	*remaining = image->remaining(cursor);
+	return 1;
+}
+
+void GcodeImageJob::seek(uint64_t line) {
+	cursor = (line < image->lines()) ? line : image->lines();
+}
+
+// carry on from line on a printer which has been reset since
+int GcodeImageJob::resume(uint64_t line) {
+	char buf[1024];
+	seek(line);
+	int l = image->preamble(cursor, buf, sizeof(buf));
+	if (l < 0)
+		return -1;
+	return write(buf, l);
+}
+
+uint64_t GcodeImageJob::tell() {
+	return cursor;
+}
+
+uint64_t GcodeImageJob::length() {
+	return image->lines();
+}
@@ -0,0 +1,160 @@
+#ifndef _GCODEIMAGE_HPP
+#define _GCODEIMAGE_HPP
+
+#include <cstdint>
+
+#include "gcode.hpp"
+#include "printerstate.hpp"
+#include "estimator.hpp"
+#include "job.hpp"
+#include "workerpool.hpp"
+
+#define GCODEIMAGE_MAGIC   "NETRAPGI"
+#define GCODEIMAGE_VERSION 3
+
+/*
+ * Pre-tokenized gcode, produced once at ingest and mmap()ed for playback.
+ *
+ *	header
+ *	text     the source file, verbatim
+ *	records  one per source line, 8 byte aligned
+ *	index    uint64_t offset of each record, for O(1) seek
+ *	checkpoints  printer state at each layer and tool change, and every
+ *	         GCODEIMAGE_INTERVAL lines, ordered by line
+ *
+ * A record holds the line's seen/bare masks and only the words which are
+ * present, in letter order, so feeding a line to a printer costs a
+ * pointer bump and a few loads rather than a tokenizer run.
+ */
+struct GcodeImageHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t layers;
+	uint64_t lines;
+	uint64_t text;
+	uint64_t textlen;
+	uint64_t records;
+	uint64_t index;
+	uint64_t checkpoints;
+	uint64_t ncheckpoints;
+	double extruded;
+	double time;
+	MotionLimits limits;
+};
+
+#define GCODEIMAGE_EMPTY 1   // blank or comment-only line, never sent
+#define GCODEIMAGE_ERROR 2   // tokenizer failed, masks are partial
+
+struct GcodeImageRecord {
+	uint64_t text;       // offset of the line within the text section
+	uint32_t seen;
+	uint32_t bare;
+	uint16_t textlen;    // command part only, without comment or line ending
+	uint8_t sum;         // xor of the command part, to renumber lines cheaply
+	uint8_t flags;
+	uint32_t reserved;
+	float words[];
+};
+
+#define GCODEIMAGE_INTERVAL 4096
+// longest command part played back. like Job::writelines, longer lines
+// are skipped rather than sent cut short
+#define GCODEIMAGE_MAXLINE 254
+
+#define GCODEIMAGE_LAYER 1   // first line of a layer
+#define GCODEIMAGE_TOOL  2   // a tool change
+
+/*
+ * the state in effect just before line. a layer starts at the Z move
+ * leading to its first extrusion, so Z hops don't count as layers
+ */
+struct GcodeImageCheckpoint {
+	uint64_t line;
+	uint32_t layer;      // 0 until the first layer starts
+	uint32_t flags;
+	double extruded;     // filament used so far, net of retractions
+	double time;         // estimated print time so far, behind by the lookahead
+	PrinterState state;
+};
+
+class GcodeImage {
+public:
+	GcodeImage();
+	~GcodeImage();
+
+	static int ingest(const char *source, const char *image, const MotionLimits *limits = NULL);
+
+	int open(const char *image);
+	void close();
+
+	uint64_t lines();
+	const GcodeImageRecord *record(uint64_t line);
+	const char *text(const GcodeImageRecord *r);
+	void tokens(const GcodeImageRecord *r, GcodeLine *g);
+
+	unsigned int layers();
+	double extruded();
+	double time();
+	double remaining(uint64_t line);
+	uint64_t layerline(unsigned int layer);
+	const GcodeImageCheckpoint *checkpoint(uint64_t line);
+	int state(uint64_t line, PrinterState *state, double *extruded);
+	int preamble(uint64_t line, char *buf, int len);
+protected:
+	const char *map;
+	uint64_t maplen;
+	const GcodeImageHeader *header;
+	const uint64_t *index;
+	const GcodeImageCheckpoint *checkpoints;
+};
+
+/*
+ * GcodeImage::ingest() on the worker pool, as it's far too slow to run
+ * beside printers being fed. The client, if it's still there, hears how
+ * it went, and the task deletes itself
+ */
+class GcodeImageIngest : public Task {
+public:
+	GcodeImageIngest(Socket *client, const char *source, const char *image, const MotionLimits *limits);
+	~GcodeImageIngest();
+
+	void run();
+	void done();
+protected:
+	Socket *client;
+	char *source;
+	char *image;
+	MotionLimits limits;
+	int lines;
+};
+
+/*
+ * Play a GcodeImage to a printer. Seeking and progress are just a matter
+ * of moving the cursor, and resume() restores the printer's state from the
+ * image's checkpoints first
+ */
+class GcodeImageJob : public Job {
+public:
+	GcodeImageJob(Socket *source, GcodeImage *image, int priority);
+	~GcodeImageJob();
+
+	unsigned int numlines();
+	unsigned int peeklen();
+	unsigned int readline(char *buf, unsigned int len);
+	const GcodeLine *tokens();
+	int complete();
+	int progress(uint64_t *done, uint64_t *total, double *remaining);
+	int requeue();
+
+	void seek(uint64_t line);
+	int resume(uint64_t line);
+	uint64_t tell();
+	uint64_t length();
+protected:
+	GcodeImage *image;
+	uint64_t cursor;
+	GcodeLine current;
+	int queued;
+};
+
+#endif /* _GCODEIMAGE_HPP */
@@ -0,0 +1,160 @@
+#include "hotplug.hpp"
+
+#include "printer.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/inotify.h>
+#include <dirent.h>
+
+namespace C {
+	extern "C" ssize_t read(int fd, void *buf, size_t count);
+	extern "C" int close(int fd);
+}
+
+Hotplug::Hotplug(const char *dir, int baud) {
+	this->dir = dir;
+	this->baud = baud;
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd == -1) {
+		perror("inotify_init1");
+		return;
+	}
+	selector.add(fd, this);
+
+	arm();
+	scan();
+}
+
+Hotplug::~Hotplug() {
+	if (fd != -1) {
+		selector.remove(fd);
+		C::close(fd);
+	}
+}
+
+/*
+ * watch dir if we can, otherwise the closest parent which exists so we
+ * hear about the path being created
+ */
+void Hotplug::arm() {
+	std::map<int, std::string>::iterator i;
+	for (i = watches.begin(); i != watches.end(); i++)
+		inotify_rm_watch(fd, i->first);
+	watches.clear();
+
+	std::string path = dir;
+	for (;;) {
+		int wd;
+		if (path == dir)
+			wd = inotify_add_watch(fd, path.c_str(), IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF);
+		else
+			wd = inotify_add_watch(fd, path.c_str(), IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+		if (wd >= 0) {
+			watches[wd] = path;
+			if (path != dir)
+				printf("Hotplug: %s doesn't exist yet, watching %s\n", dir.c_str(), path.c_str());
+			return;
+		}
+		if ((errno != ENOENT) && (errno != ENOTDIR)) {
+			perror(path.c_str());
+			return;
+		}
+		size_t slash = path.rfind('/');
+		if ((slash == std::string::npos) || (slash == 0))
+			return;
+		path.erase(slash);
+	}
+}
+
+// pick up devices which were already plugged in
+void Hotplug::scan() {
+	DIR *d = opendir(dir.c_str());
+	if (d == NULL)
+		return;
+	struct dirent *e;
+	while ((e = readdir(d)) != NULL) {
+		if (e->d_name[0] == '.')
+			continue;
+		attach(dir + "/" + e->d_name);
+	}
+	closedir(d);
+}
+
+void Hotplug::attach(const std::string &path) {
+	std::list<Printer *>::iterator i;
+	for (i = Printer::allprinters.begin(); i != Printer::allprinters.end(); i++) {
+		if ((*i)->port() && (path == (*i)->port()))
+			return;
+	}
+
+	Printer *p = new Printer((char *) path.c_str(), baud);
+	if (p->opened() < 0) {
+		delete p;
+		return;
+	}
+	p->setname((char *) path.substr(path.rfind('/') + 1).c_str());
+	printf("Hotplug: printer %s attached at %s\n", p->name(), path.c_str());
+
+	// jobs may have been waiting for this printer
+	QueueManager::dispatch();
+}
+
+void Hotplug::detach(const std::string &path) {
+	std::list<Printer *>::iterator i;
+	for (i = Printer::allprinters.begin(); i != Printer::allprinters.end(); i++) {
+		if ((*i)->port() && (path == (*i)->port())) {
+			(*i)->disconnect();
+			return;
+		}
+	}
+}
+
+void Hotplug::onread(struct SelectFd *selected) {
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t r;
+	int rearm = 0;
+
+	while ((r = C::read(fd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + r; ) {
+			struct inotify_event *e = (struct inotify_event *) p;
+			p += sizeof(struct inotify_event) + e->len;
+
+			std::map<int, std::string>::iterator w = watches.find(e->wd);
+			if (w == watches.end())
+				continue;
+
+			if (w->second != dir) {
+				// something was created along the way to dir
+				rearm = 1;
+				continue;
+			}
+			if (e->mask & (IN_DELETE_SELF | IN_IGNORED)) {
+				rearm = 1;
+				continue;
+			}
+			if ((e->len == 0) || (e->name[0] == '.'))
+				continue;
+
+			std::string path = dir + "/" + e->name;
+			if (e->mask & (IN_CREATE | IN_MOVED_TO))
+				attach(path);
+			else if (e->mask & (IN_DELETE | IN_MOVED_FROM))
+				detach(path);
+		}
+	}
+
+	if (rearm) {
+		arm();
+		scan();
+	}
+}
+
+void Hotplug::onwrite(struct SelectFd *selected) {
+}
+
+void Hotplug::onerror(struct SelectFd *selected) {
+}
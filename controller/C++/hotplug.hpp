@@ -0,0 +1,45 @@
+#ifndef _HOTPLUG_HPP
+#define _HOTPLUG_HPP
+
+#include <map>
+#include <string>
+
+#include "selector.hpp"
+
+#define HOTPLUG_DEFAULT_DIR  "/dev/serial/by-id"
+#define HOTPLUG_DEFAULT_BAUD 115200
+
+/*
+ * Watch a device directory with inotify, and bring printers up and down as
+ * their serial ports come and go.
+ *
+ * The watch is part of the event loop like any socket. If the directory
+ * doesn't exist yet (udev only creates /dev/serial once the first USB
+ * serial device appears) we watch the nearest parent that does, and move
+ * down as the path is created.
+ */
+class Hotplug : public SelectorEventReceiver {
+public:
+	Hotplug(const char *dir = HOTPLUG_DEFAULT_DIR, int baud = HOTPLUG_DEFAULT_BAUD);
+	~Hotplug();
+
+protected:
+	int fd;
+	int baud;
+	std::string dir;
+	// watch descriptor to the directory it watches
+	std::map<int, std::string> watches;
+
+	Selector selector;
+
+	void arm();
+	void scan();
+	void attach(const std::string &path);
+	void detach(const std::string &path);
+
+	void onread(struct SelectFd *selected);
+	void onwrite(struct SelectFd *selected);
+	void onerror(struct SelectFd *selected);
+};
+
+#endif /* _HOTPLUG_HPP */
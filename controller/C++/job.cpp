@@ -0,0 +1,266 @@
+#include "job.hpp"
+
+#include "printer.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+Job::Job(Socket *source, int priority, unsigned int queuesize) {
+	this->source = source;
+	if (source)
+		source->ref();
+	this->priority = priority;
+	printer = NULL;
+	deficit = 0;
+	sent = 0;
+	finished = 0;
+	pause = 1;
+	// subclasses which bring their own line store don't need a queue
+	lines = queuesize ? new Ringbuffer(queuesize) : NULL;
+	filters = NULL;
+	batch = NULL;
+	batchpos = 0;
+}
+
+Job::~Job() {
+	if (lines && source && source->is_stalled())
+		source->unstall();
+	if (lines)
+		delete lines;
+	delete filters;
+	delete batch;
+	if (source)
+		source->unref();
+}
+
+void Job::addFilter(Filter *filter) {
+	if (filters == NULL) {
+		filters = new FilterChain();
+		batch = new FilterBatch;
+		batch->count = 0;
+	}
+	filters->add(filter);
+}
+
+unsigned int Job::numlines() {
+	if (batch)
+		return lines->numlines() + batch->count - batchpos;
+	return lines->numlines();
+}
+
+unsigned int Job::peeklen() {
+	if (batch && ((batchpos < batch->count) || fill()))
+		return batch->len[batchpos];
+	const char *seg1, *seg2;
+	unsigned int len1, len2;
+	return lines->linespan(&seg1, &len1, &seg2, &len2);
+}
+
+/*
+ * tokenize the next batch of queued lines and run it through the
+ * filters. returns the number of lines read
+ */
+int Job::fill() {
+	const char *seg1, *seg2;
+	unsigned int len1, len2, l;
+	batch->count = 0;
+	batchpos = 0;
+	while ((batch->count < FILTER_BATCH) && ((l = lines->linespan(&seg1, &len1, &seg2, &len2)) > 0)) {
+		unsigned int i = batch->count++;
+		char *text = batch->text[i];
+		if (len1 > sizeof(batch->text[0]) - 1)
+			len1 = sizeof(batch->text[0]) - 1;
+		if (len2 > sizeof(batch->text[0]) - 1 - len1)
+			len2 = sizeof(batch->text[0]) - 1 - len1;
+		memcpy(text, seg1, len1);
+		if (len2)
+			memcpy(&text[len1], seg2, len2);
+		text[len1 + len2] = 0;
+		batch->len[i] = len1 + len2;
+		batch->dirty[i] = 0;
+		Gcode::parse(text, len1 + len2, &batch->lines[i]);
+		lines->skip(l);
+	}
+	if (source && source->is_stalled() && (lines->canread() <= JOB_LOW_WATERMARK))
+		source->unstall();
+
+	filters->run(batch);
+
+	for (unsigned int i = 0; i < batch->count; i++) {
+		if (!batch->dirty[i])
+			continue;
+		int l = Gcode::format(&batch->lines[i], batch->text[i], sizeof(batch->text[0]));
+		batch->len[i] = (l > 0) ? l : 0;
+	}
+	return batch->count;
+}
+
+/*
+ * always consumes the whole line, truncating it to fit buf so an overlong
+ * line can't wedge the queue. returns the number of bytes copied
+ */
+unsigned int Job::readline(char *buf, unsigned int len) {
+	if (batch) {
+		if ((batchpos == batch->count) && !fill())
+			return 0;
+		unsigned int l = batch->len[batchpos];
+		if (l > len - 1)
+			l = len - 1;
+		memcpy(buf, batch->text[batchpos], l);
+		buf[l] = 0;
+		batchpos++;
+		return l;
+	}
+
+	const char *seg1, *seg2;
+	unsigned int len1, len2;
+	unsigned int l = lines->linespan(&seg1, &len1, &seg2, &len2);
+	if (l == 0)
+		return 0;
+	len--; // make room for trailing 0
+	if (len1 > len)
+		len1 = len;
+	if (len2 > len - len1)
+		len2 = len - len1;
+	memcpy(buf, seg1, len1);
+	if (len2)
+		memcpy(&buf[len1], seg2, len2);
+	buf[len1 + len2] = 0;
+	lines->skip(l);
+
+	if (source && source->is_stalled() && (lines->canread() <= JOB_LOW_WATERMARK))
+		source->unstall();
+
+	return len1 + len2;
+}
+
+const GcodeLine *Job::tokens() {
+	if (batch && batchpos)
+		return &batch->lines[batchpos - 1];
+	return NULL;
+}
+
+/*
+ * queue whole lines. ones that don't fit aren't queued at all, as a
+ * truncated command would go to the printer as if it were whole- the
+ * source is stalled, if it may be, and 0 returned so it can try again.
+ * -1 if a line is longer than JOB_MAXLINE, which no printer will take
+ */
+int Job::write(const char *line, int len) {
+	for (const char *p = line, *nl; p < line + len; p = nl + 1) {
+		nl = (const char *) memchr(p, 10, line + len - p);
+		if (nl == NULL)
+			nl = line + len - 1;
+		if (nl - p + 1 > JOB_MAXLINE)
+			return -1;
+	}
+	if (lines->canwrite() < (unsigned int) len) {
+		if (pause && source && !source->is_stalled())
+			source->stall();
+		return 0;
+	}
+	int r = lines->write(line, len);
+	if (pause && source && !source->is_stalled() && (lines->canread() >= JOB_HIGH_WATERMARK))
+		source->stall();
+	return r;
+}
+
+/*
+ * move whole lines from a source's buffer until the source gets stalled,
+ * or there's no room for the next. lines too long for the printer are
+ * dropped. returns the lines moved
+ */
+unsigned int Job::writelines(Ringbuffer *from) {
+	const char *seg1, *seg2;
+	unsigned int len1, len2, l, n = 0;
+	char line[JOB_MAXLINE];
+	while (!(source && source->is_stalled()) && ((l = from->linespan(&seg1, &len1, &seg2, &len2)) > 0)) {
+		if (l <= JOB_MAXLINE) {
+			memcpy(line, seg1, len1);
+			if (len2)
+				memcpy(&line[len1], seg2, len2);
+			if (write(line, l) == 0)
+				break;
+			n++;
+		}
+		from->skip(l);
+	}
+	return n;
+}
+
+// the source has gone away. let go of it, the job ends once its queued
+// lines are out
+void Job::orphan() {
+	if (source == NULL)
+		return;
+	if (lines && source->is_stalled())
+		source->unstall();
+	source->unref();
+	source = NULL;
+}
+
+/*
+ * print jobs which haven't started wait for another printer. one which
+ * has is ended, as another printer would pick it up mid-print without
+ * homing or heating. interactive jobs were for this printer anyway
+ */
+int Job::requeue() {
+	if (priority == JOB_PRIORITY_INTERACTIVE)
+		return 0;
+	if (sent == 0) {
+		if (source && (source->opened() >= 0))
+			source->write("--printer disconnected, job requeued--\n");
+		return 1;
+	}
+	printf("Job %p ended, its printer went away after %llu lines\n", this, (unsigned long long) sent);
+	if (source && (source->opened() >= 0))
+		source->printf("--printer disconnected after %llu lines, job ended--\n", (unsigned long long) sent);
+	return 0;
+}
+
+void Job::finish() {
+	finished = 1;
+}
+
+int Job::whole() {
+	return finished;
+}
+
+int Job::complete() {
+	if (numlines())
+		return 0;
+	// a job fed by a client ends when the client goes away
+	return finished || (source == NULL) || (source->opened() < 0);
+}
+
+int Job::progress(uint64_t *done, uint64_t *total, double *remaining) {
+	return 0;
+}
+
+int Job::compatible(Printer *printer) {
+	if (group.length() > 0) {
+		const char *g = printer->getCapability("group");
+		if ((group != printer->name()) && ((g == NULL) || (group != g)))
+			return 0;
+	}
+	std::map<std::string, std::string>::iterator i;
+	for (i = requirements.begin(); i != requirements.end(); i++) {
+		const char *c = printer->getCapability(i->first.c_str());
+		if ((c == NULL) || (i->second != c))
+			return 0;
+	}
+	return 1;
+}
+
+SourceJob::SourceJob(Socket *source, int priority) : Job(source, priority) {
+}
+
+SourceJob::~SourceJob() {
+	Socket *s = source;
+	source = NULL;
+	// replies to its last lines may still be on their way
+	std::list<Printer *>::iterator i;
+	for (i = Printer::allprinters.begin(); i != Printer::allprinters.end(); i++)
+		(*i)->forget(s);
+	delete s;
+}
@@ -0,0 +1,95 @@
+#ifndef _JOB_HPP
+#define _JOB_HPP
+
+#include <string>
+#include <map>
+
+#include "gcode.hpp"
+#include "ringbuffer.hpp"
+#include "filter.hpp"
+#include "socket.hpp"
+
+class Printer;
+
+#define JOB_PRIORITY_BULK        0
+#define JOB_PRIORITY_NORMAL      1
+#define JOB_PRIORITY_INTERACTIVE 2
+
+// source is stalled when this much is queued, and resumed once it drains
+#define JOB_HIGH_WATERMARK 3072
+#define JOB_LOW_WATERMARK  1024
+// longest line a job takes, with its newline. lines are fed to printers
+// through 256 byte buffers
+#define JOB_MAXLINE 255
+
+/*
+ * A stream of gcode lines headed for a printer- an uploaded file, a client
+ * streaming a print, or a client jogging the printer by hand.
+ *
+ * Producers push lines in with write(), QueueManager pulls them out with
+ * readline() when the printer has room. source receives the printer's
+ * replies to this job's lines.
+ */
+class Job {
+public:
+	Job(Socket *source, int priority, unsigned int queuesize = 4096);
+	virtual ~Job();
+
+	virtual unsigned int numlines();
+	virtual unsigned int peeklen();
+	virtual unsigned int readline(char *buf, unsigned int len);
+	// the line last read, if the job has it tokenized already
+	virtual const GcodeLine *tokens();
+
+	virtual int write(const char *line, int len);
+	unsigned int writelines(Ringbuffer *from);
+	virtual void finish();
+	// finish() has been called, every line is in
+	int whole();
+	virtual int complete();
+	void orphan();
+	// its printer has gone. 1 if it should wait for another, 0 to end it
+	virtual int requeue();
+
+	void addFilter(Filter *filter);
+
+	int compatible(Printer *printer);
+	// lines done and to do, and estimated seconds left. 0 if not known
+	virtual int progress(uint64_t *done, uint64_t *total, double *remaining);
+
+	Socket *source;
+	int priority;
+
+	// printer name or group capability to run on, empty for any printer
+	std::string group;
+	// capabilities the printer must have, eg. material=PLA diameter=1.75
+	std::map<std::string, std::string> requirements;
+
+	Printer *printer;
+	int deficit;
+	// lines handed to a printer so far
+	uint64_t sent;
+	// stall source at the high watermark rather than drop its lines
+	int pause;
+protected:
+	Ringbuffer *lines;
+	int finished;
+
+	// lines are read through the filters a batch at a time
+	FilterChain *filters;
+	FilterBatch *batch;
+	unsigned int batchpos;
+	int fill();
+};
+
+/*
+ * A job whose source exists only to feed it, like a file or a pipe. The
+ * source goes when the job does.
+ */
+class SourceJob : public Job {
+public:
+	SourceJob(Socket *source, int priority);
+	~SourceJob();
+};
+
+#endif /* _JOB_HPP */
@@ -1,10 +1,18 @@
 #include <iostream>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 
 #include "array.hpp"
 #include "ringbuffer.hpp"
 #include "TCPListen.hpp"
+#include "UnixListen.hpp"
 #include "printer.hpp"
+#include "hotplug.hpp"
+#include "admission.hpp"
+#include "arena.hpp"
+#include "trace.hpp"
+#include "gcode.hpp"
 
 #include <list>
 
@@ -14,7 +22,28 @@ int main(int argc, char **argv) {
 // 	Ringbuffer *r = new Ringbuffer(1024);
 // 	r->writefromfd(stdin, 1024);
 // 	cout << r->readtofd(stdout, 1024) << " chars written" << endl;
-	TCPListen listener(2560);
+	// --replay <file> [stall ms] summarises a printer's trace file
+	if ((argc >= 3) && (strcmp(argv[1], "--replay") == 0)) {
+		Arena arena;
+		ArenaText out(&arena);
+		if (LineTracer::replay(argv[2], (argc >= 4) ? atoi(argv[3]) : TRACE_STALL_MS, &out) < 0)
+			return 1;
+		fwrite(out.data(), 1, out.length(), stdout);
+		return 0;
+	}
+	// --check runs the checks which have no printer to try them on
+	if ((argc >= 2) && (strcmp(argv[1], "--check") == 0))
+		return (PathStage::check() + Gcode::check()) ? 1 : 0;
+	Admission::configure();
+	TCPListen listener(2560, getenv("NETRAP_REUSEPORT") ? TCPLISTEN_REUSEPORT : 0);
+	UnixListen local;
+	// local tools are a convenience, TCP clients shouldn't lose out over them
+	const char *localpath = UnixListen::defaultpath();
+	if (localpath == NULL)
+		fprintf(stderr, "No NETRAP_SOCKET or XDG_RUNTIME_DIR, serving TCP only\n");
+	else if (local.listen(localpath) < 0)
+		fprintf(stderr, "No local socket at %s, serving TCP only\n", localpath);
+	Hotplug hotplug;
 	for (;;) {
 		selector.allwait();
 	}
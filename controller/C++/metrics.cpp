@@ -0,0 +1,348 @@
+#include "metrics.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <list>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "arena.hpp"
+
+namespace {
+	struct Metric {
+		int type;
+		std::string name;
+		std::string help;
+		std::string labels;
+	};
+
+	// everything the shards are merged through. built on first use, so
+	// metrics can be registered from static initialisers anywhere
+	struct Registry {
+		std::mutex lock;
+		Metric metrics[METRICS_MAX];
+		std::vector<void *> shards;
+		std::list<void (*)()> collectors;
+	};
+
+	Registry &registry() {
+		static Registry r;
+		return r;
+	}
+
+	__thread void *localshard = NULL;
+
+	// bumps which only the owning thread makes, so no locked instructions
+	inline void bump(std::atomic<uint64_t> &a, uint64_t n) {
+		a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+}
+
+void HistogramData::clear() {
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		counts[i].store(0, std::memory_order_relaxed);
+	count.store(0, std::memory_order_relaxed);
+	sum.store(0, std::memory_order_relaxed);
+	max.store(0, std::memory_order_relaxed);
+}
+
+void HistogramData::merge(const HistogramData *from) {
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		bump(counts[i], from->counts[i].load(std::memory_order_relaxed));
+	bump(count, from->count.load(std::memory_order_relaxed));
+	bump(sum, from->sum.load(std::memory_order_relaxed));
+	uint64_t m = from->max.load(std::memory_order_relaxed);
+	if (m > max.load(std::memory_order_relaxed))
+		max.store(m, std::memory_order_relaxed);
+}
+
+void HistogramData::record(uint64_t value) {
+	bump(counts[bucket(value)], 1);
+	bump(count, 1);
+	bump(sum, value);
+	if (value > max.load(std::memory_order_relaxed))
+		max.store(value, std::memory_order_relaxed);
+}
+
+/*
+ * values below 2^SUBBITS get a bucket each. above that, each power of two
+ * is split into 2^SUBBITS buckets by the bits after the top one
+ */
+unsigned int HistogramData::bucket(uint64_t value) {
+	if (value < (1 << HISTOGRAM_SUBBITS))
+		return value;
+	unsigned int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUBBITS;
+	return ((shift + 1) << HISTOGRAM_SUBBITS) + ((value >> shift) & ((1 << HISTOGRAM_SUBBITS) - 1));
+}
+
+// the largest value which lands in bucket
+uint64_t HistogramData::upper(unsigned int bucket) {
+	if (bucket < (1 << HISTOGRAM_SUBBITS))
+		return bucket;
+	unsigned int shift = (bucket >> HISTOGRAM_SUBBITS) - 1;
+	uint64_t low = (uint64_t) ((1 << HISTOGRAM_SUBBITS) + (bucket & ((1 << HISTOGRAM_SUBBITS) - 1))) << shift;
+	return low + ((uint64_t) 1 << shift) - 1;
+}
+
+uint64_t HistogramData::quantile(double q) {
+	uint64_t n = count.load(std::memory_order_relaxed);
+	if (n == 0)
+		return 0;
+	uint64_t rank = (uint64_t) (q * n);
+	if (rank >= n)
+		rank = n - 1;
+	uint64_t seen = 0;
+	uint64_t m = max.load(std::memory_order_relaxed);
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += counts[i].load(std::memory_order_relaxed);
+		if (seen > rank)
+			return (upper(i) < m) ? upper(i) : m;
+	}
+	return m;
+}
+
+// how many values fell in buckets no higher than value's
+uint64_t HistogramData::below(uint64_t value) {
+	unsigned int b = bucket(value);
+	uint64_t n = 0;
+	for (unsigned int i = 0; i <= b; i++)
+		n += counts[i].load(std::memory_order_relaxed);
+	return n;
+}
+
+Metrics::Shard *Metrics::shard() {
+	if (localshard == NULL) {
+		Shard *s = new Shard;
+		for (int i = 0; i < METRICS_MAX; i++) {
+			s->values[i].store(0, std::memory_order_relaxed);
+			s->histograms[i].store(NULL, std::memory_order_relaxed);
+		}
+		Registry &r = registry();
+		std::lock_guard<std::mutex> l(r.lock);
+		// a shard outlives its thread, so nothing counted is lost
+		r.shards.push_back(s);
+		localshard = s;
+	}
+	return (Shard *) localshard;
+}
+
+int Metrics::define(int type, const char *name, const char *help, const std::string &labels) {
+	Registry &r = registry();
+	std::lock_guard<std::mutex> l(r.lock);
+	for (int i = 0; i < METRICS_MAX; i++) {
+		Metric &m = r.metrics[i];
+		if (m.type)
+			continue;
+		m.type = type;
+		m.name = name;
+		m.help = help;
+		m.labels = labels;
+		return i;
+	}
+	fprintf(stderr, "Out of metrics, not counting %s{%s}\n", name, labels.c_str());
+	return -1;
+}
+
+int Metrics::counter(const char *name, const char *help, const std::string &labels) {
+	return define(METRIC_COUNTER, name, help, labels);
+}
+
+int Metrics::gauge(const char *name, const char *help, const std::string &labels) {
+	return define(METRIC_GAUGE, name, help, labels);
+}
+
+int Metrics::histogram(const char *name, const char *help, const std::string &labels) {
+	return define(METRIC_HISTOGRAM, name, help, labels);
+}
+
+void Metrics::relabel(int id, const std::string &labels) {
+	if (id < 0)
+		return;
+	Registry &r = registry();
+	std::lock_guard<std::mutex> l(r.lock);
+	r.metrics[id].labels = labels;
+}
+
+/*
+ * free id for reuse, with its values zeroed in every shard. only safe
+ * once nothing will update it again, as a thread might be mid-update
+ */
+void Metrics::remove(int id) {
+	if (id < 0)
+		return;
+	Registry &r = registry();
+	std::lock_guard<std::mutex> l(r.lock);
+	for (unsigned int i = 0; i < r.shards.size(); i++) {
+		Shard *s = (Shard *) r.shards[i];
+		s->values[id].store(0, std::memory_order_relaxed);
+		HistogramData *h = s->histograms[id].load(std::memory_order_relaxed);
+		if (h)
+			h->clear();
+	}
+	r.metrics[id].type = 0;
+}
+
+void Metrics::add(int id, uint64_t n) {
+	if (id < 0)
+		return;
+	bump(shard()->values[id], n);
+}
+
+void Metrics::set(int id, int64_t value) {
+	if (id < 0)
+		return;
+	shard()->values[id].store((uint64_t) value, std::memory_order_relaxed);
+}
+
+void Metrics::observe(int id, uint64_t ns) {
+	if (id < 0)
+		return;
+	Shard *s = shard();
+	HistogramData *h = s->histograms[id].load(std::memory_order_relaxed);
+	if (h == NULL) {
+		h = new HistogramData;
+		h->clear();
+		s->histograms[id].store(h, std::memory_order_release);
+	}
+	h->record(ns);
+}
+
+uint64_t Metrics::now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void Metrics::collector(void (*fn)()) {
+	Registry &r = registry();
+	std::lock_guard<std::mutex> l(r.lock);
+	r.collectors.push_back(fn);
+}
+
+void Metrics::collect() {
+	Registry &r = registry();
+	std::list<void (*)()> fns;
+	{
+		std::lock_guard<std::mutex> l(r.lock);
+		fns = r.collectors;
+	}
+	std::list<void (*)()>::iterator i;
+	for (i = fns.begin(); i != fns.end(); i++)
+		(*i)();
+}
+
+// callers hold the registry lock
+uint64_t Metrics::total(int id) {
+	Registry &r = registry();
+	uint64_t n = 0;
+	for (unsigned int i = 0; i < r.shards.size(); i++)
+		n += ((Shard *) r.shards[i])->values[id].load(std::memory_order_relaxed);
+	return n;
+}
+
+HistogramData *Metrics::merged(int id, HistogramData *into) {
+	Registry &r = registry();
+	into->clear();
+	for (unsigned int i = 0; i < r.shards.size(); i++) {
+		HistogramData *h = ((Shard *) r.shards[i])->histograms[id].load(std::memory_order_acquire);
+		if (h)
+			into->merge(h);
+	}
+	return into;
+}
+
+static const char *typenames[] = { "", "counter", "gauge", "histogram" };
+
+// bucket bounds for export, in seconds. the histograms have far more
+static const double bounds[] = { 1e-6, 1e-5, 1e-4, 1e-3, 1e-2, 0.1, 1, 10, 0 };
+
+// "name", or "name{labels}", with extra added to the labels
+static void series(ArenaText *out, const std::string &name, const char *suffix, const std::string &labels, const char *extra) {
+	out->append(name.data(), name.length());
+	out->append(suffix);
+	if (labels.empty() && (extra == NULL))
+		return;
+	out->append("{", 1);
+	out->append(labels.data(), labels.length());
+	if (extra) {
+		if (!labels.empty())
+			out->append(",", 1);
+		out->append(extra);
+	}
+	out->append("}", 1);
+}
+
+void Metrics::prometheus(ArenaText *out) {
+	collect();
+	Registry &r = registry();
+	std::lock_guard<std::mutex> l(r.lock);
+	HistogramData *h = new HistogramData;
+
+	// metrics of one name go together, under one HELP and TYPE
+	std::map<std::string, std::vector<int> > byname;
+	for (int i = 0; i < METRICS_MAX; i++) {
+		if (r.metrics[i].type)
+			byname[r.metrics[i].name].push_back(i);
+	}
+	std::map<std::string, std::vector<int> >::iterator n;
+	for (n = byname.begin(); n != byname.end(); n++) {
+		Metric &first = r.metrics[n->second[0]];
+		out->printf("# HELP %s %s\n# TYPE %s %s\n", first.name.c_str(), first.help.c_str(), first.name.c_str(), typenames[first.type]);
+		for (unsigned int j = 0; j < n->second.size(); j++) {
+			int id = n->second[j];
+			Metric &m = r.metrics[id];
+			if (m.type == METRIC_COUNTER) {
+				series(out, m.name, "", m.labels, NULL);
+				out->printf(" %llu\n", (unsigned long long) total(id));
+			}
+			else if (m.type == METRIC_GAUGE) {
+				series(out, m.name, "", m.labels, NULL);
+				out->printf(" %lld\n", (long long) total(id));
+			}
+			else {
+				merged(id, h);
+				char le[32];
+				for (int b = 0; bounds[b]; b++) {
+					snprintf(le, sizeof(le), "le=\"%g\"", bounds[b]);
+					series(out, m.name, "_bucket", m.labels, le);
+					out->printf(" %llu\n", (unsigned long long) h->below((uint64_t) (bounds[b] * 1e9)));
+				}
+				series(out, m.name, "_bucket", m.labels, "le=\"+Inf\"");
+				out->printf(" %llu\n", (unsigned long long) h->count.load());
+				series(out, m.name, "_sum", m.labels, NULL);
+				out->printf(" %.9f\n", h->sum.load() / 1e9);
+				series(out, m.name, "_count", m.labels, NULL);
+				out->printf(" %llu\n", (unsigned long long) h->count.load());
+			}
+		}
+	}
+	delete h;
+}
+
+void Metrics::summary(ArenaText *out) {
+	collect();
+	Registry &r = registry();
+	std::lock_guard<std::mutex> l(r.lock);
+	HistogramData *h = new HistogramData;
+	for (int id = 0; id < METRICS_MAX; id++) {
+		Metric &m = r.metrics[id];
+		if (m.type == 0)
+			continue;
+		series(out, m.name, "", m.labels, NULL);
+		if (m.type == METRIC_COUNTER) {
+			out->printf(": %llu\n", (unsigned long long) total(id));
+		}
+		else if (m.type == METRIC_GAUGE) {
+			out->printf(": %lld\n", (long long) total(id));
+		}
+		else {
+			merged(id, h);
+			out->printf(": %llu, p50 %.3fms, p90 %.3fms, p99 %.3fms, p99.9 %.3fms, max %.3fms\n",
+				(unsigned long long) h->count.load(), h->quantile(0.5) / 1e6, h->quantile(0.9) / 1e6,
+				h->quantile(0.99) / 1e6, h->quantile(0.999) / 1e6, h->max.load() / 1e6);
+		}
+	}
+	delete h;
+}
@@ -0,0 +1,93 @@
+#ifndef _METRICS_HPP
+#define _METRICS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+class ArenaText;
+
+// most metrics there can be at once, counting each set of labels
+#define METRICS_MAX 256
+
+// histograms keep 2^SUBBITS buckets per power of two, so values are
+// resolved to within about 6%
+#define HISTOGRAM_SUBBITS 4
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUBBITS + 1) << HISTOGRAM_SUBBITS)
+
+#define METRIC_COUNTER 1
+#define METRIC_GAUGE 2
+#define METRIC_HISTOGRAM 3
+
+/*
+ * An HDR style histogram of nanoseconds: log-linear buckets, so one of
+ * these covers a nanosecond to centuries at a fixed relative precision.
+ */
+struct HistogramData {
+	std::atomic<uint64_t> counts[HISTOGRAM_BUCKETS];
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> sum;
+	std::atomic<uint64_t> max;
+
+	void clear();
+	void merge(const HistogramData *from);
+	// count one value, from the thread that owns this
+	void record(uint64_t value);
+	uint64_t quantile(double q);
+	uint64_t below(uint64_t value);
+
+	static unsigned int bucket(uint64_t value);
+	static uint64_t upper(unsigned int bucket);
+};
+
+/*
+ * Counters, gauges and histograms, cheap enough to update on every line
+ * and every callback.
+ *
+ * Each thread updates its own shard, so updates are plain loads and
+ * stores with no locking or bus traffic; a shard is only ever written by
+ * the thread it belongs to. Reading merges the shards: counters and
+ * histograms are summed, and so are gauges, so a gauge should be set from
+ * one thread only.
+ *
+ * Metrics are named as Prometheus has them, and labels are the text that
+ * goes between the braces, eg. printer="ender". Names may be registered
+ * more than once with different labels. Collectors are run in the event
+ * loop before each read, to set gauges that are easier to work out than
+ * to keep up to date.
+ */
+class Metrics {
+public:
+	static int counter(const char *name, const char *help, const std::string &labels = "");
+	static int gauge(const char *name, const char *help, const std::string &labels = "");
+	static int histogram(const char *name, const char *help, const std::string &labels = "");
+	static void relabel(int id, const std::string &labels);
+	static void remove(int id);
+
+	static void add(int id, uint64_t n = 1);
+	static void set(int id, int64_t value);
+	// a duration in nanoseconds
+	static void observe(int id, uint64_t ns);
+
+	// monotonic nanoseconds
+	static uint64_t now();
+
+	static void collector(void (*fn)());
+
+	// Prometheus text exposition format
+	static void prometheus(ArenaText *out);
+	// the same, with histograms as percentiles, for people
+	static void summary(ArenaText *out);
+private:
+	struct Shard {
+		std::atomic<uint64_t> values[METRICS_MAX];
+		std::atomic<HistogramData *> histograms[METRICS_MAX];
+	};
+	static Shard *shard();
+	static int define(int type, const char *name, const char *help, const std::string &labels);
+	static void collect();
+	static HistogramData *merged(int id, HistogramData *into);
+	static uint64_t total(int id);
+};
+
+#endif /* _METRICS_HPP */
@@ -0,0 +1,345 @@
+#include "pathstage.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#define WORD(g, letter) ((g)->words[(letter) - 'A'])
+#define HAS(g, letter) ((g)->seen & GCODE_WORD(letter))
+
+#define MOVE_WORDS (GCODE_WORD('G') | GCODE_WORD('X') | GCODE_WORD('Y') | GCODE_WORD('Z') | GCODE_WORD('E') | GCODE_WORD('F'))
+
+PathStage::PathStage() {
+	flags = 0;
+	arrived = 0;
+	reset();
+}
+
+// state is where the printer is now, since we haven't been following it
+void PathStage::setmode(int mode, const PrinterState *state) {
+	if ((flags == 0) && mode)
+		this->state = *state;
+	if (mode == 0)
+		flush();
+	flags = mode;
+}
+
+int PathStage::mode() {
+	return flags;
+}
+
+// forget everything, eg. when the printer resets and loses it anyway
+void PathStage::reset() {
+	out.clear();
+	nheld = 0;
+	printerstate_init(&state);
+}
+
+// lines still here from a respondent that's going away are sent for no one
+void PathStage::forget(Socket *respondent) {
+	std::list<PathCommand>::iterator i;
+	for (i = out.begin(); i != out.end(); i++) {
+		if (i->respondent == respondent)
+			i->respondent = NULL;
+	}
+	for (unsigned int h = 0; h < nheld; h++) {
+		if (held[h].respondent == respondent)
+			held[h].respondent = NULL;
+	}
+}
+
+void PathStage::push(Socket *respondent, const GcodeLine *g, const char *text, int len, int reshape, uint64_t queued) {
+	arrived = queued;
+	float from[4];
+	memcpy(from, state.target, sizeof(from));
+	float feedrate = state.feedrate;
+	if (g->error == GCODE_OK)
+		printerstate_apply(&state, g);
+
+	if (reshape && (g->error == GCODE_OK) && HAS(g, 'G')) {
+		int code = (int) WORD(g, 'G');
+
+		if ((flags & PATHSTAGE_SIMPLIFY) && ((code == 0) || (code == 1)) && !(g->seen & ~MOVE_WORDS) && !g->bare) {
+			float dx = state.target[AXIS_X] - from[AXIS_X];
+			float dy = state.target[AXIS_Y] - from[AXIS_Y];
+			float dz = state.target[AXIS_Z] - from[AXIS_Z];
+			float l = sqrtf(dx * dx + dy * dy + dz * dz);
+			if ((l > 0) && (l < PATHSTAGE_SEGMENT)) {
+				int same = (nheld > 0) && (WORD(&held[0].g, 'G') == code) && (!HAS(g, 'F') || (WORD(g, 'F') == feedrate));
+				if (same && fits(state.target)) {
+					held[nheld].respondent = respondent;
+					held[nheld].queued = queued;
+					held[nheld].g = *g;
+					held[nheld].len = 0;
+					memcpy(points[nheld], state.target, sizeof(points[0]));
+					if (++nheld == PATHSTAGE_LOOKAHEAD)
+						flush();
+					return;
+				}
+				flush();
+				memcpy(start, from, sizeof(start));
+				relative = state.relative;
+				relative_e = state.relative_e;
+				ratio = (state.target[AXIS_E] - from[AXIS_E]) / l;
+				emit(respondent, g, text, len);
+				held[0] = out.back();
+				out.pop_back();
+				memcpy(points[0], state.target, sizeof(points[0]));
+				nheld = 1;
+				return;
+			}
+		}
+
+		if ((flags & PATHSTAGE_ARCS) && ((code == 2) || (code == 3))) {
+			flush();
+			arc(respondent, g, from, state.target);
+			return;
+		}
+	}
+
+	flush();
+	emit(respondent, g, text, len);
+}
+
+/*
+ * whether the held run can be extended to to: at about the same extrusion
+ * per mm, with every point so far in order along the new line and within
+ * PATHSTAGE_TOLERANCE of it
+ */
+int PathStage::fits(const float *to) {
+	const float *last = points[nheld - 1];
+	float sx = to[AXIS_X] - last[AXIS_X];
+	float sy = to[AXIS_Y] - last[AXIS_Y];
+	float sz = to[AXIS_Z] - last[AXIS_Z];
+	float sl = sqrtf(sx * sx + sy * sy + sz * sz);
+	float r = (to[AXIS_E] - last[AXIS_E]) / sl;
+	if (fabsf(r - ratio) > PATHSTAGE_RATIO * fabsf(ratio) + 1e-6f)
+		return 0;
+
+	float dx = to[AXIS_X] - start[AXIS_X];
+	float dy = to[AXIS_Y] - start[AXIS_Y];
+	float dz = to[AXIS_Z] - start[AXIS_Z];
+	float l = sqrtf(dx * dx + dy * dy + dz * dz);
+	if (l == 0)
+		return 0;
+	dx /= l;
+	dy /= l;
+	dz /= l;
+
+	float along = 0;
+	for (unsigned int i = 0; i < nheld; i++) {
+		float px = points[i][AXIS_X] - start[AXIS_X];
+		float py = points[i][AXIS_Y] - start[AXIS_Y];
+		float pz = points[i][AXIS_Z] - start[AXIS_Z];
+		float t = px * dx + py * dy + pz * dz;
+		if ((t <= along) || (t >= l))
+			return 0;
+		along = t;
+		float off = px * px + py * py + pz * pz - t * t;
+		if (off > PATHSTAGE_TOLERANCE * PATHSTAGE_TOLERANCE)
+			return 0;
+	}
+	return 1;
+}
+
+// let the held run go, as one move if there's more than one segment
+int PathStage::flush() {
+	if (nheld == 0)
+		return 0;
+	if (nheld == 1) {
+		out.push_back(held[0]);
+	}
+	else {
+		const float *end = points[nheld - 1];
+		GcodeLine g;
+		memset(&g, 0, sizeof(g));
+		g.seen = GCODE_WORD('G') | GCODE_WORD('X') | GCODE_WORD('Y');
+		g.n = -1;
+		g.checksum = -1;
+		g.comment = -1;
+		g.text = -1;
+		WORD(&g, 'G') = WORD(&held[0].g, 'G');
+		for (int i = 0; i < 4; i++) {
+			int rel = (i == AXIS_E) ? relative_e : relative;
+			WORD(&g, "XYZE"[i]) = rel ? end[i] - start[i] : end[i];
+		}
+		if (end[AXIS_Z] != start[AXIS_Z])
+			g.seen |= GCODE_WORD('Z');
+		if (end[AXIS_E] != start[AXIS_E])
+			g.seen |= GCODE_WORD('E');
+		if (HAS(&held[0].g, 'F')) {
+			g.seen |= GCODE_WORD('F');
+			WORD(&g, 'F') = WORD(&held[0].g, 'F');
+		}
+		emit(held[nheld - 1].respondent, &g, NULL, 0);
+		out.back().queued = held[0].queued;
+	}
+	nheld = 0;
+	return 1;
+}
+
+void PathStage::emit(Socket *respondent, const GcodeLine *g, const char *text, int len) {
+	out.push_back(PathCommand());
+	PathCommand *c = &out.back();
+	c->respondent = respondent;
+	c->queued = arrived;
+	c->g = *g;
+	c->len = 0;
+	if (text && (len > 0) && (len < (int) sizeof(c->text))) {
+		memcpy(c->text, text, len);
+		c->text[len] = 0;
+		c->len = len;
+	}
+}
+
+// a straight move in the current modes
+void PathStage::move(Socket *respondent, const float *from, const float *to, float feedrate) {
+	GcodeLine g;
+	memset(&g, 0, sizeof(g));
+	g.seen = GCODE_WORD('G') | GCODE_WORD('X') | GCODE_WORD('Y');
+	g.n = -1;
+	g.checksum = -1;
+	g.comment = -1;
+	g.text = -1;
+	WORD(&g, 'G') = 1;
+	for (int i = 0; i < 4; i++) {
+		int rel = (i == AXIS_E) ? state.relative_e : state.relative;
+		WORD(&g, "XYZE"[i]) = rel ? to[i] - from[i] : to[i];
+	}
+	if (to[AXIS_Z] != from[AXIS_Z])
+		g.seen |= GCODE_WORD('Z');
+	if (to[AXIS_E] != from[AXIS_E])
+		g.seen |= GCODE_WORD('E');
+	if (feedrate > 0) {
+		g.seen |= GCODE_WORD('F');
+		WORD(&g, 'F') = feedrate;
+	}
+	emit(respondent, &g, NULL, 0);
+}
+
+/*
+ * G2 (clockwise) or G3 in the XY plane, centred by I J or sized by R,
+ * as chords which stray no more than PATHSTAGE_CHORD from it
+ */
+void PathStage::arc(Socket *respondent, const GcodeLine *g, const float *from, const float *to) {
+	float feedrate = HAS(g, 'F') ? WORD(g, 'F') : 0;
+	int cw = (WORD(g, 'G') == 2);
+	float cx, cy;
+
+	if (HAS(g, 'I') || HAS(g, 'J')) {
+		cx = from[AXIS_X] + (HAS(g, 'I') ? WORD(g, 'I') : 0);
+		cy = from[AXIS_Y] + (HAS(g, 'J') ? WORD(g, 'J') : 0);
+	}
+	else if (HAS(g, 'R')) {
+		float r = WORD(g, 'R');
+		float dx = to[AXIS_X] - from[AXIS_X];
+		float dy = to[AXIS_Y] - from[AXIS_Y];
+		float d = sqrtf(dx * dx + dy * dy);
+		if (d == 0) {
+			move(respondent, from, to, feedrate);
+			return;
+		}
+		float h = r * r - d * d / 4;
+		h = (h > 0) ? sqrtf(h) : 0;
+		// negative R means the long way round
+		float side = ((cw ? -1 : 1) * (r < 0 ? -1 : 1)) * h / d;
+		cx = from[AXIS_X] + dx / 2 - dy * side;
+		cy = from[AXIS_Y] + dy / 2 + dx * side;
+	}
+	else {
+		move(respondent, from, to, feedrate);
+		return;
+	}
+
+	float r = hypotf(from[AXIS_X] - cx, from[AXIS_Y] - cy);
+	float a0 = atan2f(from[AXIS_Y] - cy, from[AXIS_X] - cx);
+	float sweep = atan2f(to[AXIS_Y] - cy, to[AXIS_X] - cx) - a0;
+	if (cw && (sweep >= 0))
+		sweep -= 2 * M_PI;
+	else if (!cw && (sweep <= 0))
+		sweep += 2 * M_PI;
+
+	int n = 1;
+	if (r > PATHSTAGE_CHORD)
+		n = ceilf(fabsf(sweep) / (2 * acosf(1 - PATHSTAGE_CHORD / r)));
+	if (n < 1)
+		n = 1;
+
+	float prev[4], p[4];
+	memcpy(prev, from, sizeof(prev));
+	for (int k = 1; k <= n; k++) {
+		if (k == n) {
+			memcpy(p, to, sizeof(p));
+		}
+		else {
+			float f = (float) k / n;
+			p[AXIS_X] = cx + r * cosf(a0 + sweep * f);
+			p[AXIS_Y] = cy + r * sinf(a0 + sweep * f);
+			p[AXIS_Z] = from[AXIS_Z] + (to[AXIS_Z] - from[AXIS_Z]) * f;
+			p[AXIS_E] = from[AXIS_E] + (to[AXIS_E] - from[AXIS_E]) * f;
+		}
+		move(respondent, prev, p, (k == 1) ? feedrate : 0);
+		memcpy(prev, p, sizeof(prev));
+	}
+}
+
+int PathStage::pending() {
+	return !out.empty();
+}
+
+PathCommand *PathStage::front() {
+	return &out.front();
+}
+
+void PathStage::pop() {
+	out.pop_front();
+}
+
+/*
+ * runs of segments ended by a line which changes the modes or the
+ * position, for --check. the merged move has to come out in the modes
+ * the run was made in. returns the number of failures
+ */
+int PathStage::check() {
+	static const struct {
+		const char *gcode;
+		float x, e;
+	} cases[] = {
+		{ "G90\nM82\nG1 X10 Y10 E1\nG1 X10.2 E1.02\nG1 X10.4 E1.04\nG1 X10.6 E1.06\nG91\n", 10.6f, 1.06f },
+		{ "G90\nM82\nG1 X10 Y10 E1\nG1 X10.2 E1.02\nG1 X10.4 E1.04\nG1 X10.6 E1.06\nM83\n", 10.6f, 1.06f },
+		{ "G90\nM82\nG1 X10 Y10 E1\nG1 X10.2 E1.02\nG1 X10.4 E1.04\nG1 X10.6 E1.06\nG92 X0 E0\n", 10.6f, 1.06f },
+		{ "G1 X10 Y10 E1\nG91\nM83\nG1 X0.2 E0.02\nG1 X0.2 E0.02\nG1 X0.2 E0.02\nG90\n", 0.6f, 0.06f },
+		{ "G1 X10 Y10 E1\nG91\nM83\nG1 X0.2 E0.02\nG1 X0.2 E0.02\nG1 X0.2 E0.02\nM82\n", 0.6f, 0.06f },
+	};
+	int failed = 0;
+	for (unsigned int c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+		PathStage *p = new PathStage;
+		PrinterState state;
+		printerstate_init(&state);
+		p->setmode(PATHSTAGE_SIMPLIFY, &state);
+
+		GcodeLine g;
+		for (const char *l = cases[c].gcode; *l; ) {
+			const char *nl = strchr(l, '\n');
+			Gcode::parse(l, nl - l, &g);
+			p->push(NULL, &g, l, nl - l + 1, 1);
+			l = nl + 1;
+		}
+		p->flush();
+
+		// the merged move is the only line made here
+		const GcodeLine *m = NULL;
+		std::list<PathCommand>::iterator i;
+		for (i = p->out.begin(); i != p->out.end(); i++) {
+			if (i->len == 0)
+				m = &i->g;
+		}
+		if ((m == NULL) || (fabsf(WORD(m, 'X') - cases[c].x) > 1e-4f) || (fabsf(WORD(m, 'E') - cases[c].e) > 1e-4f)) {
+			printf("pathstage case %u FAILED: got X%g E%g, wanted X%g E%g\n", c, m ? WORD(m, 'X') : 0, m ? WORD(m, 'E') : 0, cases[c].x, cases[c].e);
+			failed++;
+		}
+		delete p;
+	}
+	printf("pathstage: %u cases, %d failed\n", (unsigned int) (sizeof(cases) / sizeof(cases[0])), failed);
+	return failed;
+}
@@ -0,0 +1,89 @@
+#ifndef _PATHSTAGE_HPP
+#define _PATHSTAGE_HPP
+
+#include <list>
+#include <cstdint>
+
+#include "gcode.hpp"
+#include "printerstate.hpp"
+
+class Socket;
+
+#define PATHSTAGE_ARCS     1   // expand G2/G3 into G1 segments
+#define PATHSTAGE_SIMPLIFY 2   // merge runs of collinear G1 segments
+
+// most segments merged into one move
+#define PATHSTAGE_LOOKAHEAD 32
+// how far a merged move may stray from the segments it replaces, mm
+#define PATHSTAGE_TOLERANCE 0.01f
+// segments longer than this are left alone, mm
+#define PATHSTAGE_SEGMENT   1.0f
+// how much the extrusion per mm may vary within a merged move
+#define PATHSTAGE_RATIO     0.02f
+// largest chord error of an expanded arc, mm
+#define PATHSTAGE_CHORD     0.01f
+
+// a line on its way out. len is 0 for lines made here, to be formatted.
+// queued is when the line it came from was pushed
+struct PathCommand {
+	Socket *respondent;
+	uint64_t queued;
+	GcodeLine g;
+	int len;
+	char text[256];
+};
+
+/*
+ * Reshape moves on their way to the printer: expand arcs for firmware
+ * which can't do them, and merge runs of tiny collinear segments so the
+ * serial link carries fewer lines.
+ *
+ * Lines go in with push() in the order they'd have been sent, and come
+ * out of front()/pop() in the same order. Only lines pushed with reshape
+ * set are changed- each output line earns one ok, so a client counting
+ * its oks must see its lines go through unchanged. A run being merged is
+ * held back until a line that doesn't fit, PATHSTAGE_LOOKAHEAD segments,
+ * or flush().
+ */
+class PathStage {
+public:
+	PathStage();
+
+	void setmode(int mode, const PrinterState *state);
+	int mode();
+
+	void push(Socket *respondent, const GcodeLine *g, const char *text, int len, int reshape, uint64_t queued = 0);
+	int flush();
+	void reset();
+	void forget(Socket *respondent);
+
+	int pending();
+	PathCommand *front();
+	void pop();
+
+	static int check();
+protected:
+	int flags;
+	// where the lines pushed so far leave the printer
+	PrinterState state;
+	std::list<PathCommand> out;
+
+	PathCommand held[PATHSTAGE_LOOKAHEAD];
+	float points[PATHSTAGE_LOOKAHEAD][4];
+	unsigned int nheld;
+	float start[4];
+	float ratio;
+	// the modes the held run was made in. the line that ends the run may
+	// change them before the run is flushed
+	int relative;
+	int relative_e;
+	// queued time of the line being pushed
+	uint64_t arrived;
+
+	void emit(Socket *respondent, const GcodeLine *g, const char *text, int len);
+	void move(Socket *respondent, const float *from, const float *to, float feedrate);
+	int fits(const float *to);
+	void arc(Socket *respondent, const GcodeLine *g, const float *from, const float *to);
+};
+
+#endif /* _PATHSTAGE_HPP */
@@ -0,0 +1,60 @@
+#include "pool.hpp"
+
+
+PoolCounters::PoolCounters(const char *name, size_t size) {
+	// counts may have started before we were constructed, so leave them be
+	this->name = name;
+	this->size = size;
+	all().push_back(this);
+}
+
+std::list<PoolCounters *> &PoolCounters::all() {
+	static std::list<PoolCounters *> counters;
+	return counters;
+}
+
+BufferArena::Block *BufferArena::freelists[32];
+PoolCounters BufferArena::counters("buffers", 0);
+
+// the class a size rounds up to, or -1 if it's too big to keep
+int BufferArena::sizeclass(size_t size) {
+	if ((size > POOL_ARENA_MAX) || (size < sizeof(Block)))
+		return -1;
+	int c = 0;
+	while (((size_t) 1 << c) < size)
+		c++;
+	return c;
+}
+
+void *BufferArena::get(size_t size) {
+	int c = sizeclass(size);
+	if (c < 0) {
+		counters.heap++;
+		return malloc(size);
+	}
+	counters.allocs++;
+	if (freelists[c] == NULL) {
+		counters.slabs++;
+		void *p = malloc((size_t) 1 << c);
+		if (p == NULL)
+			throw std::bad_alloc();
+		return p;
+	}
+	Block *b = freelists[c];
+	freelists[c] = b->next;
+	return b;
+}
+
+void BufferArena::put(void *p, size_t size) {
+	if (p == NULL)
+		return;
+	int c = sizeclass(size);
+	if (c < 0) {
+		free(p);
+		return;
+	}
+	counters.frees++;
+	Block *b = (Block *) p;
+	b->next = freelists[c];
+	freelists[c] = b;
+}
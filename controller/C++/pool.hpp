@@ -0,0 +1,131 @@
+#ifndef _POOL_HPP
+#define _POOL_HPP
+
+#include <cstddef>
+#include <cstdlib>
+#include <list>
+#include <new>
+#include <type_traits>
+#include <typeinfo>
+
+// objects carved from each slab a pool gets from the heap
+#define POOL_SLAB 64
+// buffers bigger than this come straight from the heap
+#define POOL_ARENA_MAX (1 << 20)
+
+/*
+ * What a pool has handed out, so churn can be checked for heap traffic:
+ * once warmed up, allocs and frees climb while slabs stays put.
+ */
+struct PoolCounters {
+	const char *name;
+	size_t size;
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long slabs;
+	// requests the pool couldn't serve, which went to the heap
+	unsigned long heap;
+
+	PoolCounters(const char *name, size_t size);
+	static std::list<PoolCounters *> &all();
+};
+
+/*
+ * Free lists of fixed size objects, for things made and dropped with every
+ * connection. Memory is only ever returned to the pool, never the heap.
+ * Requests for any other size- a subclass, an array- go to the heap, so
+ * class operator new/delete can use a pool without knowing what derives
+ * from it. Not thread safe: pools belong to the event loop.
+ */
+template <class T> class Pool {
+public:
+	static void *get(size_t size = sizeof(T)) {
+		if (size != sizeof(T)) {
+			counters.heap++;
+			return ::operator new(size);
+		}
+		if (freelist == NULL)
+			grow();
+		Slot *s = freelist;
+		freelist = s->next;
+		counters.allocs++;
+		return s;
+	}
+
+	static void put(void *p, size_t size = sizeof(T)) {
+		if (p == NULL)
+			return;
+		if (size != sizeof(T)) {
+			::operator delete(p);
+			return;
+		}
+		Slot *s = (Slot *) p;
+		s->next = freelist;
+		freelist = s;
+		counters.frees++;
+	}
+
+	static PoolCounters counters;
+private:
+	union Slot {
+		Slot *next;
+		typename std::aligned_storage<sizeof(T), alignof(T)>::type data;
+	};
+	static Slot *freelist;
+
+	static void grow() {
+		Slot *slab = (Slot *) malloc(sizeof(Slot) * POOL_SLAB);
+		if (slab == NULL)
+			throw std::bad_alloc();
+		for (int i = POOL_SLAB - 1; i >= 0; i--) {
+			slab[i].next = freelist;
+			freelist = &slab[i];
+		}
+		counters.slabs++;
+	}
+};
+
+template <class T> typename Pool<T>::Slot *Pool<T>::freelist = NULL;
+template <class T> PoolCounters Pool<T>::counters(typeid(T).name(), sizeof(T));
+
+// an allocator for std containers whose nodes should come from pools
+template <class T> class PoolAllocator {
+public:
+	typedef T value_type;
+
+	PoolAllocator() {}
+	template <class U> PoolAllocator(const PoolAllocator<U> &) {}
+
+	T *allocate(size_t n) {
+		return (T *) Pool<T>::get(n * sizeof(T));
+	}
+	void deallocate(T *p, size_t n) {
+		Pool<T>::put(p, n * sizeof(T));
+	}
+
+	template <class U> struct rebind {
+		typedef PoolAllocator<U> other;
+	};
+	template <class U> bool operator==(const PoolAllocator<U> &) const { return true; }
+	template <class U> bool operator!=(const PoolAllocator<U> &) const { return false; }
+};
+
+/*
+ * Buffers, in power of two size classes up to POOL_ARENA_MAX, eg. for
+ * ringbuffers. Like the pools, freed buffers are kept for reuse.
+ */
+class BufferArena {
+public:
+	static void *get(size_t size);
+	static void put(void *p, size_t size);
+
+	static PoolCounters counters;
+private:
+	struct Block {
+		Block *next;
+	};
+	static Block *freelists[32];
+	static int sizeclass(size_t size);
+};
+
+#endif /* _POOL_HPP */
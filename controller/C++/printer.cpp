@@ -3,6 +3,8 @@
 #include <cstdio>
 #include <cstring>
 
+#include <termios.h>
+
 namespace C {
 	#include <unistd.h>
 	#include <sys/types.h>
@@ -13,29 +15,56 @@ namespace C {
 }
 
 #include "gcode.hpp"
+#include "reply.hpp"
+#include "metrics.hpp"
+#include "arena.hpp"
 
 std::list<Printer *> Printer::allprinters;
 int Printer::allprinters_count;
 
 Printer::Printer() {
 	Socket::_fd = -1;
+	_port = NULL;
 	init();
 }
 
 Printer::Printer(int fd) {
+	_port = NULL;
 	Socket::open(fd);
 	init();
 }
 
 Printer::Printer(char *port, int baud) {
+	_port = NULL;
 	open(port, baud);
 	init();
 }
 
 Printer::~Printer() {
 	close();
+	retire();
+	free(_port);
+	free(_name);
+}
+
+/*
+ * out of service: off the list of printers and out of the metrics. this
+ * happens once, when the device goes or when we're deleted if it never did
+ */
+void Printer::retire() {
+	if (retired)
+		return;
+	retired = 1;
 	allprinters.remove(this);
 	allprinters_count--;
+	Metrics::remove(metric.txbytes);
+	Metrics::remove(metric.rxbytes);
+	Metrics::remove(metric.lines);
+	Metrics::remove(metric.ok);
+	Metrics::remove(metric.inflight);
+	Metrics::remove(metric.queued);
+	txbuf->count(-1);
+	rxbuf->count(-1);
 }
 
 char *Printer::name() {
@@ -45,28 +74,166 @@ char *Printer::name() {
 void Printer::setname(char *newname) {
 	free(_name);
 	int l = strlen(newname);
-	_name = (char *) malloc(l);
-	memcpy(_name, newname, l);
+	_name = (char *) malloc(l + 1);
+	memcpy(_name, newname, l + 1);
+	registermetrics();
+}
+
+static std::string printerlabel(const char *name, const char *extra = NULL) {
+	std::string l = "printer=\"";
+	for (; *name; name++) {
+		if ((*name == '"') || (*name == '\\'))
+			l += '\\';
+		l += *name;
+	}
+	l += '"';
+	if (extra)
+		l += std::string(",") + extra;
+	return l;
+}
+
+// register our metrics, or relabel them after a rename
+void Printer::registermetrics() {
+	if (metric.lines >= 0) {
+		Metrics::relabel(metric.txbytes, printerlabel(name(), "direction=\"tx\""));
+		Metrics::relabel(metric.rxbytes, printerlabel(name(), "direction=\"rx\""));
+		Metrics::relabel(metric.lines, printerlabel(name()));
+		Metrics::relabel(metric.ok, printerlabel(name()));
+		Metrics::relabel(metric.inflight, printerlabel(name()));
+		Metrics::relabel(metric.queued, printerlabel(name()));
+		return;
+	}
+	metric.txbytes = Metrics::counter("netrap_printer_bytes_total", "Bytes to and from each printer", printerlabel(name(), "direction=\"tx\""));
+	metric.rxbytes = Metrics::counter("netrap_printer_bytes_total", "Bytes to and from each printer", printerlabel(name(), "direction=\"rx\""));
+	metric.lines = Metrics::counter("netrap_printer_lines_total", "Lines sent to each printer", printerlabel(name()));
+	metric.ok = Metrics::histogram("netrap_printer_ok_seconds", "Time from writing a line to the printer to its ok", printerlabel(name()));
+	metric.inflight = Metrics::gauge("netrap_printer_inflight", "Lines sent to each printer and not yet acknowledged", printerlabel(name()));
+	metric.queued = Metrics::gauge("netrap_printer_queued_lines", "Lines queued in jobs on each printer", printerlabel(name()));
+	txbuf->count(metric.txbytes);
+	rxbuf->count(metric.rxbytes);
+}
+
+// queue depths are only worked out when someone asks
+void Printer::collect() {
+	static int pending = Metrics::gauge("netrap_jobs_pending", "Jobs waiting for a printer");
+	Metrics::set(pending, QueueManager::waiting());
+	std::list<Printer *>::iterator i;
+	for (i = allprinters.begin(); i != allprinters.end(); i++) {
+		Printer *p = *i;
+		Metrics::set(p->metric.inflight, p->tracer.inflight());
+		uint64_t queued = 0;
+		const list<Job *> &jobs = p->queuemanager.jobs();
+		list<Job *>::const_iterator j;
+		for (j = jobs.begin(); j != jobs.end(); j++)
+			queued += (*j)->numlines();
+		Metrics::set(p->metric.queued, queued);
+	}
+}
+
+static speed_t baudflag(int baud) {
+	switch (baud) {
+		case 9600:   return B9600;
+		case 19200:  return B19200;
+		case 38400:  return B38400;
+		case 57600:  return B57600;
+		case 115200: return B115200;
+		case 230400: return B230400;
+		case 460800: return B460800;
+		case 500000: return B500000;
+		case 921600: return B921600;
+		case 1000000: return B1000000;
+	}
+	fprintf(stderr, "Unsupported baud rate %d, using 115200\n", baud);
+	return B115200;
 }
 
+/*
+ * open and configure a serial port. O_NONBLOCK means this never waits for
+ * the device, so it's safe to call from inside the event loop
+ */
 int Printer::open(char *port, int baud) {
-	_fd = open(port, O_RDWR | O_NOCTTY | O_NONBLOCK);
-	if (_fd != -1) {
-		return Socket::open(_fd);
+	int fd = C::open(port, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd == -1) {
+		perror(port);
+		return -1;
+	}
+
+	struct termios t;
+	if (tcgetattr(fd, &t) == 0) {
+		cfmakeraw(&t);
+		cfsetispeed(&t, baudflag(baud));
+		cfsetospeed(&t, baudflag(baud));
+		t.c_cflag |= CLOCAL | CREAD;
+		t.c_cflag &= ~CRTSCTS;
+		tcsetattr(fd, TCSANOW, &t);
 	}
-	return _fd;
+
+	free(_port);
+	_port = strdup(port);
+
+	Socket::open(fd);
+	return fd;
+}
+
+const char *Printer::port() {
+	return _port;
+}
+
+/*
+ * the device has gone away- let its clients know, hand its jobs back, and
+ * go once nobody holds us. plugged in again it's a new Printer
+ */
+void Printer::disconnect() {
+	C::printf("Printer %s disconnected\n", name());
+	close();
+	tracer.clear();
+	path.reset();
+	encoder.reset();
+	retire();
+	queuemanager.broadcast("--printer disconnected--\n", 25, NULL, 0);
+	if (respondent && (respondent->opened() >= 0))
+		respondent->write("--printer disconnected--\n");
+	queuemanager.evict();
+	// another printer may take what was handed back
+	QueueManager::dispatch();
+	destroy();
 }
 
 void Printer::init() {
+	delete rxbuf;
+	rxbuf = new Ringbuffer(PRINTER_RXBUFFER);
+	overlong = 0;
+
 	allprinters.push_back(this);
 	allprinters_count++;
+	retired = 0;
+
+	respondent = NULL;
+	printerstate_init(&state);
 
 	_name = (char *) malloc(sizeof(void *) * 2 + 3);
 	C::printf("%d chars in name %s\n", snprintf(_name, sizeof(void *) * 2 + 3, "%p", this), this->name());
 
+	static int collecting = 0;
+	if (!collecting) {
+		Metrics::collector(&Printer::collect);
+		collecting = 1;
+	}
+	metric.lines = -1;
+	registermetrics();
+
 	capabilities["material"] = "PLA";
 	capabilities["diameter"] = "3.0";
 	capabilities["fan"] = "true";
+	capabilities["window"] = "1";
+	window = 1;
+	capabilities["path"] = "off";
+	capabilities["encode"] = "on";
+	capabilities["trace"] = "off";
+	capabilities["trace.stall"] = "1000";
+	capabilities["resolution"] = "0.001";
+	capabilities["resolution.e"] = "0.00001";
+	configureencoder();
 
 	properties["position.X"] = "0";
 	properties["position.Y"] = "0";
@@ -85,39 +252,362 @@ void Printer::init() {
 	properties["fanspeed"] = "0";
 
 	queuemanager.setDrain(this);
+	queuemanager.setBehaviours(BEHAVIOUR_SOURCEPAUSE | BEHAVIOUR_DRAINDROP);
+	probing = 0;
 	if (_fd >= 0) {
+		probing = 1;
 		write("M115\n", 5);
 		write("M114\n", 5);
 		write("M105\n", 5);
 	}
 }
 
+const char *Printer::getCapability(const char *capability) {
+	map<string, string>::iterator i = capabilities.find(capability);
+	if (i == capabilities.end())
+		return NULL;
+	return i->second.c_str();
+}
+
+void Printer::setCapability(const char *capability, const char *value) {
+	capabilities[capability] = value;
+	if (strcmp(capability, "window") == 0) {
+		window = atoi(value);
+		if (window < 1)
+			window = 1;
+		feed();
+	}
+	else if (strcmp(capability, "path") == 0) {
+		configurepath();
+		feed();
+	}
+	else if ((strcmp(capability, "encode") == 0) || (strncmp(capability, "resolution", 10) == 0)) {
+		configureencoder();
+	}
+	else if (strcmp(capability, "trace") == 0) {
+		// a file to write every line's timings to, or off
+		if (tracer.record(value) < 0)
+			capabilities[capability] = "off";
+	}
+	else if (strcmp(capability, "trace.stall") == 0) {
+		tracer.setstall(atoi(value));
+	}
+}
+
+/*
+ * path=on reshapes print moves on the way out: arcs are expanded unless
+ * the firmware says it does them, and micro-segments merged either way
+ */
+void Printer::configurepath() {
+	const char *on = getCapability("path");
+	if ((on == NULL) || (strcmp(on, "on") != 0)) {
+		path.setmode(0, &state);
+		return;
+	}
+	const char *arcs = getCapability("cap.ARCS");
+	int mode = PATHSTAGE_SIMPLIFY;
+	if ((arcs == NULL) || (strcmp(arcs, "1") != 0))
+		mode |= PATHSTAGE_ARCS;
+	path.setmode(mode, &state);
+}
+
+/*
+ * encode=on strips lines down to what the firmware needs before they go
+ * out, compact drops the spaces between words too. resolution and
+ * resolution.e are the smallest steps worth sending, in mm
+ */
+void Printer::configureencoder() {
+	const char *mode = getCapability("encode");
+	const char *xyz = getCapability("resolution");
+	const char *e = getCapability("resolution.e");
+	if ((mode == NULL) || (strcmp(mode, "off") == 0))
+		encoder.setmode(ENCODER_OFF);
+	else if (strcmp(mode, "compact") == 0)
+		encoder.setmode(ENCODER_COMPACT);
+	else
+		encoder.setmode(ENCODER_ON);
+	encoder.setresolution(xyz ? atof(xyz) : 0.001f, e ? atof(e) : 0.00001f);
+}
+
+// the planner limits from capabilities, for time estimates
+void Printer::motionlimits(MotionLimits *limits) {
+	static const char axes[4] = { 'x', 'y', 'z', 'e' };
+	char key[16];
+	const char *v;
+	motionlimits_init(limits);
+	if ((v = getCapability("accel")) != NULL)
+		limits->accel = atof(v);
+	for (int i = 0; i < 4; i++) {
+		snprintf(key, sizeof(key), "jerk.%c", axes[i]);
+		if ((v = getCapability(key)) != NULL)
+			limits->jerk[i] = atof(v);
+		snprintf(key, sizeof(key), "feedrate.%c", axes[i]);
+		if ((v = getCapability(key)) != NULL)
+			limits->feedrate[i] = atof(v);
+	}
+}
+
+void Printer::status(Socket *to) {
+	to->printf("printer: %s\n", name());
+	to->printf("position: %.3f %.3f %.3f %.3f\n", state.position[AXIS_X], state.position[AXIS_Y], state.position[AXIS_Z], state.position[AXIS_E]);
+	to->printf("hotend: %.1f/%.1f\n", state.hotend[state.tool], state.hotend_target[state.tool]);
+	to->printf("bed: %.1f/%.1f\n", state.bed, state.bed_target);
+	to->printf("inflight: %u/%u\n", tracer.inflight(), window);
+
+	const list<Job *> &jobs = queuemanager.jobs();
+	list<Job *>::const_iterator i;
+	for (i = jobs.begin(); i != jobs.end(); i++) {
+		uint64_t done, total;
+		double remaining;
+		if ((*i)->progress(&done, &total, &remaining))
+			to->printf("job %p: %llu/%llu lines, %.0fs left\n", *i, (unsigned long long) done, (unsigned long long) total, remaining);
+		else
+			to->printf("job %p: %u lines queued\n", *i, (*i)->numlines());
+	}
+	to->printf("--end of status--\n");
+}
+
+// how long lines take to go out and be acknowledged, and the slowest
+void Printer::trace(ArenaText *out) {
+	out->printf("printer: %s\n", name());
+	tracer.report(out);
+}
+
 int Printer::write(string str) {
 	return write(str.c_str(), str.length());
 }
 
 int Printer::write(const char *str, int len) {
-	float words[32];
-	uint32_t seen;
-	// TODO: extract target properties from outgoing commands
-	seen = Gcode::parse(str, len, words);
-	return Socket::write(str, len);
+	return write(NULL, str, len);
 }
 
+// lines written to the printer are queued, and sent as the ok window
+// allows. returns 0 if there's no room for them yet, as Job::write does
 int Printer::write(Socket *respondent, const char *str, int len) {
-	this->respondent = respondent;
-	return write(str, len);
+	return queuemanager.enqueue(respondent, str, len);
+}
+
+int Printer::canaccept() {
+	return (_fd >= 0) && (tracer.inflight() < window) && !tracer.full() && (txbuf->canwrite() >= 256);
+}
+
+void Printer::feed() {
+	queuemanager.feed();
+}
+
+void Printer::monitor(Socket *drain) {
+	queuemanager.addDrain(drain);
+}
+
+// a respondent is going away, so its replies go nowhere
+void Printer::forget(Socket *respondent) {
+	tracer.forget(respondent);
+	if (this->respondent == respondent)
+		this->respondent = NULL;
+	path.forget(respondent);
+	queuemanager.delDrain(respondent);
+	queuemanager.forget(respondent);
+}
+
+void Printer::attach(Job *job) {
+	queuemanager.addSource(job);
+	queuemanager.feed();
+}
+
+int Printer::idle() {
+	return queuemanager.idle();
+}
+
+/*
+ * send a line, or hand it to the path stage to be sent by release().
+ * reshape lets the path stage change it, which only print jobs allow
+ */
+int Printer::send(Socket *respondent, const char *str, int len, const GcodeLine *tokens, int reshape) {
+	uint64_t queued = Metrics::now();
+	GcodeLine g;
+	if (tokens == NULL) {
+		Gcode::parse(str, len, &g);
+		tokens = &g;
+	}
+
+	// blank and comment-only lines get no ok, so don't send them at all
+	if ((tokens->error == GCODE_OK) && (tokens->seen == 0) && (tokens->bare == 0))
+		return 0;
+
+	if (path.mode() || path.pending()) {
+		path.push(respondent, tokens, str, len, reshape, queued);
+		release();
+		return len;
+	}
+	return transmit(respondent, str, len, tokens, queued);
 }
 
-int Printer::read(char *buf, int buflen) {
-	int r = Socket::read(buf, buflen);
-	// TODO: extract properties from replies
-	if (respondent) {
-		respondent->write(buf, buflen);
+// send one line the path stage has ready, if there's room
+int Printer::release() {
+	if (!path.pending() || !canaccept())
+		return 0;
+	PathCommand *c = path.front();
+	if (c->len == 0)
+		c->len = Gcode::format(&c->g, c->text, sizeof(c->text));
+	if (c->len > 0)
+		transmit(c->respondent, c->text, c->len, &c->g, c->queued);
+	path.pop();
+	return 1;
+}
+
+// let go of any moves the path stage is holding back to merge
+int Printer::flush() {
+	return path.flush();
+}
+
+int Printer::transmit(Socket *respondent, const char *str, int len, const GcodeLine *tokens, uint64_t queued) {
+	char line[256];
+	int l = encoder.encode(tokens, &state, line, sizeof(line));
+	if (l > 0) {
+		str = line;
+		len = l;
 	}
+
+	if (tokens->error == GCODE_OK)
+		printerstate_apply(&state, tokens);
+	else
+		// pass it on anyway, the firmware may know better
+		C::printf("Printer %s: unparseable gcode at column %d: %.*s", name(), tokens->erroroffset, len, str);
+
+	Metrics::add(metric.lines);
+	this->respondent = respondent;
+	int r = Socket::write(str, len);
+	tracer.sent(respondent, queued, str, r);
 	return r;
 }
 
+// lines are written when the last of them leaves txbuf
+void Printer::onwrite(struct SelectFd *selected) {
+	unsigned int before = txbuf->canread();
+	Socket::onwrite(selected);
+	tracer.flushed(before - txbuf->canread(), Metrics::now());
+}
+
+void Printer::onread(struct SelectFd *selected) {
+	Socket::onread(selected);
+
+	// parse replies straight out of rxbuf, then pass them on to whoever
+	// sent the oldest unacknowledged line
+	const char *seg1, *seg2;
+	unsigned int len1, len2, l;
+	int acked = 0, probed = 0;
+	while ((l = rxbuf->linespan(&seg1, &len1, &seg2, &len2)) > 0) {
+		if (overlong) {
+			// the rest of a reply that was too long
+			rxbuf->skip(l);
+			overlong = 0;
+			continue;
+		}
+		uint32_t flags = Reply::parse(seg1, len1, seg2, len2, &state);
+		if (flags & (REPLY_FIRMWARE | REPLY_CAPABILITY)) {
+			char line[256];
+			unsigned int l1 = (len1 < sizeof(line) - 1) ? len1 : sizeof(line) - 1;
+			unsigned int l2 = (len2 < sizeof(line) - 1 - l1) ? len2 : sizeof(line) - 1 - l1;
+			memcpy(line, seg1, l1);
+			if (l2)
+				memcpy(&line[l1], seg2, l2);
+			line[l1 + l2] = 0;
+			firmware(line);
+		}
+		if (flags & REPLY_START) {
+			// the firmware has reset, anything in flight was lost
+			tracer.clear();
+			path.reset();
+			encoder.reset();
+			probing = 1;
+			write("M115\n", 5);
+		}
+		Socket *dest = tracer.inflight() ? tracer.front() : respondent;
+		if (dest && dest->opened() >= 0) {
+			dest->write(seg1, len1);
+			if (len2)
+				dest->write(seg2, len2);
+		}
+		queuemanager.broadcast(seg1, len1, seg2, len2);
+		const LineTrace *t;
+		if ((flags & REPLY_OK) && (t = tracer.acked(Metrics::now()))) {
+			Metrics::observe(metric.ok, t->ok - t->written);
+			if (t->flags & TRACE_STALL)
+				C::printf("Printer %s: line %llu took %.3fs to ok: %s\n", name(), (unsigned long long) t->seq, (t->ok - t->queued) / 1e9, t->text);
+			acked++;
+			// the M115 goes first, so this is its ok
+			if (probing) {
+				probing = 0;
+				probed = 1;
+			}
+		}
+		rxbuf->skip(l);
+	}
+
+	// a full rxbuf with no newline in it would never be read into again
+	if ((rxbuf->numlines() == 0) && (overlong || (rxbuf->canwrite() == 0))) {
+		if (!overlong)
+			C::printf("Printer %s: reply longer than %d bytes dropped\n", name(), PRINTER_RXBUFFER);
+		rxbuf->skip(rxbuf->canread());
+		overlong = 1;
+	}
+
+	if ((rxbuf->canwrite() > 0) && (_fd >= 0) && !stalled) {
+		selector[_fd]->poll |= POLL_READ;
+	}
+
+	if (acked)
+		feed();
+	if (probed)
+		QueueManager::dispatch();
+}
+
+/*
+ * pick capabilities out of the M115 reply, eg.
+ *	FIRMWARE_NAME:Marlin 1.1.9 (Github) PROTOCOL_VERSION:1.0 MACHINE_TYPE:i3 EXTRUDER_COUNT:1
+ *	Cap:ARCS:1
+ */
+void Printer::firmware(const char *line) {
+	const char *fields[][2] = {
+		{ "FIRMWARE_NAME:", "firmware" },
+		{ "MACHINE_TYPE:", "machine" },
+		{ "EXTRUDER_COUNT:", "extruders" },
+		{ "PROTOCOL_VERSION:", "protocol" },
+		{ NULL, NULL }
+	};
+
+	if (strncasecmp(line, "Cap:", 4) == 0) {
+		const char *value = index(line + 4, ':');
+		if (value == NULL)
+			return;
+		string cap = string("cap.") + string(line + 4, value - line - 4);
+		int l;
+		for (value++, l = 0; value[l] > 32; l++);
+		capabilities[cap] = string(value, l);
+		if (cap == "cap.ARCS")
+			configurepath();
+		return;
+	}
+
+	for (int i = 0; fields[i][0]; i++) {
+		const char *value = strstr(line, fields[i][0]);
+		if (value == NULL)
+			continue;
+		value += strlen(fields[i][0]);
+		// values may contain spaces, so run up to the next " KEY:"
+		int l, k;
+		for (l = 0; value[l] >= 32; l++) {
+			if (value[l] != ' ')
+				continue;
+			for (k = l + 1; (value[k] >= 'A' && value[k] <= 'Z') || value[k] == '_'; k++);
+			if ((k > l + 1) && (value[k] == ':'))
+				break;
+		}
+		capabilities[fields[i][1]] = string(value, l);
+	}
+	C::printf("Printer %s is running %s\n", name(), getCapability("firmware") ? getCapability("firmware") : "unknown firmware");
+}
+
 int Printer::printercount() {
 	return allprinters_count;
 }
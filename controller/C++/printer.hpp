@@ -1,11 +1,21 @@
 #ifndef _PRINTER_HPP
+#define _PRINTER_HPP
 
 #include "socket.hpp"
 #include "queuemanager.hpp"
+#include "printerstate.hpp"
+#include "estimator.hpp"
+#include "pathstage.hpp"
+#include "encoder.hpp"
+#include "trace.hpp"
 
 #include <string>
 #include <map>
 
+// longer than any reply we care about- firmware() keeps up to 255 bytes of
+// the M115 reply. longer replies are dropped
+#define PRINTER_RXBUFFER 1024
+
 class Printer;
 class Printer : public Socket {
 public:
@@ -21,10 +31,15 @@ public:
 	void setname(char *newname);
 
 	int open(char *port, int baud);
+	const char *port();
+	void disconnect();
 
 	char **listCapabilities();
-	char *getCapability(char *capability);
-	void setCapability(char *capability, char *value);
+	const char *getCapability(const char *capability);
+	void setCapability(const char *capability, const char *value);
+	void motionlimits(MotionLimits *limits);
+	void status(Socket *to);
+	void trace(ArenaText *out);
 
 	char **listProperties();
 	char *getProperty(char *property);
@@ -35,16 +50,62 @@ public:
 
 	int write(Socket *respondent, const char *str, int len);
 
-	int read(char *buffer, int buflen);
+	int canaccept();
+	int send(Socket *respondent, const char *str, int len, const GcodeLine *tokens = NULL, int reshape = 0);
+	int release();
+	int flush();
+	void feed();
+	void monitor(Socket *drain);
+	void forget(Socket *respondent);
+	void attach(Job *job);
+	int idle();
+
+	PrinterState state;
 protected:
 	char *_name;
+	char *_port;
 	void init();
+	void retire();
+	int retired;
+	// the reply being read didn't fit rxbuf, drop up to its newline
+	int overlong;
+	// the M115 sent on attach or reset isn't answered yet. jobs aren't
+	// dispatched here until it is, and capabilities are known
+	int probing;
+	void firmware(const char *line);
+	void configurepath();
+	void configureencoder();
+	int transmit(Socket *respondent, const char *str, int len, const GcodeLine *tokens, uint64_t queued);
 	QueueManager queuemanager;
 	map<string, string> properties;
 	map<string, string> capabilities;
 
 	Socket *respondent;
 
+	// lines sent but not yet acknowledged, by who sent them and when
+	LineTracer tracer;
+	unsigned int window;
+
+	PathStage path;
+	Encoder encoder;
+
+	// ids in the Metrics registry, labelled with our name
+	struct {
+		int txbytes;
+		int rxbytes;
+		int lines;
+		int ok;
+		int inflight;
+		int queued;
+	} metric;
+	void registermetrics();
+	static void collect();
+
+	friend class QueueManager;
+
+	virtual void onread(struct SelectFd *selected);
+	virtual void onwrite(struct SelectFd *selected);
+
 	static int allprinters_count;
 private:
 };
@@ -0,0 +1,98 @@
+#include "printerstate.hpp"
+
+#include <cstring>
+
+void printerstate_init(PrinterState *state) {
+	memset(state, 0, sizeof(PrinterState));
+	state->extruders = 1;
+	state->resend = -1;
+}
+
+#define WORD(g, letter) ((g)->words[(letter) - 'A'])
+#define HAS(g, letter) ((g)->seen & GCODE_WORD(letter))
+
+/*
+ * track the modal state a command leaves behind- positions, feedrate,
+ * absolute/relative modes, temperature targets, tool and fan
+ */
+void printerstate_apply(PrinterState *state, const GcodeLine *g) {
+	static const char axes[4] = { 'X', 'Y', 'Z', 'E' };
+	int i;
+
+	if (HAS(g, 'G')) {
+		switch ((int) WORD(g, 'G')) {
+			case 0: case 1: case 2: case 3:
+				for (i = 0; i < 4; i++) {
+					if (!HAS(g, axes[i]))
+						continue;
+					int rel = (i == AXIS_E) ? state->relative_e : state->relative;
+					state->target[i] = rel ? state->target[i] + WORD(g, axes[i]) : WORD(g, axes[i]);
+				}
+				if (HAS(g, 'F'))
+					state->feedrate = WORD(g, 'F');
+				break;
+			case 28: {
+				uint32_t named = (g->seen | g->bare) & (GCODE_WORD('X') | GCODE_WORD('Y') | GCODE_WORD('Z'));
+				for (i = 0; i < 3; i++) {
+					if ((named == 0) || (named & GCODE_WORD(axes[i])))
+						state->target[i] = 0;
+				}
+				break;
+			}
+			case 90:
+				state->relative = 0;
+				state->relative_e = 0;
+				break;
+			case 91:
+				state->relative = 1;
+				state->relative_e = 1;
+				break;
+			case 92: {
+				int any = 0;
+				for (i = 0; i < 4; i++) {
+					if (HAS(g, axes[i])) {
+						state->target[i] = WORD(g, axes[i]);
+						any = 1;
+					}
+				}
+				if (!any) {
+					for (i = 0; i < 4; i++)
+						state->target[i] = 0;
+				}
+				break;
+			}
+		}
+	}
+	else if (HAS(g, 'M')) {
+		switch ((int) WORD(g, 'M')) {
+			case 82:
+				state->relative_e = 0;
+				break;
+			case 83:
+				state->relative_e = 1;
+				break;
+			case 104: case 109:
+				if (HAS(g, 'S')) {
+					int tool = HAS(g, 'T') ? (int) WORD(g, 'T') : state->tool;
+					if ((tool >= 0) && (tool < PRINTER_MAX_EXTRUDERS))
+						state->hotend_target[tool] = WORD(g, 'S');
+				}
+				break;
+			case 140: case 190:
+				if (HAS(g, 'S'))
+					state->bed_target = WORD(g, 'S');
+				break;
+			case 106:
+				state->fan = HAS(g, 'S') ? WORD(g, 'S') : 255;
+				break;
+			case 107:
+				state->fan = 0;
+				break;
+		}
+	}
+	else if (HAS(g, 'T')) {
+		int tool = (int) WORD(g, 'T');
+		if ((tool >= 0) && (tool < PRINTER_MAX_EXTRUDERS))
+			state->tool = tool;
+	}
+}
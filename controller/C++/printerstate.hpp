@@ -0,0 +1,39 @@
+#ifndef _PRINTERSTATE_HPP
+#define _PRINTERSTATE_HPP
+
+#include "gcode.hpp"
+
+#define PRINTER_MAX_EXTRUDERS 4
+
+#define AXIS_X 0
+#define AXIS_Y 1
+#define AXIS_Z 2
+#define AXIS_E 3
+
+// typed view of what we know about a printer, kept up to date from its replies
+struct PrinterState {
+	float position[4];
+	float hotend[PRINTER_MAX_EXTRUDERS];
+	float hotend_target[PRINTER_MAX_EXTRUDERS];
+	float bed;
+	float bed_target;
+	int extruders;
+	int tool;
+
+	int busy;
+	long resend;
+	unsigned long oks;
+	unsigned long errors;
+
+	// where the commands we've sent so far will leave the printer
+	float target[4];
+	float feedrate;
+	float fan;
+	int relative;
+	int relative_e;
+};
+
+void printerstate_init(PrinterState *state);
+void printerstate_apply(PrinterState *state, const GcodeLine *g);
+
+#endif /* _PRINTERSTATE_HPP */
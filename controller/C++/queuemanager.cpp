@@ -1,31 +1,332 @@
 #include "queuemanager.hpp"
 
+#include "printer.hpp"
+
+#include <cstdio>
+
+list<Job *> QueueManager::pending;
+
 QueueManager::QueueManager() {
+	behaviour = 0;
+	printer = NULL;
+	current = sources.end();
 }
 
-QueueManager::QueueManager(Socket *drain) {
+QueueManager::QueueManager(Printer *drain) {
+	behaviour = 0;
+	current = sources.end();
 	setDrain(drain);
 }
 
 QueueManager::~QueueManager() {
+	list<Job *>::iterator i;
+	for (i = sources.begin(); i != sources.end(); i++)
+		delete *i;
+	list<Drain>::iterator d;
+	for (d = drains.begin(); d != drains.end(); d++)
+		d->socket->unref();
 }
 
 void QueueManager::setBehaviours(int behaviours) {
 	behaviour = behaviours;
+	list<Job *>::iterator i;
+	for (i = sources.begin(); i != sources.end(); i++)
+		(*i)->pause = (behaviour & BEHAVIOUR_SOURCEPAUSE) ? 1 : 0;
+}
+
+void QueueManager::setDrain(Printer *drain) {
+	printer = drain;
 }
 
 void QueueManager::addDrain(Socket *drain) {
-	drains.push_back(drain);
+	Drain d = { drain, 0 };
+	drain->ref();
+	drains.push_back(d);
 }
 
 void QueueManager::delDrain(Socket *drain) {
-	drains.remove(drain);
+	list<Drain>::iterator i;
+	for (i = drains.begin(); i != drains.end(); i++) {
+		if (i->socket == drain) {
+			drains.erase(i);
+			drain->unref();
+			return;
+		}
+	}
 }
 
-void addSocket(Socket *s) {
+/*
+ * copy a printer reply to every monitoring drain. this never waits on a
+ * drain- the printer is the one thing we don't hold up
+ */
+void QueueManager::broadcast(const char *seg1, unsigned int len1, const char *seg2, unsigned int len2) {
+	list<Drain>::iterator i;
+	for (i = drains.begin(); i != drains.end(); ) {
+		Socket *drain = i->socket;
+		if (drain->opened() < 0) {
+			i = drains.erase(i);
+			drain->unref();
+			continue;
+		}
+		if ((behaviour & BEHAVIOUR_DRAINDROP) && (drain->canwrite() < (int) (len1 + len2))) {
+			if (++i->skipped >= QUEUEMANAGER_MAXSKIP) {
+				printf("Dropping slow drain %s\n", drain->toString());
+				i = drains.erase(i);
+				drain->unref();
+			}
+			else {
+				++i;
+			}
+			continue;
+		}
+		i->skipped = 0;
+		drain->write(seg1, len1);
+		if (len2)
+			drain->write(seg2, len2);
+		++i;
+	}
+}
+
+void QueueManager::addSource(Job *s) {
+	s->printer = printer;
+	s->deficit = 0;
+	s->pause = (behaviour & BEHAVIOUR_SOURCEPAUSE) ? 1 : 0;
 	sources.push_back(s);
 }
 
-void delSocket(Socket *s) {
+void QueueManager::delSource(Job *s) {
+	if ((current != sources.end()) && (*current == s))
+		++current;
 	sources.remove(s);
+	s->printer = NULL;
+}
+
+/*
+ * a client has gone away. its interactive job goes with it, and its other
+ * jobs let go of it so it can be freed now rather than when the printer
+ * next acks a line, which on an idle printer is never
+ */
+void QueueManager::forget(Socket *source) {
+	int finished = 0;
+	list<Job *>::iterator i;
+	for (i = sources.begin(); i != sources.end(); ) {
+		Job *job = *i;
+		++i;
+		if (job->source != source)
+			continue;
+		job->orphan();
+		if ((job->priority == JOB_PRIORITY_INTERACTIVE) || job->complete()) {
+			if (job->priority < JOB_PRIORITY_INTERACTIVE)
+				finished++;
+			delSource(job);
+			delete job;
+		}
+	}
+	if (finished)
+		dispatch();
+}
+
+/*
+ * the printer has gone. jobs which can wait for another printer go back
+ * to pending, the rest end here, and drains are let go
+ */
+void QueueManager::evict() {
+	list<Job *> jobs = sources;
+	list<Job *>::iterator i;
+	for (i = jobs.begin(); i != jobs.end(); i++) {
+		Job *job = *i;
+		// requeue() may want to say which printer it was on
+		int again = job->requeue();
+		delSource(job);
+		if (again)
+			queue(job);
+		else
+			delete job;
+	}
+	list<Drain>::iterator d;
+	for (d = drains.begin(); d != drains.end(); d++)
+		d->socket->unref();
+	drains.clear();
+}
+
+/*
+ * queue a line from a client talking to this printer directly. each
+ * client gets its own interactive job, created on first use. returns
+ * what the job's write() did with it
+ */
+int QueueManager::enqueue(Socket *source, const char *line, int len) {
+	Job *job = NULL;
+	list<Job *>::iterator i;
+	for (i = sources.begin(); i != sources.end(); i++) {
+		if (((*i)->source == source) && ((*i)->priority == JOB_PRIORITY_INTERACTIVE)) {
+			job = *i;
+			break;
+		}
+	}
+	if (job == NULL) {
+		job = new Job(source, JOB_PRIORITY_INTERACTIVE);
+		addSource(job);
+	}
+	int r = job->write(line, len);
+	feed();
+	return r;
+}
+
+/*
+ * deficit round robin over the jobs of one priority. the job under
+ * current keeps the printer until its credit runs out, then the next job
+ * with lines waiting is credited a quantum and takes over
+ */
+Job *QueueManager::next(int priority) {
+	for (unsigned int n = (sources.size() + 1) * 2; n > 0; n--) {
+		if (current == sources.end())
+			current = sources.begin();
+		Job *job = *current;
+		if (job->numlines() == 0) {
+			job->deficit = 0;
+		}
+		else if (job->priority == priority) {
+			if (job->deficit >= (int) job->peeklen())
+				return job;
+		}
+		if (++current == sources.end())
+			current = sources.begin();
+		if (((*current)->priority == priority) && (*current)->numlines())
+			(*current)->deficit += QUEUEMANAGER_QUANTUM;
+	}
+	return NULL;
+}
+
+void QueueManager::feed() {
+	char line[JOB_MAXLINE + 1];
+	list<Job *>::iterator i;
+
+	while ((printer != NULL) && printer->canaccept()) {
+		// lines the path stage has ready go first, they came first
+		if (printer->release())
+			continue;
+
+		int priority = -1;
+		for (i = sources.begin(); i != sources.end(); i++) {
+			if (((*i)->priority > priority) && (*i)->numlines())
+				priority = (*i)->priority;
+		}
+		if (priority < 0) {
+			// nothing more to merge with for now
+			if (printer->flush())
+				continue;
+			break;
+		}
+
+		Job *job = next(priority);
+		if (job == NULL)
+			break;
+
+		int l = job->readline(line, sizeof(line));
+		job->deficit -= l;
+		job->sent++;
+		printer->send(job->source, line, l, job->tokens(), job->priority < JOB_PRIORITY_INTERACTIVE);
+	}
+
+	// reap finished jobs. once a printer has no print running it can
+	// take the next pending job
+	int finished = 0;
+	for (i = sources.begin(); i != sources.end(); ) {
+		Job *job = *i;
+		++i;
+		if (job->complete()) {
+			if (job->priority < JOB_PRIORITY_INTERACTIVE)
+				finished++;
+			delSource(job);
+			delete job;
+		}
+	}
+	if (finished)
+		dispatch();
+}
+
+// a printer is idle while nothing but interactive jobs are attached to it
+int QueueManager::idle() {
+	list<Job *>::iterator i;
+	for (i = sources.begin(); i != sources.end(); i++) {
+		if ((*i)->priority < JOB_PRIORITY_INTERACTIVE)
+			return 0;
+	}
+	return 1;
+}
+
+const list<Job *> &QueueManager::jobs() {
+	return sources;
+}
+
+void QueueManager::submit(Job *job) {
+	queue(job);
+	dispatch();
+}
+
+// into pending behind the jobs of its priority
+void QueueManager::queue(Job *job) {
+	list<Job *>::iterator i;
+	for (i = pending.begin(); i != pending.end(); i++) {
+		if ((*i)->priority < job->priority)
+			break;
+	}
+	pending.insert(i, job);
+}
+
+/*
+ * the same for jobs still waiting for a printer. a finished one runs
+ * without its client, but one cut off before its end would print part
+ * of a file, so it goes
+ */
+void QueueManager::withdraw(Socket *source) {
+	list<Job *>::iterator i;
+	for (i = pending.begin(); i != pending.end(); ) {
+		Job *job = *i;
+		if (job->source != source) {
+			++i;
+			continue;
+		}
+		if (job->whole()) {
+			job->orphan();
+			++i;
+			continue;
+		}
+		printf("Job %p dropped, its client went away before the end of the job\n", job);
+		i = pending.erase(i);
+		delete job;
+	}
+}
+
+unsigned int QueueManager::waiting() {
+	return pending.size();
+}
+
+void QueueManager::dispatch() {
+	list<Job *>::iterator i;
+	list<Printer *>::iterator j;
+	list<Printer *> started;
+	for (i = pending.begin(); i != pending.end(); ) {
+		Job *job = *i;
+		Printer *target = NULL;
+		for (j = Printer::allprinters.begin(); j != Printer::allprinters.end(); j++) {
+			if ((*j)->opened() >= 0 && !(*j)->probing && (*j)->queuemanager.idle() && job->compatible(*j)) {
+				target = *j;
+				break;
+			}
+		}
+		if (target == NULL) {
+			++i;
+			continue;
+		}
+		i = pending.erase(i);
+		printf("Job %p dispatched to printer %s\n", job, target->name());
+		target->queuemanager.addSource(job);
+		started.push_back(target);
+	}
+
+	// feeding may finish jobs and dispatch again, so only once we're done
+	// walking the pending list
+	for (j = started.begin(); j != started.end(); j++)
+		(*j)->queuemanager.feed();
 }
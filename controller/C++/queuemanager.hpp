@@ -3,31 +3,85 @@
 
 #include "array.hpp"
 #include "socket.hpp"
+#include "job.hpp"
 
 #include <iostream>
 #include <list>
 
 using namespace std;
 
+class Printer;
+
+// bytes of credit a job earns each time deficit round robin visits it
+#define QUEUEMANAGER_QUANTUM 256
+// consecutive replies a drain may miss before it's dropped
+#define QUEUEMANAGER_MAXSKIP 64
+
+/*
+ * Each Printer owns a QueueManager which feeds it lines from the jobs
+ * attached to it.
+ *
+ * Between priorities the scheduling is strict, so an interactive jog
+ * always goes out before the next line of a bulk print. Jobs of the same
+ * priority share the printer by deficit round robin over their line lengths.
+ *
+ * Jobs which don't need a specific printer are submit()ted to a global
+ * pending list, and dispatched to the first idle printer they're
+ * compatible with.
+ */
 class QueueManager {
 public:
 	QueueManager();
-	QueueManager(Socket *drain);
+	QueueManager(Printer *drain);
 	~QueueManager();
 
-#define BEHAVIOUR_SOURCEPAUSE 1;
-#define BEHAVIOUR_DRAINDROP   2;
+/*
+ * SOURCEPAUSE: stall() a job's source when its queue is above the high
+ *	watermark instead of dropping lines, unstall() at the low watermark
+ * DRAINDROP: skip whole reply lines for monitoring drains which can't keep
+ *	up, and drop drains which fall too far behind, rather than letting
+ *	their buffers truncate lines
+ */
+#define BEHAVIOUR_SOURCEPAUSE 1
+#define BEHAVIOUR_DRAINDROP   2
 	void setBehaviours(int behaviours);
 
+	void setDrain(Printer *drain);
+
 	void addDrain(Socket *drain);
 	void delDrain(Socket *drain);
+	void broadcast(const char *seg1, unsigned int len1, const char *seg2, unsigned int len2);
+
+	void addSource(Job *s);
+	void delSource(Job *s);
+	void forget(Socket *source);
+	void evict();
 
-	void addSource(Socket *s);
-	void delSource(Socket *s);
+	int enqueue(Socket *source, const char *line, int len);
+	void feed();
+	int idle();
+	const list<Job *> &jobs();
+
+	static void submit(Job *job);
+	static void dispatch();
+	static void withdraw(Socket *source);
+	// jobs waiting for a printer
+	static unsigned int waiting();
 private:
 	int behaviour;
-	list<Socket *> drains;
-	list<Socket *> sources;
+	Printer *printer;
+	struct Drain {
+		Socket *socket;
+		unsigned int skipped;
+	};
+	list<Drain> drains;
+	list<Job *> sources;
+	list<Job *>::iterator current;
+
+	Job *next(int priority);
+
+	static list<Job *> pending;
+	static void queue(Job *job);
 };
 
 #endif /* _QUEUEMANAGER_HPP */
@@ -0,0 +1,277 @@
+#include "reply.hpp"
+
+#include <cstring>
+
+/*
+ * Single pass scanner for Marlin, Repetier, Sprinter and Teacup replies, eg.
+ *
+ *	ok
+ *	ok T:201.3 /210.0 B:60.0 /60.0 T0:201.3 /210.0 T1:24.1 /0.0 @:0 B@:0
+ *	T:200.1 E:0 W:5
+ *	X:10.00 Y:20.00 Z:0.30 E:1.50 Count X: 800 Y:1600 Z:120
+ *	Resend: 42
+ *	rs 42
+ *	echo:busy: processing
+ *	Error:checksum mismatch, Last Line: 41
+ *	!! temperature sensor fault
+ *	wait
+ *	start
+ *	FIRMWARE_NAME:Marlin 1.1.9 PROTOCOL_VERSION:1.0 EXTRUDER_COUNT:1
+ *	Cap:ARCS:1
+ *
+ * Instead of matching each line against a series of patterns, we walk it
+ * once: look at the leading word to classify it, then pick up every
+ * KEY:value pair we understand. The line is read through a cursor which
+ * hops from the first segment to the second, so lines wrapped around the
+ * end of a Ringbuffer never have to be copied out.
+ */
+
+namespace {
+
+struct Cursor {
+	const char *p;
+	const char *end;
+	const char *next;
+	const char *nextend;
+};
+
+inline int more(Cursor *c) {
+	if (c->p < c->end)
+		return 1;
+	if (c->next) {
+		c->p = c->next;
+		c->end = c->nextend;
+		c->next = NULL;
+		return c->p < c->end;
+	}
+	return 0;
+}
+
+inline int peek(Cursor *c) {
+	if (more(c))
+		return (unsigned char) *c->p;
+	return -1;
+}
+
+inline void advance(Cursor *c) {
+	if (more(c))
+		c->p++;
+}
+
+inline void skipspace(Cursor *c) {
+	int ch;
+	while ((ch = peek(c)) == ' ' || ch == '\t')
+		advance(c);
+}
+
+inline void skipword(Cursor *c) {
+	int ch;
+	while ((ch = peek(c)) > ' ')
+		advance(c);
+}
+
+// case insensitive prefix match, only consumes the prefix if it matches
+int match(Cursor *c, const char *word) {
+	Cursor save = *c;
+	for (; *word; word++) {
+		int ch = peek(c);
+		if (ch >= 'A' && ch <= 'Z')
+			ch += 'a' - 'A';
+		if (ch != *word) {
+			*c = save;
+			return 0;
+		}
+		advance(c);
+	}
+	return 1;
+}
+
+int isalnum_ascii(int ch) {
+	return ((ch >= 'A') && (ch <= 'Z')) || ((ch >= 'a') && (ch <= 'z')) || ((ch >= '0') && (ch <= '9'));
+}
+
+int number(Cursor *c, float *value) {
+	int ch = peek(c);
+	int neg = 0;
+	int digits = 0;
+	double v = 0;
+
+	if (ch == '-' || ch == '+') {
+		neg = (ch == '-');
+		advance(c);
+		ch = peek(c);
+	}
+	while (ch >= '0' && ch <= '9') {
+		v = v * 10 + (ch - '0');
+		digits++;
+		advance(c);
+		ch = peek(c);
+	}
+	if (ch == '.') {
+		double scale = 0.1;
+		advance(c);
+		ch = peek(c);
+		while (ch >= '0' && ch <= '9') {
+			v += (ch - '0') * scale;
+			scale *= 0.1;
+			digits++;
+			advance(c);
+			ch = peek(c);
+		}
+	}
+	if (digits == 0)
+		return 0;
+	*value = neg ? -v : v;
+	return 1;
+}
+
+// key names are at most a few characters- T, T0, B, B@, X, Count ...
+#define KEY_MAX 8
+
+int readkey(Cursor *c, char *key) {
+	int l = 0;
+	int ch;
+	while (((ch = peek(c)) == '@' || isalnum_ascii(ch)) && l < KEY_MAX - 1) {
+		key[l++] = ch;
+		advance(c);
+	}
+	key[l] = 0;
+	if (l > 0 && peek(c) == ':') {
+		advance(c);
+		return l;
+	}
+	return 0;
+}
+
+}
+
+uint32_t Reply::parse(const char *line, unsigned int len, PrinterState *state) {
+	return parse(line, len, NULL, 0, state);
+}
+
+uint32_t Reply::parse(const char *seg1, unsigned int len1, const char *seg2, unsigned int len2, PrinterState *state) {
+	Cursor c = { seg1, seg1 + len1, seg2, seg2 ? seg2 + len2 : NULL };
+	uint32_t flags = 0;
+	int positions = 0;
+	int ch;
+
+	skipspace(&c);
+
+	// classify by leading word
+	if (match(&c, "ok")) {
+		ch = peek(&c);
+		if (ch <= ' ') {
+			flags |= REPLY_OK;
+			state->oks++;
+		}
+	}
+	else if (match(&c, "resend:") || match(&c, "rs ")) {
+		skipspace(&c);
+		if (peek(&c) == 'N' || peek(&c) == 'n')
+			advance(&c);
+		float n;
+		if (number(&c, &n)) {
+			state->resend = (long) n;
+			flags |= REPLY_RESEND;
+		}
+		return flags;
+	}
+	else if (match(&c, "error:") || match(&c, "!!")) {
+		state->errors++;
+		return flags | REPLY_ERROR;
+	}
+	else if (match(&c, "echo:")) {
+		flags |= REPLY_ECHO;
+		skipspace(&c);
+		if (match(&c, "busy:")) {
+			state->busy = 1;
+			flags |= REPLY_BUSY;
+		}
+		return flags;
+	}
+	else if (match(&c, "busy:")) {
+		state->busy = 1;
+		return flags | REPLY_BUSY;
+	}
+	else if (match(&c, "wait")) {
+		state->busy = 0;
+		return flags | REPLY_WAIT;
+	}
+	else if (match(&c, "start")) {
+		return flags | REPLY_START;
+	}
+	// M115 replies are rare and free-form, leave them to the caller
+	else if (match(&c, "firmware_name:")) {
+		return flags | REPLY_FIRMWARE;
+	}
+	else if (match(&c, "cap:")) {
+		return flags | REPLY_CAPABILITY;
+	}
+
+	// pick up KEY:value pairs from the rest of the line
+	char key[KEY_MAX];
+	float value;
+	for (;;) {
+		skipspace(&c);
+		ch = peek(&c);
+		if (ch < 0 || ch == '\r' || ch == '\n')
+			break;
+
+		if (readkey(&c, key) == 0) {
+			// Marlin follows M114 positions with step counts, not mm
+			if (strcmp(key, "Count") == 0)
+				break;
+			skipword(&c);
+			continue;
+		}
+		skipspace(&c);
+
+		if (key[0] == 'T' && (key[1] == 0 || (key[1] >= '0' && key[1] <= '9' && key[2] == 0))) {
+			if (!number(&c, &value))
+				continue;
+			int tool = state->tool;
+			if (key[1]) {
+				tool = key[1] - '0';
+				if (tool >= state->extruders && tool < PRINTER_MAX_EXTRUDERS)
+					state->extruders = tool + 1;
+			}
+			if (tool >= PRINTER_MAX_EXTRUDERS)
+				continue;
+			state->hotend[tool] = value;
+			skipspace(&c);
+			if (peek(&c) == '/') {
+				advance(&c);
+				skipspace(&c);
+				if (number(&c, &value))
+					state->hotend_target[tool] = value;
+			}
+			flags |= REPLY_TEMPERATURE;
+		}
+		else if (key[0] == 'B' && key[1] == 0) {
+			if (!number(&c, &value))
+				continue;
+			state->bed = value;
+			skipspace(&c);
+			if (peek(&c) == '/') {
+				advance(&c);
+				skipspace(&c);
+				if (number(&c, &value))
+					state->bed_target = value;
+			}
+			flags |= REPLY_TEMPERATURE;
+		}
+		else if (key[1] == 0 && (key[0] == 'X' || key[0] == 'Y' || key[0] == 'Z' || key[0] == 'E')) {
+			// E: is the extruder index in temperature wait lines, so axes
+			// only count as a position report once X: has been seen
+			if (key[0] == 'X')
+				positions = 1;
+			if (positions && number(&c, &value)) {
+				int axis = (key[0] == 'E') ? AXIS_E : (key[0] - 'X');
+				state->position[axis] = value;
+				flags |= REPLY_POSITION;
+			}
+		}
+	}
+
+	return flags;
+}
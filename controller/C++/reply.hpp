@@ -0,0 +1,31 @@
+#ifndef _REPLY_HPP
+#define _REPLY_HPP
+
+#include <cstdint>
+
+#include "printerstate.hpp"
+
+#define REPLY_OK          1
+#define REPLY_TEMPERATURE 2
+#define REPLY_POSITION    4
+#define REPLY_RESEND      8
+#define REPLY_ECHO        16
+#define REPLY_ERROR       32
+#define REPLY_BUSY        64
+#define REPLY_WAIT        128
+#define REPLY_START       256
+#define REPLY_FIRMWARE    512
+#define REPLY_CAPABILITY  1024
+
+class Reply {
+public:
+	/*
+	 * scan one firmware reply line in a single pass and update state.
+	 * the line may be split in two segments (eg. wrapped around a Ringbuffer)
+	 * so it can be parsed in place. returns a mask of REPLY_* flags
+	 */
+	static uint32_t parse(const char *seg1, unsigned int len1, const char *seg2, unsigned int len2, PrinterState *state);
+	static uint32_t parse(const char *line, unsigned int len, PrinterState *state);
+};
+
+#endif /* _REPLY_HPP */
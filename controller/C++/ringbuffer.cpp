@@ -10,22 +10,44 @@ namespace C {
 #include	<string.h>
 #include	<cstdio>
 
+#include	"pool.hpp"
+#include	"metrics.hpp"
+
+static int bufferbytes = Metrics::counter("netrap_ringbuffer_bytes_total", "Bytes through ring buffers not counted anywhere more specific");
+
+void *Ringbuffer::operator new(size_t size) {
+	return Pool<Ringbuffer>::get(size);
+}
+
+void Ringbuffer::operator delete(void *p, size_t size) {
+	Pool<Ringbuffer>::put(p, size);
+}
+
 Ringbuffer::Ringbuffer(unsigned int size) {
-	data   = (char *) malloc(size);
+	data   = (char *) BufferArena::get(size);
 	length = size;
 	head   = 0;
 	tail   = 0;
 	nl     = 0;
+	metric = bufferbytes;
 }
 
 Ringbuffer::~Ringbuffer() {
-	free(data);
+	BufferArena::put(data, length);
 }
 
 unsigned int Ringbuffer::numlines() {
 	return nl;
 }
 
+unsigned int Ringbuffer::size() {
+	return length;
+}
+
+void Ringbuffer::count(int metric) {
+	this->metric = metric;
+}
+
 unsigned int Ringbuffer::scannl() {
 	nl = 0;
 	if (canread()) {
@@ -56,7 +78,6 @@ unsigned int Ringbuffer::read(char *buf, unsigned int len) {
 		stage1 = len;
 	if (stage1 < len) {
 		stage2 = len - stage1;
-		stage1 = len;
 	}
 
 	memcpy(buf, &data[tail], stage1);
@@ -83,13 +104,14 @@ unsigned int Ringbuffer::readtofd(int fd, unsigned int len) {
 	if (stage1 > len)
 		stage1 = len;
 	
-	stage1 = C::write(fd, &data[tail], stage1);
+	ssize_t r = C::write(fd, &data[tail], stage1);
 
-	if (stage1 < 0)
+	if (r < 0)
 		return 0;
-	
+	stage1 = r;
+
 	tail += stage1;
-	if (stage1 >= length) stage1 -= length;
+	if (tail >= length) tail -= length;
 	
 	scannl();
 	
@@ -107,7 +129,7 @@ unsigned int Ringbuffer::readtofd(FILE * fd, unsigned int len) {
 	stage1 = fwrite(&data[tail], 1, stage1, fd);
 
 	tail += stage1;
-	if (stage1 >= length) stage1 -= length;
+	if (tail >= length) tail -= length;
 
 	scannl();
 
@@ -144,6 +166,56 @@ unsigned int Ringbuffer::readline(char *buf, unsigned int len) {
 	return r;
 }
 
+/*
+ * locate the next complete line in place without copying it out.
+ * a line may wrap around the end of the buffer, so it is returned as up to
+ * two contiguous segments. returns the line length including the newline,
+ * or 0 if no complete line is buffered. the line stays in the buffer until
+ * skip() is called
+ */
+unsigned int Ringbuffer::linespan(const char **seg1, unsigned int *len1, const char **seg2, unsigned int *len2) {
+	if (nl == 0)
+		return 0;
+
+	unsigned int avail = canread();
+	unsigned int stage1 = length - tail;
+	if (stage1 > avail)
+		stage1 = avail;
+
+	const char *p = (const char *) memchr(&data[tail], 10, stage1);
+	if (p) {
+		*seg1 = &data[tail];
+		*len1 = p - &data[tail] + 1;
+		*seg2 = NULL;
+		*len2 = 0;
+		return *len1;
+	}
+
+	p = (const char *) memchr(data, 10, avail - stage1);
+	if (p) {
+		*seg1 = &data[tail];
+		*len1 = stage1;
+		*seg2 = data;
+		*len2 = p - data + 1;
+		return *len1 + *len2;
+	}
+	return 0;
+}
+
+unsigned int Ringbuffer::skip(unsigned int len) {
+	if (len > canread())
+		len = canread();
+
+	// only the skipped span needs counting, not the whole buffer
+	for (unsigned int i = 0; i < len; i++) {
+		if (data[tail] == 10)
+			nl--;
+		tail = (tail + 1) % length;
+	}
+
+	return len;
+}
+
 unsigned int Ringbuffer::write(const char *buf, unsigned int len) {
 	if (len > canwrite())
 		len = canwrite();
@@ -170,6 +242,7 @@ unsigned int Ringbuffer::write(const char *buf, unsigned int len) {
 	}
 
 	scannl();
+	Metrics::add(metric, len);
 
 	return len;
 }
@@ -183,12 +256,18 @@ unsigned int Ringbuffer::writefromfd(int fd, unsigned int len) {
 	if (stage1 > len)
 		stage1 = len;
 	
-	stage1 = C::read(fd, &data[head], stage1);
-	
+	ssize_t r = C::read(fd, &data[head], stage1);
+
+	// let callers see the error, as read(2) would
+	if (r < 0)
+		return r;
+	stage1 = r;
+
 	head += stage1;
 	while (head >= length) head -= length;
 	
 	scannl();
+	Metrics::add(metric, stage1);
 	
 	return stage1;
 }
@@ -208,6 +287,7 @@ unsigned int Ringbuffer::writefromfd(FILE *fd, unsigned int len) {
 	while (head >= length) head -= length;
 
 	scannl();
+	Metrics::add(metric, stage1);
 
 	return stage1;
 }
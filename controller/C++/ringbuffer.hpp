@@ -9,7 +9,14 @@ public:
 	Ringbuffer(unsigned int length);
 	~Ringbuffer();
 
+	static void *operator new(size_t size);
+	static void operator delete(void *p, size_t size);
+
 	unsigned int numlines();
+	unsigned int size();
+	// count bytes written in against this metric, rather than the total
+	// for all buffers
+	void count(int metric);
 
 	unsigned int canread();
 	unsigned int canwrite();
@@ -21,6 +28,9 @@ public:
 	unsigned int peekline(char *buf, unsigned int len);
 	unsigned int readline(char *buf, unsigned int len);
 
+	unsigned int linespan(const char **seg1, unsigned int *len1, const char **seg2, unsigned int *len2);
+	unsigned int skip(unsigned int len);
+
 	unsigned int write(const char *buf, unsigned int len);
 	unsigned int writefromfd(int fd, unsigned int len);
 	unsigned int writefromfd(FILE *fd, unsigned int len);
@@ -31,6 +41,7 @@ private:
 	unsigned int tail;
 	char *data;
 	unsigned int nl;
+	int metric;
 };
 /*
 typedef struct {
@@ -5,16 +5,57 @@
 #include <cstdlib>
 #include <cstdio>
 
-std::list<struct SelectFd *> Selector::globalfdlist;
-std::list<struct SelectFd *>::iterator Selector::globalfditerator;
+#include "metrics.hpp"
+
+Selector::fdlist_t Selector::globalfdlist;
+Selector::iterator Selector::globalfditerator;
+Selector::receiverlist_t Selector::doomedlist;
+
+static int loopiterations = Metrics::counter("netrap_loop_iterations_total", "Event loop iterations");
+static int loopbusy = Metrics::histogram("netrap_loop_busy_seconds", "Time each event loop iteration spent handling events");
+static int callbacklatency = Metrics::histogram("netrap_callback_seconds", "Time taken by the callbacks for one ready fd");
+
+SelectorEventReceiver::SelectorEventReceiver() {
+	refs = 0;
+	doomed = 0;
+	queued = 0;
+}
 
-SelectorEventReceiver::SelectorEventReceiver() {}
 SelectorEventReceiver::~SelectorEventReceiver() {}
 
+void SelectorEventReceiver::ref() {
+	refs++;
+}
+
+void SelectorEventReceiver::unref() {
+	if ((--refs <= 0) && doomed && !queued) {
+		queued = 1;
+		Selector::doomedlist.push_back(this);
+	}
+}
+
+void SelectorEventReceiver::destroy() {
+	if (doomed)
+		return;
+	doomed = 1;
+	if ((refs <= 0) && !queued) {
+		queued = 1;
+		Selector::doomedlist.push_back(this);
+	}
+}
+
+int SelectorEventReceiver::destroyed() {
+	return doomed;
+}
+
 Selector::Selector() {
 }
 
+// whatever this selector was watching is for allwait() to reclaim
 Selector::~Selector() {
+	iterator i;
+	for (i = fdlist.begin(); i != fdlist.end(); ++i)
+		(*i)->poll = 0;
 }
 
 void Selector::wait() {
@@ -26,7 +67,7 @@ void Selector::wait() {
 
 	int fdmax = 0;
 	struct SelectFd *sel;
-// 	std::list<struct SelectFd *>::iterator i;
+// 	iterator i;
 	for (fditerator = fdlist.begin(); fditerator != fdlist.end(); ++fditerator) {
 		sel = *fditerator;
 		if (sel->poll & POLL_READ)
@@ -69,7 +110,7 @@ void Selector::poll() {
 	FD_ZERO(&testerror);
 	int fdmax = 0;
 	struct SelectFd *sel;
-// 	std::list<struct SelectFd *>::iterator i;
+// 	iterator i;
 	for (fditerator = fdlist.begin(); fditerator != fdlist.end(); ++fditerator) {
 		sel = *fditerator;
 		if (sel->poll & POLL_READ)
@@ -116,8 +157,14 @@ void Selector::poll() {
 // }
 
 struct SelectFd * Selector::add(int fd, SelectorEventReceiver *callbackObj) {
-	struct SelectFd *sel = new SelectFd;
+	// FD_SET past the end of an fd_set scribbles on the stack
+	if ((fd < 0) || (fd >= FD_SETSIZE)) {
+		fprintf(stderr, "Can't watch fd %d, select() stops at %d\n", fd, FD_SETSIZE);
+		return NULL;
+	}
+	struct SelectFd *sel = (struct SelectFd *) Pool<SelectFd>::get();
 	sel->fd = fd;
+	sel->data = NULL;
 	sel->callbackObj = callbackObj;
 	sel->poll = POLL_READ | POLL_ERROR;
 	fdlist.push_back(sel);
@@ -126,30 +173,24 @@ struct SelectFd * Selector::add(int fd, SelectorEventReceiver *callbackObj) {
 	return sel;
 }
 
+/*
+ * stop watching fd. the SelectFd stays on the global list with poll 0
+ * until allwait() reclaims it, as the loop may be walking that list now
+ */
 void Selector::remove(int fd) {
-	struct SelectFd *sel = NULL;
-	std::list<struct SelectFd *>::iterator i;
-
+	iterator i;
 	for (i = fdlist.begin(); i != fdlist.end(); ++i) {
-		sel = *i;
-		if (sel->fd == fd) {
-			sel->poll = 0;
-			break;
-		}
-	}
-
-	for (i = globalfdlist.begin(); i != globalfdlist.end(); ++i) {
-		sel = *i;
-		if (sel->fd == fd) {
-			sel->poll = 0;
-			break;
+		if ((*i)->fd == fd) {
+			(*i)->poll = 0;
+			fdlist.erase(i);
+			return;
 		}
 	}
 }
 
 struct SelectFd * Selector::operator[](int fd) {
 	struct SelectFd *sel = NULL;
-	std::list<struct SelectFd *>::iterator i;
+	iterator i;
 
 	for (i = fdlist.begin(); i != fdlist.end(); ++i) {
 		sel = *i;
@@ -172,7 +213,7 @@ void Selector::allwait() {
 		sel = *globalfditerator;
 		if (sel->poll == 0) {
 			globalfditerator = globalfdlist.erase(globalfditerator);
-			free(sel);
+			Pool<SelectFd>::put(sel);
 		}
 		else {
 			if (sel->poll & POLL_READ)
@@ -188,9 +229,14 @@ void Selector::allwait() {
 	}
 	if (fdmax == 0)
 		*((int *) -1) = 12345; // segfault to trigger debugger
-	if (select(fdmax, &testread, &testwrite, &testerror, NULL)) {
+	int ready = select(fdmax, &testread, &testwrite, &testerror, NULL);
+	uint64_t start = Metrics::now();
+	if (ready > 0) {
 		for (globalfditerator = globalfdlist.begin(); globalfditerator != globalfdlist.end(); ++globalfditerator) {
 			sel = *globalfditerator;
+			if ((sel->poll == 0) || !(FD_ISSET(sel->fd, &testread) || FD_ISSET(sel->fd, &testwrite) || FD_ISSET(sel->fd, &testerror)))
+				continue;
+			uint64_t t = Metrics::now();
 			if ((sel->poll != 0) && (FD_ISSET(sel->fd, &testread))) {
 // 				sel->onread(sel->callbackObj, sel);
 				sel->callbackObj->onread(sel);
@@ -203,8 +249,12 @@ void Selector::allwait() {
 // 				sel->onerror(sel->callbackObj, sel);
 				sel->callbackObj->onerror(sel);
 			}
+			Metrics::observe(callbacklatency, Metrics::now() - t);
 		}
 	}
+	reap();
+	Metrics::add(loopiterations);
+	Metrics::observe(loopbusy, Metrics::now() - start);
 }
 
 void Selector::allpoll() {
@@ -215,9 +265,14 @@ void Selector::allpoll() {
 	FD_ZERO(&testerror);
 	int fdmax = 0;
 	struct SelectFd *sel;
-	std::list<struct SelectFd *>::iterator i;
-	for (i=globalfdlist.begin(); i != globalfdlist.end(); ++i) {
+	iterator i;
+	for (i=globalfdlist.begin(); i != globalfdlist.end(); ) {
 		sel = *i;
+		if (sel->poll == 0) {
+			i = globalfdlist.erase(i);
+			Pool<SelectFd>::put(sel);
+			continue;
+		}
 		if (sel->poll & POLL_READ)
 			FD_SET(sel->fd, &testread);
 		if (sel->poll & POLL_WRITE)
@@ -226,22 +281,59 @@ void Selector::allpoll() {
 			FD_SET(sel->fd, &testerror);
 		if (sel->fd >= fdmax)
 			fdmax = sel->fd + 1;
+		++i;
 	}
-	if (select(fdmax, &testread, &testwrite, &testerror, &timeout)) {
+	int ready = select(fdmax, &testread, &testwrite, &testerror, &timeout);
+	uint64_t start = Metrics::now();
+	if (ready > 0) {
 		for (i=globalfdlist.begin(); i != globalfdlist.end(); ++i) {
 			sel = *i;
-			if (FD_ISSET(sel->fd, &testread)) {
+			if ((sel->poll == 0) || !(FD_ISSET(sel->fd, &testread) || FD_ISSET(sel->fd, &testwrite) || FD_ISSET(sel->fd, &testerror)))
+				continue;
+			uint64_t t = Metrics::now();
+			if ((sel->poll != 0) && FD_ISSET(sel->fd, &testread)) {
 // 				sel->onread(sel->callbackObj, sel);
 				sel->callbackObj->onread(sel);
 			}
-			if (FD_ISSET(sel->fd, &testwrite)) {
+			if ((sel->poll != 0) && FD_ISSET(sel->fd, &testwrite)) {
 // 				sel->onwrite(sel->callbackObj, sel);
 				sel->callbackObj->onwrite(sel);
 			}
-			if (FD_ISSET(sel->fd, &testerror)) {
+			if ((sel->poll != 0) && FD_ISSET(sel->fd, &testerror)) {
 // 				sel->onerror(sel->callbackObj, sel);
 				sel->callbackObj->onerror(sel);
 			}
+			Metrics::observe(callbacklatency, Metrics::now() - t);
+		}
+	}
+	reap();
+	Metrics::add(loopiterations);
+	Metrics::observe(loopbusy, Metrics::now() - start);
+}
+
+/*
+ * nothing is mid-callback now, so whatever was destroyed or closed during
+ * the iteration can go. deleting a receiver may destroy others, eg. by
+ * dropping the last ref on a job's source, so keep at it until it's quiet
+ */
+void Selector::reap() {
+	while (!doomedlist.empty()) {
+		SelectorEventReceiver *r = doomedlist.front();
+		doomedlist.pop_front();
+		r->queued = 0;
+		// someone took a ref since, unref() brings it back
+		if (r->refs <= 0)
+			delete r;
+	}
+	iterator i;
+	for (i = globalfdlist.begin(); i != globalfdlist.end(); ) {
+		struct SelectFd *sel = *i;
+		if (sel->poll == 0) {
+			i = globalfdlist.erase(i);
+			Pool<SelectFd>::put(sel);
+		}
+		else {
+			++i;
 		}
 	}
 }
@@ -3,6 +3,8 @@
 
 #include <list>
 
+#include "pool.hpp"
+
 struct SelectFd;
 
 // typedef void (*FdCallback)(void *obj, struct SelectFd *selector);
@@ -24,14 +26,30 @@ struct SelectFd {
 	int poll;
 };
 
+/*
+ * Receivers which own themselves, like client connections, destroy()
+ * themselves rather than delete. They're deleted once the event loop has
+ * finished the current iteration and nothing holds a ref() on them, so
+ * it's safe to destroy() from inside a callback, or while a job still
+ * points at the receiver.
+ */
 class SelectorEventReceiver {
 public:
 	SelectorEventReceiver();
-	~SelectorEventReceiver();
+	virtual ~SelectorEventReceiver();
+
+	void ref();
+	void unref();
+	void destroy();
+	int destroyed();
 protected:
 	virtual void onread(SelectFd *) = 0;
 	virtual void onwrite(SelectFd *) = 0;
 	virtual void onerror(SelectFd *) = 0;
+private:
+	int refs;
+	int doomed;
+	int queued;
 
 	friend class Selector;
 };
@@ -52,8 +70,11 @@ public:
 
 	static void allwait();
 	static void allpoll();
+	// end of an iteration- free destroyed receivers and unwatched fds
+	static void reap();
 
-	typedef std::list<struct SelectFd *>::iterator iterator;
+	typedef std::list<struct SelectFd *, PoolAllocator<struct SelectFd *> > fdlist_t;
+	typedef fdlist_t::iterator iterator;
 
 	iterator begin();
 	iterator end();
@@ -62,11 +83,15 @@ public:
 	static int canwrite(int fd);
 	static int canerror(int fd);
 protected:
-	std::list<struct SelectFd *> fdlist;
-	std::list<struct SelectFd *>::iterator fditerator;
-	static std::list<struct SelectFd *> globalfdlist;
-	static std::list<struct SelectFd *>::iterator globalfditerator;
+	fdlist_t fdlist;
+	iterator fditerator;
+	static fdlist_t globalfdlist;
+	static iterator globalfditerator;
 private:
+	typedef std::list<SelectorEventReceiver *, PoolAllocator<SelectorEventReceiver *> > receiverlist_t;
+	static receiverlist_t doomedlist;
+
+	friend class SelectorEventReceiver;
 };
 
 #endif /* _SELECTOR_HPP */
@@ -0,0 +1,187 @@
+#include "socket-file.hpp"
+
+#include "printer.hpp"
+#include "workerpool.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+namespace C {
+	#include <unistd.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	extern "C" int printf(const char *format, ...);
+}
+
+// one chunk, read on a worker thread
+class FileRead : public Task {
+public:
+	FileSocket *file;
+	int fd;
+	int closefd;
+	off_t offset;
+	size_t length;
+	off_t advise;
+	char buf[FILESOCKET_CHUNK];
+	ssize_t got;
+	int error;
+
+	void run() {
+		if (advise >= 0)
+			C::posix_fadvise(fd, advise, FILESOCKET_READAHEAD, POSIX_FADV_WILLNEED);
+		do {
+			got = C::pread(fd, buf, length, offset);
+		} while ((got < 0) && (errno == EINTR));
+		error = (got < 0) ? errno : 0;
+	}
+
+	void done() {
+		// the FileSocket went away while we were reading
+		if (file == NULL) {
+			if (closefd)
+				C::close(fd);
+		}
+		else {
+			file->received(this);
+		}
+		delete this;
+	}
+};
+
+FileSocket::FileSocket() {
+	delete rxbuf;
+	rxbuf = new Ringbuffer(FILESOCKET_BUFFER);
+	job = NULL;
+	size = offset = advised = 0;
+	ended = 0;
+	reading = NULL;
+}
+
+FileSocket::~FileSocket() {
+	// the read in flight still needs the descriptor, so it closes it
+	if (reading) {
+		reading->file = NULL;
+		if (_fd >= 0) {
+			selector.remove(_fd);
+			reading->closefd = 1;
+			_fd = -1;
+		}
+	}
+	if (job) {
+		// job is being deleted and deleting us, or never got going
+		Job *j = job;
+		job = NULL;
+		if (j->source == this)
+			j->source = NULL;
+	}
+}
+
+int FileSocket::open(const char *path, int priority) {
+	int fd = C::open(path, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+	if (fd == -1) {
+		perror(path);
+		return -1;
+	}
+	struct C::stat st;
+	if (C::fstat(fd, &st) == 0)
+		size = st.st_size;
+	C::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	Socket::open(fd);
+	snprintf(description, sizeof(description), "file:%s", path);
+	job = new SourceJob(this, priority);
+	return fd;
+}
+
+// start the next read, unless one's running or there's nowhere to put it
+void FileSocket::fetch() {
+	// never fill rxbuf right up, or unstall() wouldn't wake us
+	if (reading || ended || (_fd < 0) || (rxbuf->canwrite() <= FILESOCKET_CHUNK))
+		return;
+	FileRead *r = new FileRead();
+	r->file = this;
+	r->fd = _fd;
+	r->closefd = 0;
+	r->offset = offset;
+	r->length = FILESOCKET_CHUNK;
+	r->advise = -1;
+	// keep the kernel a good way ahead, half a window at a time
+	if (advised < offset + FILESOCKET_READAHEAD / 2) {
+		if (advised < offset)
+			advised = offset;
+		r->advise = advised;
+		advised += FILESOCKET_READAHEAD;
+	}
+	reading = r;
+	WorkerPool::shared()->submit(r);
+}
+
+void FileSocket::received(FileRead *r) {
+	reading = NULL;
+	if (r->got > 0) {
+		rxbuf->write(r->buf, r->got);
+		offset += r->got;
+	}
+	else {
+		if (r->got < 0)
+			C::printf("Error reading %s: %s\n", toString(), strerror(r->error));
+		ended = 1;
+	}
+	// pump() may finish the job, and us with it
+	fetch();
+	pump();
+}
+
+/*
+ * queue buffered lines in the job until it stalls us. once the file has
+ * ended and every line is queued, so is the job
+ */
+void FileSocket::pump() {
+	if (job == NULL)
+		return;
+
+	int queued = job->writelines(rxbuf);
+	// no newline in a whole buffer, this isn't gcode
+	if (!stalled && (rxbuf->numlines() == 0) && (rxbuf->canwrite() <= FILESOCKET_CHUNK))
+		rxbuf->skip(rxbuf->canread());
+
+	if (ended && !stalled && !reading) {
+		// the last line may lack its newline. give it one, so it's
+		// queued whole like the rest, or waits for room like the rest
+		if ((rxbuf->canread() > 0) && (rxbuf->numlines() == 0) && (rxbuf->canwrite() > 0)) {
+			rxbuf->write("\n", 1);
+			queued += job->writelines(rxbuf);
+		}
+		if (!stalled) {
+			rxbuf->skip(rxbuf->canread());
+			if (_fd >= 0) {
+				C::printf("Finished reading %s, %llu bytes\n", toString(), (unsigned long long) offset);
+				close();
+				job->finish();
+				queued++;
+			}
+		}
+	}
+
+	if (queued && job->printer)
+		job->printer->feed();
+}
+
+void FileSocket::onread(struct SelectFd *selected) {
+	// nothing to read here directly- this only means the job has room again
+	selected->poll &= ~POLL_READ;
+	// pump() may finish the job, and us with it
+	fetch();
+	pump();
+}
+
+// nobody reads the replies, they only need to go
+void FileSocket::onwrite(struct SelectFd *selected) {
+	txbuf->skip(txbuf->canread());
+	selected->poll &= ~POLL_WRITE;
+}
+
+void FileSocket::onerror(struct SelectFd *selected) {
+	selected->poll &= ~POLL_ERROR;
+}
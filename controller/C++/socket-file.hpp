@@ -0,0 +1,59 @@
+#ifndef _SOCKET_FILE_HPP
+#define _SOCKET_FILE_HPP
+
+#include <sys/types.h>
+
+#include "socket.hpp"
+#include "job.hpp"
+
+// lines read from the file but not yet queued in the job
+#define FILESOCKET_BUFFER    65536
+// most read in one go
+#define FILESOCKET_CHUNK     16384
+// how far ahead of the reads the kernel is asked to fetch
+#define FILESOCKET_READAHEAD (4 << 20)
+
+class FileRead;
+
+/*
+ * A gcode file streamed into a job, for printing straight off a local
+ * disk, SD card or network share.
+ *
+ * Reads never happen on the event loop- each chunk is a pread on the
+ * WorkerPool, with posix_fadvise asking the kernel to fetch well ahead of
+ * it, so a slow device holds up only its own job. The file descriptor is
+ * in the selector like any socket, but POLL_READ just means the job wants
+ * more lines: onread() queues what's buffered and starts the next read.
+ *
+ * The job owns the FileSocket, and deletes it when the print is done.
+ * Printer replies to the job's lines are thrown away.
+ */
+class FileSocket : public Socket {
+public:
+	FileSocket();
+	~FileSocket();
+
+	int open(const char *path, int priority = JOB_PRIORITY_NORMAL);
+
+	Job *job;
+protected:
+	off_t size;
+	off_t offset;
+	off_t advised;
+	int ended;
+
+	// the read in flight, if any
+	FileRead *reading;
+
+	void fetch();
+	void pump();
+	void received(FileRead *r);
+
+	void onread(struct SelectFd *selected);
+	void onwrite(struct SelectFd *selected);
+	void onerror(struct SelectFd *selected);
+
+	friend class FileRead;
+};
+
+#endif /* _SOCKET_FILE_HPP */
@@ -0,0 +1,198 @@
+#include "socket-pipe.hpp"
+
+#include "printer.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+namespace C {
+	#include <unistd.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	extern "C" int printf(const char *format, ...);
+}
+
+PipeSocket::PipeSocket() {
+	delete rxbuf;
+	rxbuf = new Ringbuffer(PIPESOCKET_BUFFER);
+	job = NULL;
+	spool = -1;
+	spoolpipe[0] = spoolpipe[1] = -1;
+	holder = -1;
+	ended = 0;
+}
+
+PipeSocket::~PipeSocket() {
+	if (spool >= 0)
+		C::close(spool);
+	if (spoolpipe[0] >= 0) {
+		C::close(spoolpipe[0]);
+		C::close(spoolpipe[1]);
+	}
+	if (holder >= 0)
+		C::close(holder);
+	if (job && (job->source == this))
+		job->source = NULL;
+}
+
+int PipeSocket::open(const char *path, const char *spool, int priority) {
+	int fd = C::open(path, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+	if (fd == -1) {
+		perror(path);
+		return -1;
+	}
+	struct C::stat st;
+	if ((C::fstat(fd, &st) == 0) && S_ISFIFO(st.st_mode))
+		holder = C::open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	if (open(fd, spool, priority) < 0)
+		return -1;
+	snprintf(description, sizeof(description), "pipe:%s", path);
+	return fd;
+}
+
+int PipeSocket::open(int fd, const char *spool, int priority) {
+	if (spool) {
+		this->spool = C::open(spool, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (this->spool == -1) {
+			perror(spool);
+			C::close(fd);
+			return -1;
+		}
+		if (C::pipe2(spoolpipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+			spoolpipe[0] = spoolpipe[1] = -1;
+		}
+	}
+	C::fcntl(fd, F_SETFL, C::fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	Socket::open(fd);
+	job = new SourceJob(this, priority);
+	return fd;
+}
+
+/*
+ * copy the next len bytes waiting in the pipe to the spool without
+ * reading them. returns what tee() did- the bytes copied, 0 at the end,
+ * or -1. EINVAL means the source isn't a pipe, and tee() is given up
+ */
+ssize_t PipeSocket::tospool(unsigned int len) {
+	ssize_t t = C::tee(_fd, spoolpipe[1], len, SPLICE_F_NONBLOCK);
+	if ((t < 0) && (errno == EINVAL)) {
+		C::close(spoolpipe[0]);
+		C::close(spoolpipe[1]);
+		spoolpipe[0] = spoolpipe[1] = -1;
+	}
+	for (ssize_t left = t; left > 0; ) {
+		ssize_t s = C::splice(spoolpipe[0], NULL, spool, NULL, left, SPLICE_F_MOVE);
+		if (s <= 0) {
+			perror("splice");
+			// the spool is incomplete, so stop writing it at all
+			C::close(spool);
+			spool = -1;
+			break;
+		}
+		left -= s;
+	}
+	return t;
+}
+
+void PipeSocket::onread(struct SelectFd *selected) {
+	ssize_t room = rxbuf->canwrite();
+	if (ended || (room == 0)) {
+		selected->poll &= ~POLL_READ;
+		pump();
+		return;
+	}
+
+	// after a tee we read exactly what went to the spool, to stay in step
+	if ((spool >= 0) && (spoolpipe[0] >= 0)) {
+		ssize_t t = tospool(room);
+		if ((t < 0) && (errno == EAGAIN))
+			return;
+		if (t >= 0)
+			room = t;
+	}
+
+	ssize_t got = 0;
+	if (room > 0) {
+		if ((spool >= 0) && (spoolpipe[0] < 0)) {
+			// no tee, so the spool is written from here
+			char buf[4096];
+			got = C::read(_fd, buf, (room < (ssize_t) sizeof(buf)) ? room : sizeof(buf));
+			if (got > 0) {
+				rxbuf->write(buf, got);
+				if (C::write(spool, buf, got) != got) {
+					perror("spool");
+					C::close(spool);
+					spool = -1;
+				}
+			}
+		}
+		else {
+			int r = 0;
+			while ((got < room) && ((r = (int) rxbuf->writefromfd(_fd, room - got)) > 0))
+				got += r;
+			if (got == 0)
+				got = r;
+		}
+		if ((got < 0) && (errno == EAGAIN))
+			return;
+		if (got < 0)
+			perror("read");
+	}
+
+	if ((got > 0) && (holder >= 0)) {
+		// the slicer has it open now, so its close will be our end
+		C::close(holder);
+		holder = -1;
+	}
+	if ((got <= 0) && (holder < 0)) {
+		C::printf("Pipe %s ended\n", toString());
+		ended = 1;
+	}
+	pump();
+}
+
+// queue buffered lines in the job, and end it once the pipe is drained
+void PipeSocket::pump() {
+	if (job == NULL)
+		return;
+
+	int queued = job->writelines(rxbuf);
+	// no newline in a whole buffer, this isn't gcode
+	if (!stalled && (rxbuf->numlines() == 0) && (rxbuf->canwrite() == 0))
+		rxbuf->skip(rxbuf->canread());
+
+	if (ended && !stalled) {
+		// the last line may lack its newline. give it one, so it's
+		// queued whole like the rest, or waits for room like the rest
+		if ((rxbuf->canread() > 0) && (rxbuf->numlines() == 0) && (rxbuf->canwrite() > 0)) {
+			rxbuf->write("\n", 1);
+			queued += job->writelines(rxbuf);
+		}
+		if (!stalled) {
+			rxbuf->skip(rxbuf->canread());
+			if (_fd >= 0) {
+				close();
+				job->finish();
+				queued++;
+			}
+		}
+	}
+
+	if ((_fd >= 0) && !stalled && (rxbuf->canwrite() > 0))
+		selector[_fd]->poll |= POLL_READ;
+
+	if (queued && job->printer)
+		job->printer->feed();
+}
+
+// nobody reads the replies, they only need to go
+void PipeSocket::onwrite(struct SelectFd *selected) {
+	txbuf->skip(txbuf->canread());
+	selected->poll &= ~POLL_WRITE;
+}
+
+void PipeSocket::onerror(struct SelectFd *selected) {
+	selected->poll &= ~POLL_ERROR;
+}
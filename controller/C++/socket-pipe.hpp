@@ -0,0 +1,48 @@
+#ifndef _SOCKET_PIPE_HPP
+#define _SOCKET_PIPE_HPP
+
+#include "socket.hpp"
+#include "job.hpp"
+
+// lines read from the pipe but not yet queued in the job. no bigger than
+// a pipe holds, so a tee always fits the spool pipe
+#define PIPESOCKET_BUFFER 65536
+
+/*
+ * A print streamed in through a pipe or FIFO, eg. straight out of a
+ * slicer, optionally spooled to a file on the way.
+ *
+ * The spool copy never comes up to user space: each read is first tee()d
+ * into a private pipe and spliced from there into the spool file, then
+ * the same bytes are read for the job. When the source isn't a pipe,
+ * tee() can't be used and the spool is written from rxbuf instead.
+ *
+ * The job owns the PipeSocket. Reads stop whenever the job stalls us, so
+ * the slicer is held up rather than the controller buffering its output.
+ */
+class PipeSocket : public Socket {
+public:
+	PipeSocket();
+	~PipeSocket();
+
+	int open(const char *path, const char *spool = NULL, int priority = JOB_PRIORITY_NORMAL);
+	int open(int fd, const char *spool = NULL, int priority = JOB_PRIORITY_NORMAL);
+
+	Job *job;
+protected:
+	int spool;
+	int spoolpipe[2];
+	// a FIFO reads as ended until its writer opens it, so we hold it open
+	// ourselves until the first data arrives
+	int holder;
+	int ended;
+
+	ssize_t tospool(unsigned int len);
+	void pump();
+
+	void onread(struct SelectFd *selected);
+	void onwrite(struct SelectFd *selected);
+	void onerror(struct SelectFd *selected);
+};
+
+#endif /* _SOCKET_PIPE_HPP */
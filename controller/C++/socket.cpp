@@ -8,28 +8,35 @@ namespace C {
 	extern "C" ssize_t read(int fd, void *buf, size_t count);
 	extern "C" ssize_t write(int fd, const void *buf, size_t count);
 	extern "C" int close(int fd);
+	extern "C" int printf(const char *format, ...);
 }
 
 #include <cstring>
+#include <cerrno>
 #include <cstdarg>
 
 Socket::Socket() {
 	txbuf = new Ringbuffer(1024);
 	rxbuf = new Ringbuffer(128);
 	_fd = -1;
+	stalled = 0;
 	memcpy(&description, "closed", 7);
 // 	printf("socket %p: txbuf is at %p and rxbuf is at %p\n", this, txbuf, rxbuf);
 }
 
-Socket::Socket(int fd) {
-	Socket();
+Socket::Socket(int fd) : Socket() {
 	open(fd);
 }
 
 Socket::~Socket() {
-	printf("Socket %s destroyed\n", description);
-	if (_fd != -1)
+	// not our own printf, that would write to the socket
+	C::printf("Socket %s destroyed\n", description);
+	if (_fd != -1) {
 		C::close(_fd);
+		selector.remove(_fd);
+	}
+	delete txbuf;
+	delete rxbuf;
 }
 
 int Socket::open(int fd) {
@@ -68,14 +75,19 @@ int Socket::fd() {
 	return _fd;
 }
 
+// stop reading from this socket until unstall(), so its peer backs off
 void Socket::stall(void) {
 	stalled = 1;
-	selector.remove(_fd);
+	struct SelectFd *sel = selector[_fd];
+	if (sel)
+		sel->poll &= ~POLL_READ;
 }
 
 void Socket::unstall(void) {
 	stalled = 0;
-	selector.add(_fd, this);
+	struct SelectFd *sel = selector[_fd];
+	if (sel && (rxbuf->canwrite() > 0))
+		sel->poll |= POLL_READ;
 }
 
 int Socket::is_stalled(void) {
@@ -97,7 +109,7 @@ void Socket::onread(struct SelectFd *selected) {
 		close();
 		selected->poll = 0;
 	}
-	else {
+	else if (errno != EAGAIN) {
 		perror("read");
 	}
 }
@@ -125,25 +137,36 @@ int Socket::write(std::string str) {
 	return write(str.c_str(), str.length());
 }
 
+int Socket::write(const char *str) {
+	return write(str, strlen(str));
+}
+
 int Socket::write(const char *str, int len) {
 	int r = txbuf->write(str, len);
-	selector[_fd]->poll |= POLL_WRITE;
+	struct SelectFd *sel = selector[_fd];
+	if (sel)
+		sel->poll |= POLL_WRITE;
 	return r;
 }
 
+// most lines fit on the stack, only long ones go to the heap
 int Socket::printf(const char *format, ...) {
-	int r = 256, s = 0;
-	char *buf = NULL;
+	char stackbuf[SOCKET_PRINTF_STACK];
+	char *buf = stackbuf;
 	va_list ap;
-	do {
-		if (buf) free(buf);
-		if (r >= s) s = r + 1;
-		buf = (char *) malloc(s);
+	va_start(ap, format);
+	int r = vsnprintf(buf, sizeof(stackbuf), format, ap);
+	va_end(ap);
+	if (r < 0)
+		return r;
+	if (r >= (int) sizeof(stackbuf)) {
+		buf = (char *) malloc(r + 1);
 		va_start(ap, format);
-		r = vsnprintf(buf, s, format, ap);
+		vsnprintf(buf, r + 1, format, ap);
 		va_end(ap);
-	} while (r >= s);
+	}
 	write(buf, r);
-	free(buf);
+	if (buf != stackbuf)
+		free(buf);
 	return r;
 }
@@ -8,6 +8,9 @@
 #include "ringbuffer.hpp"
 #include "selector.hpp"
 
+// printf() formats into this much stack before it resorts to the heap
+#define SOCKET_PRINTF_STACK 512
+
 class Socket : public SelectorEventReceiver {
 public:
 	Socket();
@@ -15,19 +18,20 @@ public:
 	~Socket();
 	int open(int fd);
 	int opened();
-	void close();
+	virtual void close();
 
 	int canread();
 	int canwrite();
 
 	int write(std::string str);
+	int write(const char *str);
 	int write(const char *str, int len);
 	int printf(const char *format, ...);
 
 	int read(char *buf, int buflen);
 
 	void stall(void);
-	void unstall(void);
+	virtual void unstall(void);
 	int is_stalled(void);
 
 	int fd();
@@ -0,0 +1,250 @@
+#include "trace.hpp"
+
+#include <cstring>
+
+#include "arena.hpp"
+#include "metrics.hpp"
+
+namespace {
+	// where the time went for a run of lines
+	struct Summary {
+		HistogramData wait;
+		HistogramData link;
+		HistogramData total;
+		uint64_t lines;
+		uint64_t lost;
+
+		Summary() {
+			wait.clear();
+			link.clear();
+			total.clear();
+			lines = 0;
+			lost = 0;
+		}
+
+		void add(const LineTrace *t) {
+			if (t->flags & TRACE_LOST) {
+				lost++;
+				return;
+			}
+			lines++;
+			wait.record(t->written - t->queued);
+			link.record(t->ok - t->written);
+			total.record(t->ok - t->queued);
+		}
+	};
+
+	void percentiles(ArenaText *out, const char *what, HistogramData *h) {
+		out->printf("%s: p50 %.3fms, p90 %.3fms, p99 %.3fms, p99.9 %.3fms, max %.3fms\n", what,
+			h->quantile(0.5) / 1e6, h->quantile(0.9) / 1e6, h->quantile(0.99) / 1e6,
+			h->quantile(0.999) / 1e6, h->max.load() / 1e6);
+	}
+
+	void summarise(ArenaText *out, Summary *s) {
+		out->printf("%llu lines acknowledged, %llu lost\n", (unsigned long long) s->lines, (unsigned long long) s->lost);
+		if (s->lines == 0)
+			return;
+		percentiles(out, "queued to written", &s->wait);
+		percentiles(out, "written to ok", &s->link);
+		percentiles(out, "queued to ok", &s->total);
+	}
+
+	void stalled(ArenaText *out, const LineTrace *t, uint64_t start) {
+		out->printf("line %llu at %.3fs: %.3fs to ok, %.3fs of it to write: %s\n", (unsigned long long) t->seq,
+			(t->queued - start) / 1e9, (t->ok - t->queued) / 1e9, (t->written - t->queued) / 1e9, t->text);
+	}
+}
+
+LineTracer::LineTracer() {
+	head = 0;
+	unwritten = 0;
+	tail = 0;
+	txqueued = 0;
+	txflushed = 0;
+	nstalls = 0;
+	stall = (uint64_t) TRACE_STALL_MS * 1000000;
+	lost = 0;
+	started = Metrics::now();
+	file = NULL;
+}
+
+LineTracer::~LineTracer() {
+	record(NULL);
+}
+
+// a line has gone into txbuf. the caller makes sure we're not full()
+void LineTracer::sent(Socket *respondent, uint64_t queued, const char *line, int len) {
+	Entry *e = &ring[head % TRACE_RING];
+	memset(&e->t, 0, sizeof(e->t));
+	e->t.seq = head;
+	e->t.queued = queued;
+	e->t.length = len;
+	int l = len;
+	while ((l > 0) && ((line[l - 1] == '\n') || (line[l - 1] == '\r')))
+		l--;
+	if (l > (int) sizeof(e->t.text) - 1)
+		l = sizeof(e->t.text) - 1;
+	memcpy(e->t.text, line, l);
+	e->respondent = respondent;
+	txqueued += len;
+	e->end = txqueued;
+	head++;
+}
+
+void LineTracer::flushed(unsigned int bytes, uint64_t now) {
+	txflushed += bytes;
+	while ((unwritten < head) && (ring[unwritten % TRACE_RING].end <= txflushed)) {
+		ring[unwritten % TRACE_RING].t.written = now;
+		unwritten++;
+	}
+}
+
+// the oldest line in flight has its ok. NULL if nothing was in flight
+const LineTrace *LineTracer::acked(uint64_t now) {
+	if (tail == head)
+		return NULL;
+	Entry *e = &ring[tail % TRACE_RING];
+	if (unwritten == tail) {
+		// the ok beat us to noticing the write
+		e->t.written = now;
+		unwritten++;
+	}
+	e->t.ok = now;
+	tail++;
+	if (now - e->t.queued > stall) {
+		e->t.flags |= TRACE_STALL;
+		stalls[nstalls++ % TRACE_STALLS] = e->t;
+	}
+	save(&e->t);
+	return &e->t;
+}
+
+// nothing in flight will be acknowledged now
+void LineTracer::clear() {
+	for (; tail < head; tail++) {
+		Entry *e = &ring[tail % TRACE_RING];
+		e->t.flags |= TRACE_LOST;
+		lost++;
+		save(&e->t);
+	}
+	unwritten = head;
+	if (file)
+		fflush(file);
+}
+
+void LineTracer::forget(Socket *respondent) {
+	for (uint64_t i = tail; i < head; i++) {
+		if (ring[i % TRACE_RING].respondent == respondent)
+			ring[i % TRACE_RING].respondent = NULL;
+	}
+}
+
+Socket *LineTracer::front() {
+	if (tail == head)
+		return NULL;
+	return ring[tail % TRACE_RING].respondent;
+}
+
+unsigned int LineTracer::inflight() {
+	return head - tail;
+}
+
+int LineTracer::full() {
+	return (head - tail) >= TRACE_RING;
+}
+
+void LineTracer::setstall(unsigned int ms) {
+	stall = (uint64_t) ms * 1000000;
+}
+
+// write every line from now on to path, or stop if it's NULL, "" or "off"
+int LineTracer::record(const char *path) {
+	if (file) {
+		fclose(file);
+		file = NULL;
+	}
+	if ((path == NULL) || (*path == 0) || (strcmp(path, "off") == 0))
+		return 0;
+
+	file = fopen(path, "wb");
+	if (file == NULL) {
+		perror(path);
+		return -1;
+	}
+	TraceHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+	h.version = TRACE_VERSION;
+	h.size = sizeof(LineTrace);
+	h.start = started;
+	if (fwrite(&h, sizeof(h), 1, file) != 1) {
+		perror(path);
+		fclose(file);
+		file = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void LineTracer::save(const LineTrace *t) {
+	if ((file != NULL) && (fwrite(t, sizeof(*t), 1, file) != 1)) {
+		perror("trace");
+		fclose(file);
+		file = NULL;
+	}
+}
+
+// percentiles over the lines still in the ring, then the latest stalls
+void LineTracer::report(ArenaText *out) {
+	Summary *s = new Summary;
+	uint64_t from = (head > TRACE_RING) ? head - TRACE_RING : 0;
+	for (uint64_t i = from; i < tail; i++)
+		s->add(&ring[i % TRACE_RING].t);
+	out->printf("%llu lines sent, %u in flight, %llu lost\n", (unsigned long long) head, inflight(), (unsigned long long) lost);
+	out->printf("last %llu: ", (unsigned long long) (tail - from));
+	summarise(out, s);
+	delete s;
+
+	out->printf("%llu stalls over %llums\n", (unsigned long long) nstalls, (unsigned long long) (stall / 1000000));
+	uint64_t first = (nstalls > TRACE_STALLS) ? nstalls - TRACE_STALLS : 0;
+	for (uint64_t i = first; i < nstalls; i++)
+		stalled(out, &stalls[i % TRACE_STALLS], started);
+}
+
+// the same from a trace file, with every stall over stallms
+int LineTracer::replay(const char *path, unsigned int stallms, ArenaText *out) {
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	TraceHeader h;
+	if ((fread(&h, sizeof(h), 1, f) != 1) || (memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) != 0)
+		|| (h.version != TRACE_VERSION) || (h.size != sizeof(LineTrace))) {
+		fprintf(stderr, "%s: not a version %d trace file from this machine\n", path, TRACE_VERSION);
+		fclose(f);
+		return -1;
+	}
+
+	LineTrace t;
+	Summary *s = new Summary;
+	uint64_t limit = (uint64_t) stallms * 1000000;
+	uint64_t n = 0;
+	while (fread(&t, sizeof(t), 1, f) == 1) {
+		s->add(&t);
+		if (!(t.flags & TRACE_LOST) && (t.ok - t.queued > limit))
+			n++;
+	}
+	summarise(out, s);
+	delete s;
+
+	// again for the stalls, now the summary is out of the way
+	out->printf("%llu stalls over %ums\n", (unsigned long long) n, stallms);
+	fseek(f, sizeof(h), SEEK_SET);
+	while (fread(&t, sizeof(t), 1, f) == 1) {
+		if (!(t.flags & TRACE_LOST) && (t.ok - t.queued > limit))
+			stalled(out, &t, h.start);
+	}
+	fclose(f);
+	return 0;
+}
@@ -0,0 +1,102 @@
+#ifndef _TRACE_HPP
+#define _TRACE_HPP
+
+#include <cstdio>
+#include <cstdint>
+
+class Socket;
+class ArenaText;
+
+// lines remembered per printer, in flight and recently acknowledged
+#define TRACE_RING 1024
+// slowest lines kept for the stall log
+#define TRACE_STALLS 32
+// a line whose ok takes longer than this is a stall, ms
+#define TRACE_STALL_MS 1000
+
+#define TRACE_LOST  1   // never acknowledged- the printer reset or went away
+#define TRACE_STALL 2   // took longer than the stall threshold
+
+#define TRACE_MAGIC "NETRAPTR"
+#define TRACE_VERSION 1
+
+/*
+ * One line's trip to the printer and back, in monotonic nanoseconds.
+ * queued is when the line was handed to the printer, written when its
+ * last byte went to the fd, and ok when its ok came back. This is also
+ * the record format of trace files, in host byte order.
+ */
+struct LineTrace {
+	uint64_t seq;
+	uint64_t queued;
+	uint64_t written;
+	uint64_t ok;
+	uint32_t length;
+	uint32_t flags;
+	char text[32];
+};
+
+// at the start of a trace file. start is when tracing began, which
+// times in the stall log are counted from
+struct TraceHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t size;
+	uint64_t start;
+};
+
+/*
+ * Timestamps for the lines a printer has in flight. Oks come back in the
+ * order lines were sent, so the lines are kept in a ring by sequence
+ * number: sent() adds at the head, acked() takes from the tail, and the
+ * slots behind the tail are the history that percentiles come from.
+ *
+ * Bytes go through the printer's txbuf, so flushed() is told how many
+ * left it and matches them up with the lines by byte offset.
+ */
+class LineTracer {
+public:
+	LineTracer();
+	~LineTracer();
+
+	void sent(Socket *respondent, uint64_t queued, const char *line, int len);
+	void flushed(unsigned int bytes, uint64_t now);
+	const LineTrace *acked(uint64_t now);
+	void clear();
+	void forget(Socket *respondent);
+
+	// who sent the oldest line in flight, NULL if nobody or nothing is
+	Socket *front();
+	unsigned int inflight();
+	int full();
+
+	void setstall(unsigned int ms);
+	int record(const char *path);
+
+	void report(ArenaText *out);
+	static int replay(const char *path, unsigned int stallms, ArenaText *out);
+protected:
+	struct Entry {
+		LineTrace t;
+		Socket *respondent;
+		// txbuf offset just past the line
+		uint64_t end;
+	};
+	Entry ring[TRACE_RING];
+	uint64_t head;
+	uint64_t unwritten;
+	uint64_t tail;
+	uint64_t txqueued;
+	uint64_t txflushed;
+
+	LineTrace stalls[TRACE_STALLS];
+	uint64_t nstalls;
+	uint64_t stall;
+	uint64_t lost;
+	uint64_t started;
+
+	FILE *file;
+	void save(const LineTrace *t);
+};
+
+#endif /* _TRACE_HPP */
@@ -0,0 +1,125 @@
+#include "workerpool.hpp"
+
+#include <cstdio>
+
+#include "metrics.hpp"
+
+namespace C {
+	#include <unistd.h>
+	#include <fcntl.h>
+}
+
+WorkerPool *WorkerPool::instance = NULL;
+
+// counted on the worker threads, each in its own shard
+static int taskruns = Metrics::histogram("netrap_worker_task_seconds", "Time worker threads spent running each task");
+
+Task::~Task() {
+}
+
+// threads 0 means one per core
+WorkerPool::WorkerPool(int threads) {
+	stopping = 0;
+
+	if (C::pipe2(pipefd, O_NONBLOCK | O_CLOEXEC) == -1) {
+		perror("pipe2");
+		pipefd[0] = pipefd[1] = -1;
+	}
+	else {
+		selector.add(pipefd[0], this);
+	}
+
+	if (threads <= 0)
+		threads = std::thread::hardware_concurrency();
+	if (threads <= 0)
+		threads = 1;
+	for (int i = 0; i < threads; i++)
+		this->threads.push_back(std::thread(&WorkerPool::work, this));
+
+	// the first pool made is the one shared()
+	if (instance == NULL)
+		instance = this;
+}
+
+WorkerPool::~WorkerPool() {
+	{
+		std::lock_guard<std::mutex> l(lock);
+		stopping = 1;
+	}
+	wake.notify_all();
+	for (unsigned int i = 0; i < threads.size(); i++)
+		threads[i].join();
+
+	if (pipefd[0] != -1) {
+		selector.remove(pipefd[0]);
+		C::close(pipefd[0]);
+		C::close(pipefd[1]);
+	}
+	if (instance == this)
+		instance = NULL;
+}
+
+WorkerPool *WorkerPool::shared() {
+	if (instance == NULL)
+		instance = new WorkerPool();
+	return instance;
+}
+
+int WorkerPool::size() {
+	return threads.size();
+}
+
+void WorkerPool::submit(Task *task) {
+	{
+		std::lock_guard<std::mutex> l(lock);
+		queue.push_back(task);
+	}
+	wake.notify_one();
+}
+
+void WorkerPool::work() {
+	for (;;) {
+		Task *task;
+		{
+			std::unique_lock<std::mutex> l(lock);
+			while (queue.empty() && !stopping)
+				wake.wait(l);
+			if (stopping)
+				return;
+			task = queue.front();
+			queue.pop_front();
+		}
+
+		uint64_t t = Metrics::now();
+		task->run();
+		Metrics::observe(taskruns, Metrics::now() - t);
+
+		{
+			std::lock_guard<std::mutex> l(lock);
+			finished.push_back(task);
+		}
+		// a full pipe already has a wakeup in it, so EAGAIN is fine
+		char c = 0;
+		if (C::write(pipefd[1], &c, 1) == -1) {}
+	}
+}
+
+void WorkerPool::onread(struct SelectFd *selected) {
+	char buf[256];
+	while (C::read(pipefd[0], buf, sizeof(buf)) > 0);
+
+	std::list<Task *> done;
+	{
+		std::lock_guard<std::mutex> l(lock);
+		done.swap(finished);
+	}
+	std::list<Task *>::iterator i;
+	for (i = done.begin(); i != done.end(); i++)
+		(*i)->done();
+}
+
+void WorkerPool::onwrite(struct SelectFd *selected) {
+}
+
+void WorkerPool::onerror(struct SelectFd *selected) {
+}
@@ -0,0 +1,60 @@
+#ifndef _WORKERPOOL_HPP
+#define _WORKERPOOL_HPP
+
+#include <list>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "selector.hpp"
+
+/*
+ * A piece of work too slow for the event loop. run() is called on a
+ * worker thread and must not touch sockets, printers or queues; done() is
+ * called back in the event loop once run() has returned. The pool forgets
+ * the task when done() returns, so done() may delete it.
+ */
+class Task {
+public:
+	virtual ~Task();
+	virtual void run() = 0;
+	virtual void done() = 0;
+};
+
+/*
+ * Threads for Tasks. Finished tasks are handed back through a pipe which
+ * is part of the event loop like any socket, so nothing but run() ever
+ * happens off the main thread.
+ */
+class WorkerPool : public SelectorEventReceiver {
+public:
+	WorkerPool(int threads = 0);
+	~WorkerPool();
+
+	static WorkerPool *shared();
+
+	void submit(Task *task);
+	int size();
+
+protected:
+	std::vector<std::thread> threads;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::list<Task *> queue;
+	std::list<Task *> finished;
+	int stopping;
+
+	int pipefd[2];
+	Selector selector;
+
+	void work();
+
+	void onread(struct SelectFd *selected);
+	void onwrite(struct SelectFd *selected);
+	void onerror(struct SelectFd *selected);
+
+	static WorkerPool *instance;
+};
+
+#endif /* _WORKERPOOL_HPP */